@@ -18,6 +18,7 @@
 #include "http_net.h"
 #include "socket_layer.h"
 #include "error.h"
+#include "imgfs_trace.h"
 
 static int passive_socket = -1;
 static EventCallback cb;
@@ -54,6 +55,7 @@ int* read_message(int socket_ID, char* buffer, int* header_read, const int MAX_R
         }
         data_read += data_tcp_read;
         buffer_to_read += data_tcp_read;
+        *buffer_to_read = '\0'; // the buffer has one byte more than it reads
     }
     *header_read += data_read;
     return &our_ERR_NONE;
@@ -75,13 +77,17 @@ static void *handle_connection(void *arg)
 
     int header_read = 0;
     int socket_ID = *((int *) arg);
+    // One buffer for all the requests of the connection, grown for a body and
+    // shrunk back after it; one byte more than is read, for the final 0
+    char *buffer = malloc(MAX_HEADER_SIZE + 1);
+    if (buffer == NULL) {
+        perror("Allocation problem when handling connection");
+        free(arg);
+        return &our_ERR_OUT_OF_MEMORY;
+    }
+    int grown = 0;
     while (1) {
-        char *buffer = malloc(MAX_HEADER_SIZE);
-        if (buffer == NULL) {
-            perror("Allocation problem when handling connection");
-            free(arg);
-            return &our_ERR_OUT_OF_MEMORY;
-        }
+        buffer[0] = '\0'; // nothing of the previous request is read again
         int *err_read = read_message(socket_ID, buffer, &header_read, MAX_HEADER_SIZE);
         if (*err_read != our_ERR_NONE) {
             perror("Reading the message failed");
@@ -93,7 +99,9 @@ static void *handle_connection(void *arg)
 
         struct http_message message_out;
         int content_len;
+        uint64_t span_start = trace_now();
         int return_parse = http_parse_message(buffer, (size_t) header_read, &message_out, &content_len);
+        trace_span("parse", span_start);
         if (return_parse < 0) {
             perror("Parsing header message failed");
             close(socket_ID);
@@ -113,7 +121,7 @@ static void *handle_connection(void *arg)
             int body_already_read = header_read - (delim - buffer) - strlen(HTTP_HDR_END_DELIM);
 
             size_t new_size = header_read + content_len - body_already_read ;
-            char *temp = realloc(buffer, new_size);
+            char *temp = realloc(buffer, new_size + 1);
             if (temp == NULL) {
                 perror("Problem when reallocating the memory for the body of message");
                 close(socket_ID);
@@ -122,8 +130,11 @@ static void *handle_connection(void *arg)
                 return &our_ERR_IO;
             }
             buffer = temp;
+            grown = 1;
 
+            span_start = trace_now();
             int* err = read_message(socket_ID, buffer, &header_read, content_len - body_already_read);
+            trace_span("recv body", span_start);
             if (*err != our_ERR_NONE) {
                 perror("Reading the body failed");
                 close(socket_ID);
@@ -131,7 +142,9 @@ static void *handle_connection(void *arg)
                 free(arg);
                 return err;
             }
+            span_start = trace_now();
             return_parse = http_parse_message(buffer, (size_t) header_read, &message_out, &content_len);
+            trace_span("parse", span_start);
             if (return_parse < 0) {
                 perror("Parsing the whole message failed");
                 close(socket_ID);
@@ -160,7 +173,11 @@ static void *handle_connection(void *arg)
 
             content_len = 0;
             header_read = 0;
-            free(buffer);
+            if (grown) {
+                char *temp = realloc(buffer, MAX_HEADER_SIZE + 1);
+                if (temp != NULL) buffer = temp;
+                grown = 0;
+            }
         }
 
     }
@@ -283,13 +300,15 @@ int http_serve_file(int connection, const char* filename)
  */
 int http_reply(int connection, const char *status, const char *headers, const char *body, size_t body_len)
 {
-    char body_len_str[MAX_HEADER_SIZE];
+    char body_len_str[MAX_BODY_SIZE_STR + 1];
     sprintf(body_len_str, "%zu",body_len);
     size_t reply_size = strlen(HTTP_PROTOCOL_ID) + strlen(status) + strlen(headers)+
                         strlen(HTTP_LINE_DELIM) + strlen("Content-length: ")
                         + strlen(body_len_str) + strlen(HTTP_HDR_END_DELIM);
 
-    char *reply = malloc(reply_size+1);
+    // The header is built on the stack, unless the headers given are unusually long
+    char stack_reply[MAX_HEADER_SIZE];
+    char *reply = reply_size < sizeof(stack_reply) ? stack_reply : malloc(reply_size+1);
     if(reply==NULL){
         perror("Error when allocating memory reply");
         return ERR_OUT_OF_MEMORY;
@@ -297,9 +316,11 @@ int http_reply(int connection, const char *status, const char *headers, const ch
     sprintf(reply, "%s%s%s%sContent-Length: %zu%s", HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, body_len,
             HTTP_HDR_END_DELIM);
 
+    const uint64_t span_start = trace_now();
     ssize_t sending = tcp_send(connection, reply, reply_size);
     if (body_len != 0)tcp_send(connection,body,body_len);
-    free(reply);
+    trace_span("send", span_start);
+    if (reply != stack_reply) free(reply);
     reply = NULL;
     if (sending < 0)return ERR_IO;
     if(strcmp(status,HTTP_OK) !=0)return -1;
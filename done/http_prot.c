@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <string.h>
+#include <strings.h> // strncasecmp
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
@@ -80,6 +81,22 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
     return (int)real_size;
 }
 
+/*******************************************************************
+ * Finds the value of header `key` (case-insensitive) in message
+ */
+const struct http_string* http_get_header(const struct http_message* message, const char* key)
+{
+    if (message == NULL || key == NULL) return NULL;
+    const size_t key_len = strlen(key);
+    for (size_t i = 0; i < message->num_headers; ++i) {
+        const struct http_string* k = &message->headers[i].key;
+        if (k->len == key_len && strncasecmp(k->val, key, key_len) == 0) {
+            return &message->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
 static const char* get_next_token(const char* message, const char* delimiter, struct http_string* output)
 {
     char* delim_pos = strstr(message,delimiter);
@@ -136,6 +153,8 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
     stream_cpy = get_next_token(stream_cpy,HTTP_LINE_DELIM,NULL);
 
     *content_len = 0;
+    out->body.val = NULL; // no body unless a Content-Length says otherwise
+    out->body.len = 0;
     const char* stream_parse = http_parse_headers(stream_cpy,out,content_len);
     char* body = strstr(stream_parse,HTTP_LINE_DELIM);
     if(body == NULL)return 0;
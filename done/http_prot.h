@@ -68,6 +68,13 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
  */
 int http_get_var(const struct http_string* url, const char* name, char* out, size_t out_len);
 
+/**
+ * @brief Finds the value of header `key` (case-insensitive) in message.
+ *
+ * Returns the value, or NULL if the message has no such header.
+ */
+const struct http_string* http_get_header(const struct http_message* message, const char* key);
+
 /**
  * @brief Compare method with verb and return 1 if they are equal, 0 otherwise
  */
@@ -0,0 +1,359 @@
+/**
+ * @file image-bench.c
+ * @brief Benchmark of the image pipeline of imgFS.
+ *
+ * For each source image (JPEG files given on the command line, or else
+ * those of the test corpus, followed by synthetic originals of growing
+ * size), measures the per-call latency of get_resolution() ("sof", header
+ * parse) against the former libvips header load ("vips"), and, for the
+ * thumbnail and the small image, the latency of:
+ *  - "full":    full decode + vips_thumbnail_image + encode (the former
+ *               lazily_resize() path);
+ *  - "lazy":    lazily_resize() from the original (shrink-on-load);
+ *  - "cascade": lazily_resize() of the thumbnail once the small image exists.
+ * Each resize comes with the size of its output and the peak RSS of the
+ * process during it (the peak is reset before each, where the kernel
+ * allows it; otherwise it is the peak since the start).
+ *
+ * Results are printed on stdout as CSV.
+ *
+ * Usage: ./image-bench [-n RUNS] [file.jpg ...]
+ *   e.g. ./image-bench ../provided/tests/data/papillon.jpg
+ */
+
+#include "imgfs.h"
+#include "image_content.h"
+#include "util.h"
+
+#include <glob.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define BENCH_DB "image-bench.imgfs"
+#define DEFAULT_CORPUS "../provided/tests/data/*.jpg"
+#define DEFAULT_RUNS 5
+#define PROBE_CALLS 1000
+
+static const uint16_t thumb_res = 64;
+static const uint16_t small_res = 256;
+
+// synthetic originals, in megapixels (4:3)
+static const unsigned synthetic_mpix[] = { 1, 4, 12, 24 };
+
+/********************************************************************/
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec / 1e6;
+}
+
+/********************************************************************
+ * Peak RSS, in KiB: reset_peak_rss() starts a new peak when the kernel
+ * allows it (Linux >= 4.0, through clear_refs).
+ */
+static void reset_peak_rss(void)
+{
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (file == NULL) return;
+    fputs("5", file);
+    fclose(file);
+}
+
+static long peak_rss_kib(void)
+{
+    long peak = -1;
+    FILE* file = fopen("/proc/self/status", "r");
+    if (file != NULL) {
+        char line[128];
+        while (peak < 0 && fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "VmHWM: %ld kB", &peak) != 1) peak = -1;
+        }
+        fclose(file);
+    }
+    if (peak < 0) {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) peak = usage.ru_maxrss;
+    }
+    return peak;
+}
+
+/********************************************************************
+ * Reads a whole file into a newly allocated buffer.
+ */
+static int read_whole_file(const char* path, char** buffer, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return ERR_IO;
+    fseek(file, 0, SEEK_END);
+    const long pos = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (pos <= 0) {
+        fclose(file);
+        return ERR_IO;
+    }
+    *buffer = malloc((size_t) pos);
+    if (*buffer == NULL) {
+        fclose(file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (fread(*buffer, (size_t) pos, 1, file) != 1) {
+        free(*buffer);
+        fclose(file);
+        return ERR_IO;
+    }
+    fclose(file);
+    *size = (size_t) pos;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Creates a noisy RGB JPEG of the given size.
+ */
+static int make_synthetic(unsigned width, unsigned height, char** buffer, size_t* size)
+{
+    VipsImage* noise = NULL;
+    VipsImage* gray = NULL;
+    VipsImage* rg = NULL;
+    VipsImage* rgb = NULL;
+    int err = vips_gaussnoise(&noise, (int) width, (int) height, NULL)
+              || vips_cast_uchar(noise, &gray, NULL)
+              || vips_bandjoin2(gray, gray, &rg, NULL)
+              || vips_bandjoin2(rg, gray, &rgb, NULL)
+              || vips_jpegsave_buffer(rgb, (void**) buffer, size, "Q", 85, NULL);
+    if (rgb != NULL) g_object_unref(rgb);
+    if (rg != NULL) g_object_unref(rg);
+    if (gray != NULL) g_object_unref(gray);
+    if (noise != NULL) g_object_unref(noise);
+    return err ? ERR_IMGLIB : ERR_NONE;
+}
+
+/********************************************************************
+ * Former lazily_resize() path: full decode, then resize.
+ */
+static int full_decode_resize(const char* buffer, size_t size, int width, size_t* out_bytes)
+{
+    VipsImage* image = NULL;
+    VipsImage* resized = NULL;
+    void* out = NULL;
+    size_t out_size = 0;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_jpegload_buffer((void*) buffer, size, &image, NULL) != 0) return ERR_IMGLIB;
+#pragma GCC diagnostic pop
+    int err = vips_thumbnail_image(image, &resized, width, "height", width, NULL)
+              || vips_jpegsave_buffer(resized, &out, &out_size, NULL);
+    *out_bytes = out_size;
+    g_free(out);
+    if (resized != NULL) g_object_unref(resized);
+    g_object_unref(image);
+    return err ? ERR_IMGLIB : ERR_NONE;
+}
+
+/********************************************************************
+ * Former get_resolution() path: libvips header load.
+ */
+static int vips_resolution(uint32_t* height, uint32_t* width, const char* buffer, size_t size)
+{
+    VipsImage* image = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_jpegload_buffer((void*) buffer, size, &image, NULL) != 0) return ERR_IMGLIB;
+#pragma GCC diagnostic pop
+    *height = (uint32_t) vips_image_get_height(image);
+    *width = (uint32_t) vips_image_get_width(image);
+    g_object_unref(image);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Per-call latency of both ways to get the dimensions of one image.
+ */
+static int bench_probe(const char* name, const char* buffer, size_t size, int runs)
+{
+    uint32_t width = 0, height = 0;
+    int err = ERR_NONE;
+    for (int run = 0; run < runs && err == ERR_NONE; ++run) {
+        double start = now_ms();
+        for (int i = 0; i < PROBE_CALLS && err == ERR_NONE; ++i) {
+            err = get_resolution(&height, &width, buffer, size);
+        }
+        printf("probe,%s,%u,%u,%zu,sof,-,%.6f,-,-\n", name, width, height, size, (now_ms() - start) / PROBE_CALLS);
+
+        start = now_ms();
+        for (int i = 0; i < PROBE_CALLS && err == ERR_NONE; ++i) {
+            err = vips_resolution(&height, &width, buffer, size);
+        }
+        printf("probe,%s,%u,%u,%zu,vips,-,%.6f,-,-\n", name, width, height, size, (now_ms() - start) / PROBE_CALLS);
+    }
+    return err;
+}
+
+/********************************************************************
+ * Fresh single-image imgFS holding the given original.
+ */
+static int open_bench_db(const char* buffer, size_t size, struct imgfs_file* file)
+{
+    zero_init_ptr(file);
+    file->header.max_files = 1;
+    file->header.resized_res[0] = file->header.resized_res[1] = thumb_res;
+    file->header.resized_res[2] = file->header.resized_res[3] = small_res;
+    int err = do_create(BENCH_DB, file);
+    if (err != ERR_NONE) return err;
+    do_close(file);
+
+    err = do_open(BENCH_DB, "rb+", file);
+    if (err != ERR_NONE) return err;
+    err = do_insert(buffer, size, "bench", file);
+    if (err != ERR_NONE) do_close(file);
+    return err;
+}
+
+/********************************************************************
+ * Measures of one resize.
+ */
+struct resize_stats {
+    double ms;
+    size_t out_bytes;
+    long peak_rss_kib;
+};
+
+static void print_resize(const char* name, uint32_t width, uint32_t height, size_t size,
+                         const char* path, const char* resolution, const struct resize_stats* stats)
+{
+    printf("resize,%s,%u,%u,%zu,%s,%s,%.3f,%zu,%ld\n", name, width, height, size, path, resolution,
+           stats->ms, stats->out_bytes, stats->peak_rss_kib);
+}
+
+/********************************************************************
+ * Times one full decode, resize and encode.
+ */
+static int time_full(const char* buffer, size_t size, int width, struct resize_stats* stats)
+{
+    reset_peak_rss();
+    const double start = now_ms();
+    const int err = full_decode_resize(buffer, size, width, &stats->out_bytes);
+    stats->ms = now_ms() - start;
+    stats->peak_rss_kib = peak_rss_kib();
+    return err;
+}
+
+/********************************************************************
+ * Times one lazily_resize() from a fresh store; if `with_small` the
+ * small image is made first (untimed) so that the thumbnail cascades.
+ */
+static int time_lazy(const char* buffer, size_t size, int resolution, int with_small, struct resize_stats* stats)
+{
+    struct imgfs_file file;
+    int err = open_bench_db(buffer, size, &file);
+    if (err != ERR_NONE) return err;
+    if (with_small) err = lazily_resize(SMALL_RES, &file, 0);
+    if (err == ERR_NONE) {
+        reset_peak_rss();
+        const double start = now_ms();
+        err = lazily_resize(resolution, &file, 0);
+        stats->ms = now_ms() - start;
+        stats->peak_rss_kib = peak_rss_kib();
+        stats->out_bytes = file.metadata[0].size[resolution];
+    }
+    do_close(&file);
+    return err;
+}
+
+/********************************************************************
+ * Resize latency of one source image, `runs` times each.
+ */
+static int bench_resize(const char* name, const char* buffer, size_t size, int runs)
+{
+    uint32_t width = 0, height = 0;
+    int err = get_resolution(&height, &width, buffer, size);
+    if (err != ERR_NONE) return err;
+
+    for (int run = 0; run < runs && err == ERR_NONE; ++run) {
+        struct resize_stats stats = { 0, 0, 0 };
+        err = time_full(buffer, size, thumb_res, &stats);
+        if (err == ERR_NONE) print_resize(name, width, height, size, "full", "thumb", &stats);
+        if (err == ERR_NONE) err = time_full(buffer, size, small_res, &stats);
+        if (err == ERR_NONE) print_resize(name, width, height, size, "full", "small", &stats);
+        if (err == ERR_NONE) err = time_lazy(buffer, size, THUMB_RES, 0, &stats);
+        if (err == ERR_NONE) print_resize(name, width, height, size, "lazy", "thumb", &stats);
+        if (err == ERR_NONE) err = time_lazy(buffer, size, SMALL_RES, 0, &stats);
+        if (err == ERR_NONE) print_resize(name, width, height, size, "lazy", "small", &stats);
+        if (err == ERR_NONE) err = time_lazy(buffer, size, THUMB_RES, 1, &stats);
+        if (err == ERR_NONE) print_resize(name, width, height, size, "cascade", "thumb", &stats);
+    }
+    return err;
+}
+
+/********************************************************************
+ * Probe and resizes of one JPEG file.
+ */
+static int bench_file(const char* path, int runs)
+{
+    char* buffer = NULL;
+    size_t size = 0;
+    int err = read_whole_file(path, &buffer, &size);
+    if (err == ERR_NONE) err = bench_probe(path, buffer, size, runs);
+    if (err == ERR_NONE) err = bench_resize(path, buffer, size, runs);
+    free(buffer);
+    return err;
+}
+
+/********************************************************************/
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0]) != 0) return ERR_IMGLIB;
+
+    int runs = DEFAULT_RUNS;
+    argc--;
+    argv++;
+    if (argc >= 2 && strcmp(argv[0], "-n") == 0) {
+        runs = (int) atouint16(argv[1]);
+        if (runs == 0) runs = DEFAULT_RUNS;
+        argc -= 2;
+        argv += 2;
+    }
+
+    printf("bench,source,width,height,bytes,path,resolution,ms,out_bytes,peak_rss_kib\n");
+    int err = ERR_NONE;
+    if (argc > 0) {
+        for (int i = 0; i < argc && err == ERR_NONE; ++i) {
+            err = bench_file(argv[i], runs);
+        }
+    } else {
+        glob_t corpus;
+        if (glob(DEFAULT_CORPUS, 0, NULL, &corpus) == 0) {
+            for (size_t i = 0; i < corpus.gl_pathc && err == ERR_NONE; ++i) {
+                err = bench_file(corpus.gl_pathv[i], runs);
+            }
+            globfree(&corpus);
+        }
+    }
+
+    const size_t nb_synthetic = sizeof(synthetic_mpix) / sizeof(synthetic_mpix[0]);
+    for (size_t i = 0; i < nb_synthetic && err == ERR_NONE; ++i) {
+        // 4:3 image of synthetic_mpix[i] megapixels
+        const double side = sqrt(synthetic_mpix[i] * 1e6 * 4 / 3);
+        const unsigned width = (unsigned) side;
+        const unsigned height = width * 3 / 4;
+        char name[32];
+        snprintf(name, sizeof(name), "synthetic-%uMP", synthetic_mpix[i]);
+        char* buffer = NULL;
+        size_t size = 0;
+        err = make_synthetic(width, height, &buffer, &size);
+        if (err == ERR_NONE) err = bench_probe(name, buffer, size, runs);
+        if (err == ERR_NONE) err = bench_resize(name, buffer, size, runs);
+        g_free(buffer);
+    }
+
+    unlink(BENCH_DB);
+    if (err != ERR_NONE) fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+    vips_shutdown();
+    return err;
+}
@@ -1,11 +1,176 @@
 #include "imgfs.h"
 #include "error.h"
 #include "util.h"   // for _unused
+#include "resize_pool.h"
+#include "imgfs_alloc.h"
+#include "imgfs_commit.h"
+#include "imgfs_metrics.h"
+#include "imgfs_trace.h"
+#include "imgfs_slowlog.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <vips/vips.h>
 
+/********************************************************************/
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*******************************************************************
+ * libvips part of a resize, run by the resize pool
+ */
+struct resize_args {
+    const char* src_buf;
+    size_t src_size;
+    int width;
+    int height;
+    int encoding;
+    char* output_buffer;
+    size_t output_size;
+};
+
+static int create_resized_img(void* arg)
+{
+    struct resize_args* args = arg;
+
+    //Load and resize in one go, so that libjpeg can shrink-on-load
+    //instead of decoding the source at full resolution (the thumbnail
+    //operation loads with sequential access: the source is streamed
+    //through the resize, never held whole in memory)
+    VipsImage *image_resize = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    int err_vips = vips_thumbnail_buffer((void*) args->src_buf, args->src_size, &image_resize, args->width,
+                                         "height", args->height, NULL);
+#pragma GCC diagnostic pop
+    if (err_vips != 0) {
+        return ERR_IMGLIB;
+    }
+
+    //Save the image and it's size in corresponding variables
+    void** output = (void**) &args->output_buffer;
+    switch (args->encoding) {
+    case ENC_WEBP:
+        err_vips = vips_webpsave_buffer(image_resize, output, &args->output_size, NULL);
+        break;
+    case ENC_AVIF:
+        err_vips = vips_heifsave_buffer(image_resize, output, &args->output_size,
+                                        "compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1, NULL);
+        break;
+    default:
+        err_vips = vips_jpegsave_buffer(image_resize, output, &args->output_size, NULL);
+        break;
+    }
+    g_object_unref(VIPS_OBJECT(image_resize));
+    image_resize = NULL;
+    if (err_vips!=0) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * memory of the decoded source: libjpeg shrinks on load by the largest
+ * of 1, 2, 4 or 8 that keeps the image at least as big as the target
+ */
+static size_t decoded_size(uint32_t width, uint32_t height, int target_width, int target_height)
+{
+    uint32_t shrink = 1;
+    while (shrink < 8 && width / (shrink * 2) >= (uint32_t) target_width
+           && height / (shrink * 2) >= (uint32_t) target_height) {
+        shrink *= 2;
+    }
+    return (size_t) (width / shrink + 1) * (height / shrink + 1) * 3;
+}
+
+/*******************************************************************
+ * pick the smallest stored resolution that is big enough for the
+ * requested box (e.g. the thumbnail can be derived from the small image)
+ */
+static int resize_source(const struct imgfs_file* imgfs_file, size_t index, uint16_t width, uint16_t height)
+{
+    const struct img_metadata* meta = &imgfs_file->metadata[index];
+    const uint16_t* res = imgfs_file->header.resized_res;
+    for (int src = THUMB_RES; src < ORIG_RES; ++src) {
+        if (meta->size[src] != 0 && meta->offset[src] != 0
+            && res[2 * src] >= width && res[2 * src + 1] >= height) {
+            return src;
+        }
+    }
+    return ORIG_RES;
+}
+
+/*******************************************************************
+ * resize from the best stored source
+ */
+int resize_from_store(struct imgfs_file* imgfs_file, size_t index, uint16_t width, uint16_t height,
+                      int encoding, char** output_buffer, size_t* output_size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(output_buffer);
+    M_REQUIRE_NON_NULL(output_size);
+    if (index >= imgfs_file->header.max_files || imgfs_file->metadata[index].is_valid == EMPTY) {
+        return ERR_INVALID_IMGID;
+    }
+    if (encoding < 0 || encoding >= NB_ENCODINGS || width == 0 || height == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    //Prepare the buffer that contains the source image
+    const int src = resize_source(imgfs_file, index, width, height);
+    char* src_buf = malloc(imgfs_file->metadata[index].size[src]);
+    if (src_buf == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (read_data(imgfs_file, imgfs_file->metadata[index].offset[src],
+                  imgfs_file->metadata[index].size[src], src_buf) != ERR_NONE) {
+        free(src_buf);
+        return ERR_IO;
+    }
+
+    //Decode, resize and encode on the resize pool
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    memcpy(sha, imgfs_file->metadata[index].SHA, SHA256_DIGEST_LENGTH);
+    struct resize_args args = { src_buf, imgfs_file->metadata[index].size[src],
+                                width, height, encoding, NULL, 0
+                              };
+    const size_t mem_estimate = src == ORIG_RES
+                                ? decoded_size(imgfs_file->metadata[index].orig_res[0],
+                                               imgfs_file->metadata[index].orig_res[1], width, height)
+                                : decoded_size(imgfs_file->header.resized_res[2 * src],
+                                               imgfs_file->header.resized_res[2 * src + 1], width, height);
+    const double start = now_seconds();
+    const uint64_t span_start = trace_now();
+    int err = resize_pool_run(create_resized_img, &args, mem_estimate + args.src_size);
+    trace_span("resize", span_start);
+    const double resize_seconds = now_seconds() - start;
+    metrics_resize(resize_seconds);
+    slowlog_resize(resize_seconds);
+    free(src_buf);
+    src_buf = NULL;
+    if (err != ERR_NONE) {
+        return err;
+    }
+
+    //The caller's lock may have been released while waiting: the slot may have been deleted or reused
+    if (imgfs_file->metadata[index].is_valid == EMPTY
+        || memcmp(imgfs_file->metadata[index].SHA, sha, SHA256_DIGEST_LENGTH) != 0) {
+        free(args.output_buffer);
+        return ERR_INVALID_IMGID;
+    }
+
+    *output_buffer = args.output_buffer;
+    *output_size = args.output_size;
+    return ERR_NONE;
+}
+
 /*******************************************************************
  * resize Image
  */
@@ -31,73 +196,82 @@ int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
         return ERR_NONE;
     }
 
-
-    //Prepare the output_buffer that contain original image
-    char* orig_buf = malloc(imgfs_file->metadata[index].size[ORIG_RES]);
-    if (orig_buf == NULL) {
-        return ERR_IO;
-    }
-    if(fseek(imgfs_file->file, (long) imgfs_file->metadata[index].offset[ORIG_RES], SEEK_SET)!=0) {
-        return ERR_IO;
-    }
-    if (fread(orig_buf,imgfs_file->metadata[index].size[ORIG_RES],1,imgfs_file->file) !=1) {
-        return ERR_IO;
-    }
-
-    //Load original image
-    VipsImage *image_initial = NULL;
-    int err_vips = vips_jpegload_buffer(orig_buf, imgfs_file->metadata[index].size[ORIG_RES], &image_initial, NULL);
-    if (err_vips != 0) {
-        return ERR_IMGLIB;
+    char* output_buffer = NULL;
+    size_t output_size = 0;
+    int err = resize_from_store(imgfs_file, index, imgfs_file->header.resized_res[2 * resolution],
+                                imgfs_file->header.resized_res[2 * resolution + 1], ENC_JPEG,
+                                &output_buffer, &output_size);
+    if (err != ERR_NONE) {
+        return err;
     }
 
-    //Resize the image
-    VipsImage *image_resize = NULL;
-    if (vips_thumbnail_image(image_initial, &image_resize, imgfs_file->header.resized_res[2 * resolution],NULL) != 0) {
-        free(orig_buf);
-        g_object_unref(VIPS_OBJECT(image_initial));
-        image_initial = NULL;
-        return ERR_IO;
-    }
-
-    //Save the image and it's size in corresponding variables
-    size_t size_thumb;
-    char *output_buffer = NULL;
-    err_vips = vips_jpegsave_buffer(image_resize, &output_buffer, &size_thumb, NULL);
-    free(orig_buf);
-    g_object_unref(VIPS_OBJECT(image_initial));
-    image_initial = NULL;
-    g_object_unref(VIPS_OBJECT(image_resize));
-    image_resize = NULL;
-    if (err_vips!=0) {
-        return ERR_IO;
+    //Another request may have created the same resolution meanwhile
+    if (imgfs_file->metadata[index].size[resolution] != 0) {
+        free(output_buffer);
+        return ERR_NONE;
     }
 
-    //write the copy of image at the end of file
-    fseek(imgfs_file->file, 0, SEEK_END);
-    uint64_t new_offset = (uint64_t) ftell(imgfs_file->file);
-    int check_write = (int) fwrite(output_buffer, size_thumb, 1, imgfs_file->file);
+    //write the copy of image with the other derived images
+    uint64_t new_offset = 0;
+    err = append_derived(imgfs_file, output_buffer, output_size, &new_offset);
     free(output_buffer);
     output_buffer = NULL;
-    if (check_write!=1) {
-        return ERR_IO;
+    if (err != ERR_NONE) {
+        return err;
     }
 
     //Update metadata in struct
-    imgfs_file->metadata[index].size[resolution] = (uint32_t) size_thumb;
+    imgfs_file->metadata[index].size[resolution] = (uint32_t) output_size;
     imgfs_file->metadata[index].offset[resolution] = new_offset;
 
-    //Update metadata on disk
-    if(fseek(imgfs_file->file, (long) (sizeof(imgfs_file->header) + index * sizeof(struct img_metadata)), SEEK_SET)!=0) {
-        return ERR_IO;
-    }
-    if (fwrite(&imgfs_file->metadata[index], sizeof(struct img_metadata), 1, imgfs_file->file) !=1) {
-        return ERR_IO;
-    }
-    return ERR_NONE;
+    //Update metadata on disk (a derived image needs no sync of its own: it
+    //goes with the next commit, and is made again if lost)
+    return mark_metadata_dirty(imgfs_file, index);
 }
 
 
+/*******************************************************************
+ * read the dimensions from the JPEG start-of-frame marker, without
+ * decoding anything; returns ERR_IMGLIB if they cannot be found there
+ */
+static int jpeg_sof_resolution(uint32_t *height, uint32_t *width,
+                               const unsigned char *buf, size_t size)
+{
+    if (size < 4 || buf[0] != 0xFF || buf[1] != 0xD8) return ERR_IMGLIB;
+
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (buf[pos] != 0xFF) return ERR_IMGLIB;
+        const unsigned char marker = buf[pos + 1];
+        if (marker == 0xFF) { // fill byte
+            ++pos;
+            continue;
+        }
+        pos += 2;
+        // markers without payload
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;
+        // end of image or start of scan: no frame header before the data
+        if (marker == 0xD9 || marker == 0xDA) return ERR_IMGLIB;
+
+        const size_t length = (size_t) buf[pos] << 8 | buf[pos + 1];
+        if (length < 2 || pos + length > size) return ERR_IMGLIB;
+
+        // SOF0..SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+        if (marker >= 0xC0 && marker <= 0xCF
+            && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            if (length < 7) return ERR_IMGLIB;
+            const uint32_t h = (uint32_t) buf[pos + 3] << 8 | buf[pos + 4];
+            const uint32_t w = (uint32_t) buf[pos + 5] << 8 | buf[pos + 6];
+            if (h == 0 || w == 0) return ERR_IMGLIB; // height given later by a DNL marker
+            *height = h;
+            *width = w;
+            return ERR_NONE;
+        }
+        pos += length;
+    }
+    return ERR_IMGLIB;
+}
+
 /*******************************************************************
  * retrieve resolution
  */
@@ -108,11 +282,16 @@ int get_resolution(uint32_t *height, uint32_t *width,
     M_REQUIRE_NON_NULL(width);
     M_REQUIRE_NON_NULL(image_buffer);
 
+    if (jpeg_sof_resolution(height, width, (const unsigned char*) image_buffer, image_size) == ERR_NONE) {
+        return ERR_NONE;
+    }
+
+    // Unusual stream: let libvips have a go
     VipsImage* original = NULL;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-qual"
     const int err = vips_jpegload_buffer((void*) image_buffer, image_size,
-                                         &original, NULL);
+                                         &original, "access", VIPS_ACCESS_SEQUENTIAL, NULL);
 #pragma GCC diagnostic pop
     if (err != ERR_NONE) return ERR_IMGLIB;
 
@@ -122,3 +301,20 @@ int get_resolution(uint32_t *height, uint32_t *width,
     g_object_unref(VIPS_OBJECT(original));
     return ERR_NONE;
 }
+
+/*******************************************************************
+ * Memory of libvips
+ */
+void image_print_metrics(FILE* out)
+{
+    if (out == NULL) return;
+    fprintf(out, "# HELP imgfs_vips_memory_bytes Memory libvips has allocated for pixels.\n"
+            "# TYPE imgfs_vips_memory_bytes gauge\nimgfs_vips_memory_bytes %zu\n", vips_tracked_get_mem());
+    fprintf(out, "# HELP imgfs_vips_memory_highwater_bytes Most memory libvips has had allocated for pixels at once.\n"
+            "# TYPE imgfs_vips_memory_highwater_bytes gauge\nimgfs_vips_memory_highwater_bytes %zu\n",
+            vips_tracked_get_mem_highwater());
+    fprintf(out, "# HELP imgfs_vips_allocations Pixel buffers libvips has allocated.\n"
+            "# TYPE imgfs_vips_allocations gauge\nimgfs_vips_allocations %d\n", vips_tracked_get_allocs());
+    fprintf(out, "# HELP imgfs_vips_open_files Files libvips has open.\n"
+            "# TYPE imgfs_vips_open_files gauge\nimgfs_vips_open_files %d\n", vips_tracked_get_files());
+}
@@ -36,6 +36,29 @@ int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
  */
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index);
 
+/**
+ * @brief Creates a resized copy of an image, from the smallest stored
+ *        resolution that is big enough, without storing it.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param width, height The box the result must fit in
+ * @param encoding One of the ENC_ codes
+ * @param output_buffer Where to put the newly allocated result
+ * @param output_size Where to put its size
+ * @return Some error code. 0 if no error.
+ */
+int resize_from_store(struct imgfs_file* imgfs_file, size_t index, uint16_t width, uint16_t height,
+                      int encoding, char** output_buffer, size_t* output_size);
+
+/**
+ * @brief Prints, in the Prometheus text format, the memory libvips tracks:
+ *        in use, its high-water mark, allocations and open files.
+ *
+ * @param out Where to print
+ */
+void image_print_metrics(FILE* out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,273 @@
+/**
+ * @file image_variant.c
+ * @brief Derived images in other encodings than the preset JPEG resolutions.
+ */
+
+#include "imgfs.h"
+#include "error.h"
+#include "image_content.h"
+#include "image_variant.h"
+#include "imgfs_alloc.h"
+#include "imgfs_commit.h"
+#include "imgfs_metrics.h"
+
+#include <openssl/sha.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ZERO_CHUNK 65536
+
+/*******************************************************************
+ * append zeros at the end of the data, returns where they start
+ */
+static int append_zeros(struct imgfs_file* imgfs_file, size_t count, uint64_t* offset)
+{
+    int err = alloc_data(imgfs_file, count, offset);
+    if (err != ERR_NONE) return err;
+    FILE* file = imgfs_file->file;
+    if (fseek(file, (long) *offset, SEEK_SET) != 0) return ERR_IO;
+
+    char* zeros = calloc(1, ZERO_CHUNK);
+    if (zeros == NULL) return ERR_OUT_OF_MEMORY;
+    while (count > 0) {
+        const size_t chunk = count < ZERO_CHUNK ? count : ZERO_CHUNK;
+        if (fwrite(zeros, chunk, 1, file) != 1) {
+            free(zeros);
+            return ERR_IO;
+        }
+        count -= chunk;
+    }
+    free(zeros);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * read the variant table of a slot; `table_offset` is 0 if it has none.
+ * A stale table (from a deleted image) is returned cleared.
+ */
+static int read_table(const struct imgfs_file* imgfs_file, const struct imgfs_ext* ext, size_t index,
+                      uint64_t* table_offset, struct img_variant_table* table)
+{
+    memset(table, 0, sizeof(*table));
+    *table_offset = 0;
+    if (ext->variant_index != 0) {
+        if (fseek(imgfs_file->file, (long) (ext->variant_index + index * sizeof(uint64_t)), SEEK_SET) != 0
+            || fread(table_offset, sizeof(uint64_t), 1, imgfs_file->file) != 1) {
+            return ERR_IO;
+        }
+    }
+    if (*table_offset != 0) {
+        if (fseek(imgfs_file->file, (long) *table_offset, SEEK_SET) != 0
+            || fread(table, sizeof(*table), 1, imgfs_file->file) != 1) {
+            return ERR_IO;
+        }
+    }
+    if (memcmp(table->SHA, imgfs_file->metadata[index].SHA, SHA256_DIGEST_LENGTH) != 0) {
+        memset(table, 0, sizeof(*table));
+        memcpy(table->SHA, imgfs_file->metadata[index].SHA, SHA256_DIGEST_LENGTH);
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * position of a variant in its table, -1 if absent
+ */
+static int find_variant(const struct img_variant_table* table, uint16_t width, uint16_t height, int encoding)
+{
+    for (int i = 0; i < MAX_VARIANTS; ++i) {
+        const struct img_variant* v = &table->variants[i];
+        if (v->is_valid == NON_EMPTY && v->width == width && v->height == height && v->encoding == encoding) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*******************************************************************
+ * first bytes of the SHA-256 of a variant, never 0 (which stands for none)
+ */
+static uint32_t content_check(const char* content, size_t size)
+{
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*) content, size, sha);
+    uint32_t check = 0;
+    memcpy(&check, sha, sizeof(check));
+    return check != 0 ? check : 1;
+}
+
+/*******************************************************************
+ * write a table over its previous version; it goes with the next commit
+ */
+static int write_table(struct imgfs_file* imgfs_file, uint64_t table_offset, const struct img_variant_table* table)
+{
+    if (fseek(imgfs_file->file, (long) table_offset, SEEK_SET) != 0
+        || fwrite(table, sizeof(*table), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    mark_data_dirty(imgfs_file);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * position of a free entry of a table, -1 if full
+ */
+static int free_variant(const struct img_variant_table* table)
+{
+    for (int i = 0; i < MAX_VARIANTS; ++i) {
+        if (table->variants[i].is_valid == EMPTY) return i;
+    }
+    return -1;
+}
+
+/*******************************************************************
+ * make the table of a slot list a stored variant. The commit may have
+ * released the caller lock, so the table is read again: another request
+ * may have stored the same variant, or given the slot a table, meanwhile.
+ */
+static int link_variant(struct imgfs_file* imgfs_file, size_t index, uint64_t new_table,
+                        const struct img_variant* variant)
+{
+    struct imgfs_ext ext;
+    int err = read_ext(imgfs_file, &ext);
+    if (err != ERR_NONE) return err;
+
+    uint64_t table_offset = 0;
+    struct img_variant_table table;
+    err = read_table(imgfs_file, &ext, index, &table_offset, &table);
+    if (err != ERR_NONE) return err;
+    if (find_variant(&table, variant->width, variant->height, variant->encoding) >= 0) return ERR_NONE;
+
+    if (table_offset != 0) {
+        const int free_entry = free_variant(&table);
+        if (free_entry < 0) return ERR_NONE; // filled meanwhile: served, not stored
+        table.variants[free_entry] = *variant;
+        return write_table(imgfs_file, table_offset, &table);
+    }
+
+    // The new table already lists the variant
+    if (new_table == 0) return ERR_NONE;
+    if (fseek(imgfs_file->file, (long) (ext.variant_index + index * sizeof(uint64_t)), SEEK_SET) != 0
+        || fwrite(&new_table, sizeof(uint64_t), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    mark_data_dirty(imgfs_file);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * store a newly created variant, if its table has room
+ */
+static int store_variant(struct imgfs_file* imgfs_file, size_t index, uint16_t width, uint16_t height,
+                         int encoding, const char* buffer, size_t size)
+{
+    struct imgfs_ext ext;
+    int err = read_ext(imgfs_file, &ext);
+    if (err != ERR_NONE) return err;
+
+    uint64_t table_offset = 0;
+    struct img_variant_table table;
+    err = read_table(imgfs_file, &ext, index, &table_offset, &table);
+    if (err != ERR_NONE) return err;
+
+    // Another request may have stored it meanwhile
+    if (find_variant(&table, width, height, encoding) >= 0) return ERR_NONE;
+
+    const int free_entry = free_variant(&table);
+    if (free_entry < 0) return ERR_NONE; // table full: served, not stored
+
+    if (ext.variant_index == 0) {
+        uint64_t variant_index = 0;
+        err = append_zeros(imgfs_file, imgfs_file->header.max_files * sizeof(uint64_t), &variant_index);
+        if (err != ERR_NONE) return err;
+        //The allocation may have changed the extension block
+        err = read_ext(imgfs_file, &ext);
+        if (err != ERR_NONE) return err;
+        ext.variant_index = variant_index;
+        err = write_ext(imgfs_file, &ext);
+        if (err != ERR_NONE) return err;
+    }
+
+    struct img_variant variant;
+    memset(&variant, 0, sizeof(variant));
+    variant.width = width;
+    variant.height = height;
+    variant.encoding = (uint16_t) encoding;
+    variant.is_valid = NON_EMPTY;
+    variant.size = (uint32_t) size;
+    variant.check = content_check(buffer, size);
+    err = append_derived(imgfs_file, buffer, size, &variant.offset);
+    if (err != ERR_NONE) return err;
+
+    uint64_t new_table = 0;
+    if (table_offset == 0) {
+        table.variants[free_entry] = variant;
+        err = append_data(imgfs_file, &table, sizeof(table), &new_table);
+        if (err != ERR_NONE) return err;
+    }
+
+    // What was appended, and the extension block placing it, are durable
+    // before a table points to it
+    err = commit_changes(imgfs_file);
+    if (err != ERR_NONE) return err;
+    return link_variant(imgfs_file, index, new_table, &variant);
+}
+
+/*******************************************************************
+ * read (or create) a variant
+ */
+int read_variant(struct imgfs_file* imgfs_file, size_t index, uint16_t width, uint16_t height,
+                 int encoding, struct read_buffer* buffer, uint32_t* image_size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    if (index >= imgfs_file->header.max_files || imgfs_file->metadata[index].is_valid == EMPTY) {
+        return ERR_INVALID_IMGID;
+    }
+
+    struct imgfs_ext ext;
+    int err = read_ext(imgfs_file, &ext);
+    if (err != ERR_NONE) return err;
+
+    uint64_t table_offset = 0;
+    struct img_variant_table table;
+    err = read_table(imgfs_file, &ext, index, &table_offset, &table);
+    if (err != ERR_NONE) return err;
+
+    const int found = find_variant(&table, width, height, encoding);
+    if (found >= 0) {
+        struct img_variant* v = &table.variants[found];
+        err = read_buffer_reserve(buffer, v->size);
+        if (err != ERR_NONE) return err;
+        if (read_data(imgfs_file, v->offset, v->size, buffer->data) != ERR_NONE) return ERR_IO;
+        if (v->check == 0 || content_check(buffer->data, v->size) == v->check) {
+            metrics_cache(1);
+            *image_size = v->size;
+            return ERR_NONE;
+        }
+        // Lost in a crash: made again below
+        v->is_valid = EMPTY;
+        err = write_table(imgfs_file, table_offset, &table);
+        if (err != ERR_NONE) return err;
+    }
+    metrics_cache(0);
+
+    char* output = NULL;
+    size_t output_size = 0;
+    err = resize_from_store(imgfs_file, index, width, height, encoding, &output, &output_size);
+    if (err != ERR_NONE) return err;
+
+    err = store_variant(imgfs_file, index, width, height, encoding, output, output_size);
+    if (err != ERR_NONE) {
+        free(output);
+        return err;
+    }
+    // The new image becomes the buffer
+    free(buffer->data);
+    buffer->data = output;
+    buffer->capacity = output_size;
+    *image_size = (uint32_t) output_size;
+    return ERR_NONE;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file image_variant.h
+ * @brief Derived images in other encodings than the preset JPEG resolutions.
+ *
+ * The variants of an image are listed in a struct img_variant_table,
+ * appended to the file on first use and found through the variant index of
+ * the extension block (one table offset per metadata slot). A table whose
+ * SHA differs from the one of its slot belongs to a deleted image and is
+ * recycled.
+ *
+ * A variant is committed (see imgfs_commit.h) before its table points to
+ * it, and its content is checked against the start of its SHA-256 when
+ * read: a variant lost in a crash is made again instead of served.
+ */
+
+#pragma once
+
+#include "imgfs.h"  // for struct imgfs_file
+
+#include <stdint.h> // for uint16_t, uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Reads a variant of an image, creating and storing it if needed.
+ *
+ * If the table of the image is full, the variant is still created and
+ * returned, but not stored.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param width, height The box the variant fits in
+ * @param encoding One of the ENC_ codes
+ * @param buffer The buffer the variant content is read into (see do_read_into)
+ * @param image_size Location of the variant size variable
+ * @return Some error code. 0 if no error.
+ */
+int read_variant(struct imgfs_file* imgfs_file, size_t index, uint16_t width, uint16_t height,
+                 int encoding, struct read_buffer* buffer, uint32_t* image_size);
+
+#ifdef __cplusplus
+}
+#endif
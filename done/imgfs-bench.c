@@ -0,0 +1,434 @@
+/**
+ * @file imgfs-bench.c
+ * @brief Benchmark of the imgFS core library.
+ *
+ * Measures the insert throughput of each commit mode (see imgfs_commit.h):
+ * THREADS threads insert distinct copies of one JPEG into a fresh imgFS,
+ * one at a time under a shared lock as the server does, until INSERTS
+ * images are in. The time includes do_close(), i.e. the last sync of the
+ * modes that defer it.
+ *
+ * With -core, times instead the operations of the core library, one
+ * thread, on stores of each max_files of MAX_LIST filled to each
+ * percentage of FILL_LIST: do_insert (filling the store), the
+ * deduplication scan, do_read of originals, of thumbnails still to make
+ * (uncached) and already made (cached), do_list (JSON), do_open and
+ * do_delete. Each read, scan and delete figure is over CORE_SAMPLES
+ * images spread over the store. Cached thumbnails are read both with
+ * do_read (a new buffer each) and with do_read_into (one buffer reused).
+ * Each figure comes with the heap allocations per operation, and their
+ * bytes (see imgfs_heap.h).
+ *
+ * Results are printed on stdout as CSV.
+ *
+ * Usage: ./imgfs-bench [-n INSERTS] [-t THREADS] [file.jpg]
+ *        ./imgfs-bench -core [-m MAX_LIST] [-f FILL_LIST] [file.jpg]
+ *   e.g. ./imgfs-bench -n 1000 -t 8 ../provided/tests/data/papillon.jpg
+ *        ./imgfs-bench -core -m 100,1000 -f 10,90
+ * `make bench` builds it without sanitizer at -O2 and runs the core suite.
+ */
+
+#include "imgfs.h"
+#include "imgfs_commit.h"
+#include "image_dedup.h"
+#include "imgfs_heap.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define BENCH_DB "imgfs-bench.imgfs"
+#define DEFAULT_IMAGE "../provided/tests/data/papillon.jpg"
+#define DEFAULT_INSERTS 500
+#define DEFAULT_THREADS 4
+#define MAX_THREADS 64
+
+#define DEFAULT_MAX_LIST "100,1000,10000"
+#define DEFAULT_FILL_LIST "10,50,90"
+#define MAX_LIST_LENGTH 16
+#define CORE_SAMPLES 100   // images read, scanned and deleted per store
+#define CORE_REPEAT 20     // do_open and do_list calls per store
+
+static const char* const mode_names[NB_COMMIT_MODES] = { "direct", "per-op", "group", "async" };
+
+struct insert_args {
+    struct imgfs_file* file;
+    struct imgfs_lock* lock;
+    const char* image;
+    size_t image_size;
+    unsigned first;  // numbers of the images this thread inserts
+    unsigned count;
+    int err;
+};
+
+/********************************************************************/
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec / 1e6;
+}
+
+/********************************************************************
+ * Reads a whole file into a newly allocated buffer.
+ */
+static int read_whole_file(const char* path, char** buffer, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return ERR_IO;
+    fseek(file, 0, SEEK_END);
+    const long pos = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (pos <= 2) {
+        fclose(file);
+        return ERR_IO;
+    }
+    *buffer = malloc((size_t) pos);
+    if (*buffer == NULL) {
+        fclose(file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (fread(*buffer, (size_t) pos, 1, file) != 1) {
+        free(*buffer);
+        fclose(file);
+        return ERR_IO;
+    }
+    fclose(file);
+    *size = (size_t) pos;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Copy number i of the image, which differs in the last bytes before the
+ * end-of-image marker, so that each copy gets its own content.
+ */
+static void make_copy(char* copy, const char* image, size_t image_size, unsigned i)
+{
+    copy[image_size - 3] = (char) (image[image_size - 3] + (char) i);
+    copy[image_size - 4] = (char) (image[image_size - 4] + (char) (i >> 8));
+}
+
+/********************************************************************
+ * Inserts distinct copies of the image.
+ */
+static void* insert_worker(void* arg)
+{
+    struct insert_args* args = arg;
+    char* copy = malloc(args->image_size);
+    if (copy == NULL) {
+        args->err = ERR_OUT_OF_MEMORY;
+        return NULL;
+    }
+    memcpy(copy, args->image, args->image_size);
+
+    for (unsigned i = args->first; i < args->first + args->count && args->err == ERR_NONE; ++i) {
+        char img_id[MAX_IMG_ID + 1];
+        snprintf(img_id, sizeof(img_id), "bench-%u", i);
+        make_copy(copy, args->image, args->image_size, i);
+
+        imgfs_lock_acquire(args->lock, LOCK_SITE_INSERT);
+        args->err = do_insert(copy, args->image_size, img_id, args->file);
+        imgfs_lock_release(args->lock);
+    }
+    free(copy);
+    return NULL;
+}
+
+/********************************************************************
+ * Inserts per second of one commit mode.
+ */
+static int bench_mode(int mode, const char* image, size_t image_size, unsigned inserts, unsigned nb_threads)
+{
+    struct imgfs_file file;
+    zero_init_ptr(&file);
+    file.header.max_files = inserts;
+    file.header.resized_res[0] = file.header.resized_res[1] = 64;
+    file.header.resized_res[2] = file.header.resized_res[3] = 256;
+    int err = do_create(BENCH_DB, &file);
+    if (err != ERR_NONE) return err;
+    do_close(&file);
+
+    struct imgfs_lock lock;
+    err = imgfs_lock_init(&lock, "bench");
+    if (err != ERR_NONE) return err;
+    err = commit_configure(mode, &lock);
+    if (err == ERR_NONE) err = do_open(BENCH_DB, "rb+", &file);
+    if (err != ERR_NONE) {
+        imgfs_lock_destroy(&lock);
+        return err;
+    }
+
+    pthread_t threads[MAX_THREADS];
+    struct insert_args args[MAX_THREADS];
+    unsigned started = 0;
+    const double start = now_ms();
+    for (unsigned t = 0; t < nb_threads && err == ERR_NONE; ++t) {
+        args[t] = (struct insert_args) {
+            &file, &lock, image, image_size,
+            inserts / nb_threads * t, inserts / nb_threads + (t + 1 == nb_threads ? inserts % nb_threads : 0),
+            ERR_NONE
+        };
+        if (pthread_create(&threads[t], NULL, insert_worker, &args[t]) != 0) {
+            err = ERR_THREADING;
+        } else {
+            ++started;
+        }
+    }
+    for (unsigned t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+        if (err == ERR_NONE) err = args[t].err;
+    }
+    do_close(&file);
+    const double ms = now_ms() - start;
+
+    if (err == ERR_NONE) {
+        printf("insert,%s,%u,%u,%.3f,%.1f\n", mode_names[mode], nb_threads, inserts, ms, inserts * 1e3 / ms);
+    }
+    imgfs_lock_destroy(&lock);
+    return err;
+}
+
+/********************************************************************
+ * One line of the core suite.
+ */
+static void print_core(const char* op, uint32_t max_files, unsigned nb_images, unsigned ops, double ms,
+                       const struct heap_usage* since)
+{
+    struct heap_usage heap;
+    heap_usage_get(&heap);
+    const double per_op = ops > 0 ? 1.0 / ops : 0.0;
+    printf("core,%s,%u,%u,%u,%.3f,%.2f,%.2f,%.0f\n", op, max_files, nb_images, ops, ms, ms * 1e3 * per_op,
+           (double) (heap.allocations - since->allocations) * per_op, (double) (heap.bytes - since->bytes) * per_op);
+}
+
+/********************************************************************
+ * Reads sample images at one resolution; `what` names the figure.
+ */
+static int time_reads(struct imgfs_file* file, unsigned nb_images, unsigned samples, int resolution,
+                      uint32_t max_files, const char* what)
+{
+    int err = ERR_NONE;
+    struct heap_usage heap;
+    heap_usage_get(&heap);
+    const double start = now_ms();
+    for (unsigned k = 0; k < samples && err == ERR_NONE; ++k) {
+        char img_id[MAX_IMG_ID + 1];
+        snprintf(img_id, sizeof(img_id), "bench-%u", k * nb_images / samples);
+        char* buffer = NULL;
+        uint32_t size = 0;
+        err = do_read(img_id, resolution, &buffer, &size, file);
+        free(buffer);
+    }
+    if (err == ERR_NONE) print_core(what, max_files, nb_images, samples, now_ms() - start, &heap);
+    return err;
+}
+
+/********************************************************************
+ * Same, into one reused buffer (grown by the first read).
+ */
+static int time_reads_into(struct imgfs_file* file, unsigned nb_images, unsigned samples, int resolution,
+                           uint32_t max_files, const char* what)
+{
+    struct read_buffer buffer = { NULL, 0 };
+    uint32_t size = 0;
+    int err = do_read_into("bench-0", resolution, &buffer, &size, file);
+
+    struct heap_usage heap;
+    heap_usage_get(&heap);
+    const double start = now_ms();
+    for (unsigned k = 0; k < samples && err == ERR_NONE; ++k) {
+        char img_id[MAX_IMG_ID + 1];
+        snprintf(img_id, sizeof(img_id), "bench-%u", k * nb_images / samples);
+        err = do_read_into(img_id, resolution, &buffer, &size, file);
+    }
+    if (err == ERR_NONE) print_core(what, max_files, nb_images, samples, now_ms() - start, &heap);
+    read_buffer_free(&buffer);
+    return err;
+}
+
+/********************************************************************
+ * Core operations on one store of max_files filled to fill_percent.
+ */
+static int bench_core(const char* image, size_t image_size, uint32_t max_files, unsigned fill_percent)
+{
+    struct imgfs_file file;
+    zero_init_ptr(&file);
+    file.header.max_files = max_files;
+    file.header.resized_res[0] = file.header.resized_res[1] = 64;
+    file.header.resized_res[2] = file.header.resized_res[3] = 256;
+    int err = do_create(BENCH_DB, &file);
+    if (err != ERR_NONE) return err;
+    do_close(&file);
+
+    unsigned nb_images = (unsigned) ((uint64_t) max_files * fill_percent / 100);
+    if (nb_images == 0) nb_images = 1;
+    const unsigned samples = nb_images < CORE_SAMPLES ? nb_images : CORE_SAMPLES;
+
+    char* copy = malloc(image_size);
+    if (copy == NULL) return ERR_OUT_OF_MEMORY;
+    memcpy(copy, image, image_size);
+    err = do_open(BENCH_DB, "rb+", &file);
+    if (err != ERR_NONE) {
+        free(copy);
+        return err;
+    }
+
+    struct heap_usage heap;
+    heap_usage_get(&heap);
+    double start = now_ms();
+    for (unsigned i = 0; i < nb_images && err == ERR_NONE; ++i) {
+        char img_id[MAX_IMG_ID + 1];
+        snprintf(img_id, sizeof(img_id), "bench-%u", i);
+        make_copy(copy, image, image_size, i);
+        err = do_insert(copy, image_size, img_id, &file);
+    }
+    free(copy);
+    if (err == ERR_NONE) print_core("insert", max_files, nb_images, nb_images, now_ms() - start, &heap);
+
+    // A fresh store is filled from its first slot. The scan of a stored
+    // image clears its offset (as for an image being inserted): restore it
+    if (err == ERR_NONE) {
+        heap_usage_get(&heap);
+        start = now_ms();
+        for (unsigned k = 0; k < samples && err == ERR_NONE; ++k) {
+            const uint32_t index = k * nb_images / samples;
+            const struct img_metadata saved = file.metadata[index];
+            err = do_name_and_content_dedup(&file, index);
+            file.metadata[index] = saved;
+        }
+        if (err == ERR_NONE) print_core("dedup", max_files, nb_images, samples, now_ms() - start, &heap);
+    }
+
+    if (err == ERR_NONE) err = time_reads(&file, nb_images, samples, ORIG_RES, max_files, "read-orig");
+    if (err == ERR_NONE) err = time_reads(&file, nb_images, samples, THUMB_RES, max_files, "read-thumb-uncached");
+    if (err == ERR_NONE) err = time_reads(&file, nb_images, samples, THUMB_RES, max_files, "read-thumb-cached");
+    if (err == ERR_NONE) err = time_reads_into(&file, nb_images, samples, THUMB_RES, max_files, "read-thumb-cached-into");
+
+    if (err == ERR_NONE) {
+        heap_usage_get(&heap);
+        start = now_ms();
+        for (unsigned k = 0; k < CORE_REPEAT && err == ERR_NONE; ++k) {
+            char* json = NULL;
+            err = do_list(&file, JSON, &json);
+            free(json);
+        }
+        if (err == ERR_NONE) print_core("list-json", max_files, nb_images, CORE_REPEAT, now_ms() - start, &heap);
+    }
+    do_close(&file);
+
+    // Opening only, not closing
+    double ms = 0;
+    heap_usage_get(&heap);
+    for (unsigned k = 0; k < CORE_REPEAT && err == ERR_NONE; ++k) {
+        start = now_ms();
+        err = do_open(BENCH_DB, "rb", &file);
+        ms += now_ms() - start;
+        if (err == ERR_NONE) do_close(&file);
+    }
+    if (err == ERR_NONE) print_core("open", max_files, nb_images, CORE_REPEAT, ms, &heap);
+
+    if (err == ERR_NONE) err = do_open(BENCH_DB, "rb+", &file);
+    if (err == ERR_NONE) {
+        heap_usage_get(&heap);
+        start = now_ms();
+        for (unsigned k = 0; k < samples && err == ERR_NONE; ++k) {
+            char img_id[MAX_IMG_ID + 1];
+            snprintf(img_id, sizeof(img_id), "bench-%u", k * nb_images / samples);
+            err = do_delete(img_id, &file);
+        }
+        if (err == ERR_NONE) print_core("delete", max_files, nb_images, samples, now_ms() - start, &heap);
+        do_close(&file);
+    }
+    return err;
+}
+
+/********************************************************************
+ * Parses a comma-separated list of positive numbers; returns its length,
+ * 0 if invalid.
+ */
+static size_t parse_list(const char* text, uint32_t* values, size_t max_values)
+{
+    char copy[256];
+    if (strlen(text) >= sizeof(copy)) return 0;
+    strcpy(copy, text);
+    size_t count = 0;
+    for (char* item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        if (count == max_values) return 0;
+        values[count] = atouint32(item);
+        if (values[count] == 0) return 0;
+        ++count;
+    }
+    return count;
+}
+
+/********************************************************************/
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0]) != 0) return ERR_IMGLIB;
+
+    unsigned inserts = DEFAULT_INSERTS;
+    unsigned nb_threads = DEFAULT_THREADS;
+    int core = 0;
+    const char* max_list = DEFAULT_MAX_LIST;
+    const char* fill_list = DEFAULT_FILL_LIST;
+    argc--;
+    argv++;
+    while (argc >= 1 && argv[0][0] == '-') {
+        if (strcmp(argv[0], "-core") == 0) {
+            core = 1;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (argc < 2) break;
+        if (strcmp(argv[0], "-n") == 0) {
+            inserts = atouint32(argv[1]);
+        } else if (strcmp(argv[0], "-t") == 0) {
+            nb_threads = atouint16(argv[1]);
+        } else if (strcmp(argv[0], "-m") == 0) {
+            max_list = argv[1];
+        } else if (strcmp(argv[0], "-f") == 0) {
+            fill_list = argv[1];
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (inserts == 0) inserts = DEFAULT_INSERTS;
+    if (nb_threads == 0 || nb_threads > MAX_THREADS) nb_threads = DEFAULT_THREADS;
+
+    char* image = NULL;
+    size_t image_size = 0;
+    int err = read_whole_file(argc > 0 ? argv[0] : DEFAULT_IMAGE, &image, &image_size);
+
+    if (core) {
+        uint32_t max_files[MAX_LIST_LENGTH];
+        uint32_t fills[MAX_LIST_LENGTH];
+        const size_t nb_max = parse_list(max_list, max_files, MAX_LIST_LENGTH);
+        const size_t nb_fills = parse_list(fill_list, fills, MAX_LIST_LENGTH);
+        if (err == ERR_NONE && (nb_max == 0 || nb_fills == 0)) err = ERR_INVALID_ARGUMENT;
+        if (err == ERR_NONE) printf("bench,op,max_files,images,ops,ms,us_per_op,allocs_per_op,alloc_bytes_per_op\n");
+        for (size_t m = 0; m < nb_max && err == ERR_NONE; ++m) {
+            for (size_t f = 0; f < nb_fills && err == ERR_NONE; ++f) {
+                err = fills[f] > 100 ? ERR_INVALID_ARGUMENT : bench_core(image, image_size, max_files[m], fills[f]);
+            }
+        }
+    } else {
+        if (err == ERR_NONE) printf("bench,mode,threads,inserts,ms,per_sec\n");
+        for (int mode = 0; mode < NB_COMMIT_MODES && err == ERR_NONE; ++mode) {
+            err = bench_mode(mode, image, image_size, inserts, nb_threads);
+        }
+    }
+    free(image);
+
+    unlink(BENCH_DB);
+    if (err != ERR_NONE) fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+    vips_shutdown();
+    return err;
+}
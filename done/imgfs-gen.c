@@ -0,0 +1,358 @@
+/**
+ * @file imgfs-gen.c
+ * @brief Generator of large synthetic imgFS, for scale testing.
+ *
+ * Builds an imgFS of any number of slots, a share of which hold images,
+ * without going through do_insert(): the blobs are written one after
+ * the other from the start of the data region, and then the whole
+ * metadata array and the header at once, so that millions of slots take
+ * seconds rather than the hours of as many O(max_files) inserts.
+ *
+ * The valid slots are spread uniformly over the store. A share of the
+ * images duplicates the content of an earlier one (same SHA, size and
+ * offset, as the deduplication of do_insert() leaves them). Image IDs are
+ * unique, of a length drawn uniformly in [MIN, MAX]. Blob sizes follow a
+ * log-normal law of the given median (KiB) and sigma (0 for a fixed
+ * size). Blobs are random bytes, or, with -image, that JPEG followed by
+ * random bytes up to the drawn size (decoders ignore what follows the
+ * end of the image), so that they can be read and resized; that JPEG may
+ * not be larger than the largest blob (64 MiB). Everything is
+ * drawn from a generator seeded by -seed, so that a store can be rebuilt
+ * identically.
+ *
+ * Usage: ./imgfs-gen <imgFS_filename> [-slots N] [-fill PCT] [-dup PCT]
+ *                    [-id MIN:MAX] [-size MEDIAN_KIB[:SIGMA]] [-image file.jpg]
+ *                    [-paged] [-seed N]
+ *   e.g. ./imgfs-gen big.imgfs -slots 2000000 -fill 75 -dup 10 -size 8:0.7
+ */
+
+#include "imgfs.h"
+#include "image_content.h"
+#include "util.h"
+
+#include <math.h>
+#include <openssl/sha.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vips/vips.h>
+
+#define DEFAULT_SLOTS 1000000
+#define DEFAULT_FILL 50
+#define DEFAULT_DUP 0
+#define DEFAULT_ID_MIN 8
+#define DEFAULT_ID_MAX 32
+#define DEFAULT_SIZE_KIB 16
+#define DEFAULT_SIGMA 0.5
+#define MIN_BLOB_SIZE 64
+#define MAX_BLOB_SIZE (64UL << 20)
+#define NOMINAL_WIDTH 1024  // resolution recorded for random blobs
+#define NOMINAL_HEIGHT 768
+
+static const char id_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+#define NB_ID_CHARS (sizeof(id_chars) - 1)
+
+struct gen_params {
+    uint32_t slots;
+    uint32_t fill;      // %
+    uint32_t dup;       // %
+    uint32_t id_min;
+    uint32_t id_max;
+    double size_median; // bytes
+    double size_sigma;
+    uint32_t revision;
+    uint64_t seed;
+    const char* image;
+};
+
+// Content already written, that duplicates point to
+struct gen_blob {
+    uint64_t offset;
+    uint32_t size;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+};
+
+/*******************************************************************
+ * xorshift64*: fast, and the same store for the same seed everywhere
+ */
+static uint64_t rng_state;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, 1)
+static double rng_unit(void)
+{
+    return (double) (rng_next() >> 11) / (double) (1ULL << 53);
+}
+
+static uint64_t rng_below(uint64_t bound)
+{
+    return bound > 0 ? rng_next() % bound : 0;
+}
+
+// Standard normal (Box-Muller)
+static double rng_normal(void)
+{
+    const double u = 1.0 - rng_unit(); // in (0, 1]
+    return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * rng_unit());
+}
+
+/********************************************************************/
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int read_whole_file(const char* path, char** buffer, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return ERR_IO;
+    fseek(file, 0, SEEK_END);
+    const long length = ftell(file);
+    rewind(file);
+    *buffer = length > 0 ? malloc((size_t) length) : NULL;
+    if (*buffer == NULL || fread(*buffer, (size_t) length, 1, file) != 1) {
+        free(*buffer);
+        *buffer = NULL;
+        fclose(file);
+        return ERR_IO;
+    }
+    fclose(file);
+    *size = (size_t) length;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Unique ID of the number-th image: random characters, then the number
+ * in base 36 on `digits` characters, `length` characters in all
+ */
+static void make_id(char* id, uint32_t number, uint32_t digits, uint32_t length)
+{
+    for (uint32_t i = 0; i < length - digits; ++i) id[i] = id_chars[rng_below(NB_ID_CHARS)];
+    for (uint32_t i = length; i > length - digits; --i) {
+        id[i - 1] = id_chars[number % NB_ID_CHARS];
+        number /= (uint32_t) NB_ID_CHARS;
+    }
+    id[length] = '\0';
+}
+
+static size_t draw_size(const struct gen_params* params, size_t at_least)
+{
+    double size = params->size_median * exp(params->size_sigma * rng_normal());
+    if (size < MIN_BLOB_SIZE) size = MIN_BLOB_SIZE;
+    if (size > MAX_BLOB_SIZE) size = MAX_BLOB_SIZE;
+    return (size_t) size < at_least ? at_least : (size_t) size;
+}
+
+// The template image (if any), then random bytes
+static void fill_blob(char* blob, size_t size, const char* image, size_t image_size)
+{
+    size_t i = 0;
+    if (image != NULL) {
+        memcpy(blob, image, image_size);
+        i = image_size;
+    }
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        const uint64_t r = rng_next();
+        memcpy(blob + i, &r, sizeof(r));
+    }
+    for (; i < size; ++i) blob[i] = (char) rng_next();
+}
+
+/********************************************************************/
+static int generate(const char* filename, const struct gen_params* params)
+{
+    char* image = NULL;
+    size_t image_size = 0;
+    uint32_t width = NOMINAL_WIDTH, height = NOMINAL_HEIGHT;
+    if (params->image != NULL) {
+        int err = read_whole_file(params->image, &image, &image_size);
+        // Every blob starts with it, in a buffer of MAX_BLOB_SIZE
+        if (err == ERR_NONE && image_size > MAX_BLOB_SIZE) err = ERR_INVALID_ARGUMENT;
+        if (err == ERR_NONE) err = get_resolution(&height, &width, image, image_size);
+        if (err != ERR_NONE) {
+            free(image);
+            return err;
+        }
+    }
+
+    const uint32_t nb_images = (uint32_t) ((uint64_t) params->slots * params->fill / 100);
+    uint32_t digits = 1;
+    for (uint32_t n = nb_images; n >= NB_ID_CHARS; n /= (uint32_t) NB_ID_CHARS) ++digits;
+    const uint32_t id_min = params->id_min < digits ? digits : params->id_min;
+    const uint32_t id_max = params->id_max < id_min ? id_min : params->id_max;
+
+    const double start = now_seconds();
+    struct imgfs_file imgfs_file;
+    memset(&imgfs_file, 0, sizeof(imgfs_file));
+    imgfs_file.header.max_files = params->slots;
+    imgfs_file.header.resized_res[0] = imgfs_file.header.resized_res[1] = 64;
+    imgfs_file.header.resized_res[2] = imgfs_file.header.resized_res[3] = 256;
+    int err = do_create_revision(filename, &imgfs_file, params->revision);
+    if (err != ERR_NONE) {
+        free(image);
+        return err;
+    }
+
+    struct gen_blob* blobs = calloc(nb_images > 0 ? nb_images : 1, sizeof(struct gen_blob));
+    char* blob = malloc(MAX_BLOB_SIZE);
+    if (blobs == NULL || blob == NULL) err = ERR_OUT_OF_MEMORY;
+
+    // Blobs, in slot order: selection sampling spreads nb_images slots uniformly
+    uint64_t offset = data_offset(&imgfs_file.header);
+    uint64_t data_bytes = 0;
+    uint32_t nb_blobs = 0;
+    uint32_t placed = 0;
+    if (err == ERR_NONE && fseek(imgfs_file.file, (long) offset, SEEK_SET) != 0) err = ERR_IO;
+    for (uint32_t i = 0; i < params->slots && placed < nb_images && err == ERR_NONE; ++i) {
+        if (rng_below(params->slots - i) >= nb_images - placed) continue;
+        struct img_metadata* meta = &imgfs_file.metadata[i];
+        make_id(meta->img_id, placed, digits,
+                id_min + (uint32_t) rng_below((uint64_t) id_max - id_min + 1));
+        meta->orig_res[0] = width;
+        meta->orig_res[1] = height;
+        meta->is_valid = NON_EMPTY;
+        ++placed;
+
+        if (nb_blobs > 0 && rng_below(100) < params->dup) {
+            const struct gen_blob* original = &blobs[rng_below(nb_blobs)];
+            memcpy(meta->SHA, original->SHA, SHA256_DIGEST_LENGTH);
+            meta->size[ORIG_RES] = original->size;
+            meta->offset[ORIG_RES] = original->offset;
+            continue;
+        }
+
+        const size_t size = draw_size(params, image_size);
+        fill_blob(blob, size, image, image_size);
+        struct gen_blob* written = &blobs[nb_blobs++];
+        SHA256((const unsigned char*) blob, size, written->SHA);
+        written->offset = offset;
+        written->size = (uint32_t) size;
+        if (fwrite(blob, size, 1, imgfs_file.file) != 1) err = ERR_IO;
+        memcpy(meta->SHA, written->SHA, SHA256_DIGEST_LENGTH);
+        meta->size[ORIG_RES] = written->size;
+        meta->offset[ORIG_RES] = offset;
+        offset += size;
+        data_bytes += size;
+    }
+
+    // Then all the metadata and the header at once
+    imgfs_file.header.nb_files = placed;
+    if (err == ERR_NONE
+        && (fseek(imgfs_file.file, (long) metadata_offset(&imgfs_file.header), SEEK_SET) != 0
+            || fwrite(imgfs_file.metadata, sizeof(struct img_metadata), params->slots,
+                      imgfs_file.file) != params->slots
+            || fseek(imgfs_file.file, 0, SEEK_SET) != 0
+            || fwrite(&imgfs_file.header, sizeof(struct imgfs_header), 1, imgfs_file.file) != 1)) {
+        err = ERR_IO;
+    }
+    do_close(&imgfs_file);
+    const double seconds = now_seconds() - start;
+
+    if (err == ERR_NONE) {
+        printf("%u slots, %u images (%u distinct), %.1f MiB of data in %.2f s\n", params->slots,
+               placed, nb_blobs, (double) data_bytes / (1 << 20), seconds);
+    }
+    free(blob);
+    free(blobs);
+    free(image);
+    return err;
+}
+
+/*******************************************************************
+ * "A:B" (B optional)
+ */
+static int parse_range(const char* str, uint32_t* a, uint32_t* b)
+{
+    char copy[32];
+    strncpy(copy, str, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    char* colon = strchr(copy, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        *b = atouint32(colon + 1);
+    }
+    *a = atouint32(copy);
+    return *a > 0 && (colon == NULL || *b >= *a) ? ERR_NONE : ERR_INVALID_ARGUMENT;
+}
+
+/********************************************************************/
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0]) != 0) return ERR_IMGLIB;
+
+    struct gen_params params = {
+        DEFAULT_SLOTS, DEFAULT_FILL, DEFAULT_DUP, DEFAULT_ID_MIN, DEFAULT_ID_MAX,
+        DEFAULT_SIZE_KIB * 1024.0, DEFAULT_SIGMA, IMGFS_REVISION_ORIGINAL, 1, NULL
+    };
+    int err = argc < 2 ? ERR_NOT_ENOUGH_ARGUMENTS : ERR_NONE;
+    const char* filename = argc >= 2 ? argv[1] : NULL;
+    argc -= 2;
+    argv += 2;
+    while (argc >= 1 && err == ERR_NONE) {
+        if (strcmp(argv[0], "-paged") == 0) {
+            params.revision = IMGFS_REVISION_PAGED;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (argc < 2) {
+            err = ERR_NOT_ENOUGH_ARGUMENTS;
+            break;
+        }
+        if (strcmp(argv[0], "-slots") == 0) {
+            params.slots = atouint32(argv[1]);
+            if (params.slots == 0 || params.slots == (uint32_t) -1) err = ERR_MAX_FILES;
+        } else if (strcmp(argv[0], "-fill") == 0) {
+            params.fill = atouint32(argv[1]);
+            if (params.fill > 100) err = ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[0], "-dup") == 0) {
+            params.dup = atouint32(argv[1]);
+            if (params.dup >= 100) err = ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[0], "-id") == 0) {
+            params.id_max = 0;
+            err = parse_range(argv[1], &params.id_min, &params.id_max);
+            if (params.id_max == 0) params.id_max = params.id_min;
+            if (params.id_max > MAX_IMG_ID) err = ERR_INVALID_IMGID;
+        } else if (strcmp(argv[0], "-size") == 0) {
+            char kib_str[16];
+            strncpy(kib_str, argv[1], sizeof(kib_str) - 1);
+            kib_str[sizeof(kib_str) - 1] = '\0';
+            char* colon = strchr(kib_str, ':');
+            if (colon != NULL) *colon = '\0';
+            const uint32_t kib = atouint32(kib_str);
+            params.size_median = kib * 1024.0;
+            params.size_sigma = colon != NULL ? strtod(colon + 1, NULL) : DEFAULT_SIGMA;
+            if (kib == 0 || params.size_sigma < 0) err = ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[0], "-image") == 0) {
+            params.image = argv[1];
+        } else if (strcmp(argv[0], "-seed") == 0) {
+            params.seed = atouint32(argv[1]);
+        } else {
+            err = ERR_INVALID_COMMAND;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (err == ERR_NONE) {
+        rng_state = params.seed * 0x9E3779B97F4A7C15ULL + 1; // never 0
+        err = generate(filename, &params);
+    }
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+        fprintf(stderr, "Usage: imgfs-gen <imgFS_filename> [-slots N] [-fill PCT] [-dup PCT] [-id MIN:MAX]\n"
+                "                 [-size MEDIAN_KIB[:SIGMA]] [-image file.jpg] [-paged] [-seed N]\n");
+    }
+    vips_shutdown();
+    return err;
+}
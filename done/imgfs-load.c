@@ -0,0 +1,641 @@
+/**
+ * @file imgfs-load.c
+ * @brief HTTP load generator for imgfs_server.
+ *
+ * Like tcp-test-client, talks to a server on the local host, but through
+ * CONNECTIONS threads, each keeping one HTTP/1.1 connection open (unless
+ * -close) and sending a weighted mix of list, read (per resolution),
+ * insert and delete requests for DURATION seconds:
+ *   - reads pick an ID at random among those listed at startup;
+ *   - inserts POST distinct copies of one JPEG as "load-<thread>-<n>";
+ *   - deletes remove the images this thread inserted, newest first (a
+ *     read of an original is sent instead while there is none).
+ *
+ * Closed loop by default: each thread sends its next request as soon as
+ * it has the previous reply. With -r RATE, open loop at RATE requests/s
+ * in all: each request is due at a fixed time, and its latency is
+ * counted from that time rather than from when it was actually sent, so
+ * that a stalled server is charged for the requests it kept waiting
+ * (no coordinated omission). The run stops after DURATION either way.
+ *
+ * Prints on stdout, as CSV, the throughput and the p50/p99/p999/max
+ * latencies of each kind of request; -hist FILE also writes the whole
+ * latency histograms there.
+ *
+ * Usage: ./imgfs-load [-c CONNECTIONS] [-d DURATION] [-r RATE] [-close]
+ *                     [-mix list:W,orig:W,small:W,thumb:W,insert:W,delete:W]
+ *                     [-image file.jpg] [-hist FILE] <port>
+ *   e.g. ./imgfs-load -c 8 -d 30 -r 2000 -mix thumb:80,small:15,insert:5 8000
+ */
+
+#include "error.h"
+#include "socket_layer.h"
+#include "util.h" // for atouint16, atouint32
+
+#include <arpa/inet.h>  // for inet_addr
+#include <netinet/in.h> // for sockaddr_in
+#include <netinet/tcp.h> // for TCP_NODELAY
+#include <pthread.h>
+#include <signal.h>     // for SIGPIPE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>    // for strncasecmp
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVER_IP "127.0.0.1"
+#define DEFAULT_IMAGE "../provided/tests/data/papillon.jpg"
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_DURATION 10
+#define DEFAULT_MIX "list:5,orig:15,small:20,thumb:55,insert:3,delete:2"
+#define MAX_CONNECTIONS 256
+#define MAX_IDS 100000           // IDs kept from the list at startup
+#define MAX_ID_LENGTH 127
+#define MAX_OWN_IDS 65536        // Inserted images a thread remembers to delete
+#define REQUEST_HEADER_SIZE 512
+#define RESPONSE_BUFFER_SIZE 65536   // Larger bodies are read through, not kept
+#define LIST_BUFFER_SIZE (4UL << 20) // For the list at startup
+
+// Latencies in microseconds, in log-linear buckets: exact below HIST_LINEAR,
+// then HIST_HALF buckets per power of two (about 3% wide)
+#define HIST_LINEAR 64
+#define HIST_HALF 32
+#define HIST_MAX_SHIFT 36
+#define HIST_SIZE (HIST_LINEAR + HIST_MAX_SHIFT * HIST_HALF)
+
+enum load_op { OP_LIST, OP_ORIG, OP_SMALL, OP_THUMB, OP_INSERT, OP_DELETE, NB_OPS };
+static const char* const op_names[NB_OPS] = { "list", "orig", "small", "thumb", "insert", "delete" };
+static const char* const op_res[NB_OPS] = { NULL, "orig", "small", "thumb", NULL, NULL };
+
+struct histogram {
+    uint64_t counts[HIST_SIZE];
+    uint64_t total;
+    uint64_t max_us;
+};
+
+struct load_config {
+    uint16_t port;
+    unsigned nb_connections;
+    double duration;
+    double rate;                       // Requests/s in all, 0 for closed loop
+    int keep_alive;
+    unsigned weights[NB_OPS];
+    unsigned total_weight;
+    const char* image;                 // Content of the inserts
+    size_t image_size;
+    char (*ids)[MAX_ID_LENGTH + 1];    // Images to read
+    size_t nb_ids;
+};
+
+struct load_thread {
+    const struct load_config* config;
+    unsigned number;
+    uint64_t rng;
+    int socket;
+    char* response;                    // Buffer for the replies
+    size_t capacity;
+    char* copy;                        // Insert being sent
+    uint32_t* own;                     // Numbers of the images inserted and not deleted yet
+    size_t nb_own;
+    uint32_t next_insert;
+    struct histogram hist[NB_OPS];
+    uint64_t errors[NB_OPS];
+};
+
+/********************************************************************/
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double when)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) when;
+    ts.tv_nsec = (long) ((when - (double) ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) continue;
+}
+
+// xorshift64*
+static uint64_t next_random(uint64_t* state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/********************************************************************
+ * Histogram buckets
+ */
+static size_t bucket_of(uint64_t us)
+{
+    if (us < HIST_LINEAR) return (size_t) us;
+    unsigned msb = 63 - (unsigned) __builtin_clzll(us);
+    unsigned shift = msb - 5; // us >> shift is in [HIST_HALF, 2 * HIST_HALF)
+    if (shift > HIST_MAX_SHIFT) return HIST_SIZE - 1;
+    return HIST_LINEAR + (shift - 1) * HIST_HALF + (size_t) ((us >> shift) - HIST_HALF);
+}
+
+// Highest value a bucket holds
+static uint64_t bucket_top(size_t bucket)
+{
+    if (bucket < HIST_LINEAR) return bucket;
+    const unsigned shift = (unsigned) ((bucket - HIST_LINEAR) / HIST_HALF) + 1;
+    const uint64_t top = HIST_HALF + (bucket - HIST_LINEAR) % HIST_HALF;
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram* hist, uint64_t us)
+{
+    hist->counts[bucket_of(us)]++;
+    hist->total++;
+    if (us > hist->max_us) hist->max_us = us;
+}
+
+static void hist_add(struct histogram* into, const struct histogram* hist)
+{
+    for (size_t b = 0; b < HIST_SIZE; ++b) into->counts[b] += hist->counts[b];
+    into->total += hist->total;
+    if (hist->max_us > into->max_us) into->max_us = hist->max_us;
+}
+
+static double hist_percentile_ms(const struct histogram* hist, double percentile)
+{
+    if (hist->total == 0) return 0;
+    const uint64_t rank = (uint64_t) ((double) hist->total * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HIST_SIZE; ++b) {
+        seen += hist->counts[b];
+        if (seen >= rank && seen > 0) {
+            const uint64_t top = bucket_top(b);
+            return (double) (top < hist->max_us ? top : hist->max_us) / 1e3;
+        }
+    }
+    return (double) hist->max_us / 1e3;
+}
+
+/********************************************************************
+ * Connection to the server, -1 on failure
+ */
+static int connect_server(uint16_t port)
+{
+    const int socket_ID = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_ID == -1) return -1;
+
+    struct sockaddr_in socket_address;
+    memset(&socket_address, 0, sizeof(socket_address));
+    socket_address.sin_port = htons(port);
+    socket_address.sin_family = AF_INET;
+    socket_address.sin_addr.s_addr = inet_addr(SERVER_IP);
+    if (connect(socket_ID, (struct sockaddr*) &socket_address, sizeof(socket_address)) < 0) {
+        close(socket_ID);
+        return -1;
+    }
+    // The header and body of an insert are sent apart
+    const int no_delay = 1;
+    setsockopt(socket_ID, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    return socket_ID;
+}
+
+static int send_all(int socket_ID, const char* data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t sent = tcp_send(socket_ID, data, size);
+        if (sent <= 0) return ERR_IO;
+        data += sent;
+        size -= (size_t) sent;
+    }
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Reads one reply; its body (at most `capacity` bytes of it) is left in
+ * buffer, from *body, and its size in *body_size.
+ * Returns the HTTP status, or some (negative) error code.
+ */
+static int read_reply(int socket_ID, char* buffer, size_t capacity, size_t* body, size_t* body_size)
+{
+    size_t filled = 0;
+    char* end = NULL;
+    while (end == NULL) {
+        if (filled + 1 >= capacity) return ERR_IO;
+        const ssize_t got = tcp_read(socket_ID, buffer + filled, capacity - filled - 1);
+        if (got <= 0) return ERR_IO;
+        filled += (size_t) got;
+        buffer[filled] = '\0';
+        end = strstr(buffer, "\r\n\r\n");
+    }
+
+    int status = 0;
+    if (sscanf(buffer, "HTTP/1.%*c %d", &status) != 1) return ERR_IO;
+    size_t content_length = 0;
+    for (const char* line = strstr(buffer, "\r\n"); line != NULL && line < end; line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            content_length = (size_t) strtoull(line + 2 + 15, NULL, 10);
+        }
+    }
+
+    // The body, kept while it fits, skipped beyond
+    *body = (size_t) (end - buffer) + 4;
+    *body_size = content_length;
+    size_t have = filled - *body;
+    while (have < content_length) {
+        char* into = buffer + filled;
+        size_t room = capacity - filled;
+        if (room == 0) {
+            into = buffer + *body;
+            room = capacity - *body;
+            filled = *body;
+        }
+        const size_t wanted = content_length - have < room ? content_length - have : room;
+        const ssize_t got = tcp_read(socket_ID, into, wanted);
+        if (got <= 0) return ERR_IO;
+        filled += (size_t) got;
+        have += (size_t) got;
+    }
+    return status;
+}
+
+/********************************************************************
+ * Sends one request and waits for its reply; on a broken connection,
+ * reconnects once.
+ */
+static int exchange(struct load_thread* thread, const char* header, size_t header_size,
+                    const char* body, size_t body_size, size_t* reply_body, size_t* reply_size)
+{
+    const struct load_config* config = thread->config;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (thread->socket < 0) thread->socket = connect_server(config->port);
+        if (thread->socket < 0) return ERR_IO;
+
+        int status = send_all(thread->socket, header, header_size);
+        if (status == ERR_NONE && body_size > 0) status = send_all(thread->socket, body, body_size);
+        if (status == ERR_NONE) {
+            status = read_reply(thread->socket, thread->response, thread->capacity, reply_body, reply_size);
+        }
+        if (status < 0 || !config->keep_alive) {
+            close(thread->socket);
+            thread->socket = -1;
+        }
+        if (status >= 0) return status;
+    }
+    return ERR_IO;
+}
+
+/********************************************************************
+ * Sends one request of the given kind; returns whether it succeeded.
+ */
+static int send_op(struct load_thread* thread, enum load_op op)
+{
+    const struct load_config* config = thread->config;
+    char header[REQUEST_HEADER_SIZE];
+    const char* connection = config->keep_alive ? "keep-alive" : "close";
+    const char* body = NULL;
+    size_t body_size = 0;
+    uint32_t inserted = 0;
+    int length = -1;
+
+    switch (op) {
+    case OP_LIST:
+        length = snprintf(header, sizeof(header),
+                          "GET /imgfs/list HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n", connection);
+        break;
+    case OP_ORIG:
+    case OP_SMALL:
+    case OP_THUMB:
+        if (config->nb_ids == 0) return 0;
+        length = snprintf(header, sizeof(header),
+                          "GET /imgfs/read?res=%s&img_id=%s HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n",
+                          op_res[op], config->ids[next_random(&thread->rng) % config->nb_ids], connection);
+        break;
+    case OP_INSERT:
+        inserted = thread->next_insert++;
+        // Distinct content: the bytes before the end-of-image marker vary
+        thread->copy[config->image_size - 3] = (char) (config->image[config->image_size - 3] + (char) inserted);
+        thread->copy[config->image_size - 4] = (char) (config->image[config->image_size - 4] + (char) thread->number);
+        thread->copy[config->image_size - 5] = (char) (config->image[config->image_size - 5] + (char) (inserted >> 8));
+        body = thread->copy;
+        body_size = config->image_size;
+        length = snprintf(header, sizeof(header),
+                          "POST /imgfs/insert?name=load-%u-%u HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n"
+                          "Content-Length: %zu\r\n\r\n", thread->number, inserted, connection, body_size);
+        break;
+    case OP_DELETE:
+        if (thread->nb_own == 0) return 0;
+        length = snprintf(header, sizeof(header),
+                          "GET /imgfs/delete?img_id=load-%u-%u HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n",
+                          thread->number, thread->own[thread->nb_own - 1], connection);
+        break;
+    default:
+        return 0;
+    }
+    if (length < 0 || (size_t) length >= sizeof(header)) return 0;
+
+    size_t reply_body = 0;
+    size_t reply_size = 0;
+    const int status = exchange(thread, header, (size_t) length, body, body_size, &reply_body, &reply_size);
+    const int ok = status == 200 || status == 302; // insert and delete redirect to the index
+    if (ok && op == OP_INSERT && thread->nb_own < MAX_OWN_IDS) thread->own[thread->nb_own++] = inserted;
+    if (ok && op == OP_DELETE) thread->nb_own--;
+    return ok;
+}
+
+/********************************************************************
+ * One connection
+ */
+static void* load_worker(void* arg)
+{
+    struct load_thread* thread = arg;
+    const struct load_config* config = thread->config;
+
+    const double start = now_s();
+    const double end = start + config->duration;
+    // Open loop: this thread's requests are due every `interval`, staggered among threads
+    const double interval = config->rate > 0 ? config->nb_connections / config->rate : 0;
+    double due = start + interval * thread->number / config->nb_connections;
+
+    for (;;) {
+        if (interval > 0) {
+            // Requests still due when the time is up (the server being late) are not sent
+            const double now = now_s();
+            if (due >= end || now >= end) break;
+            if (now < due) sleep_until(due);
+        } else {
+            due = now_s();
+            if (due >= end) break;
+        }
+
+        unsigned pick = (unsigned) (next_random(&thread->rng) % config->total_weight);
+        enum load_op op = OP_LIST;
+        while (pick >= config->weights[op]) pick -= config->weights[op++];
+        if (op == OP_DELETE && thread->nb_own == 0) op = OP_ORIG;
+
+        const int ok = send_op(thread, op);
+        const double done = now_s();
+        if (ok) {
+            hist_record(&thread->hist[op], (uint64_t) ((done - due) * 1e6));
+        } else {
+            thread->errors[op]++;
+        }
+        due += interval;
+    }
+    if (thread->socket >= 0) close(thread->socket);
+    return NULL;
+}
+
+/********************************************************************
+ * IDs of the images in the server, from its list
+ */
+static int fetch_ids(struct load_config* config)
+{
+    struct load_thread probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.config = config;
+    probe.socket = -1;
+    probe.capacity = LIST_BUFFER_SIZE;
+    probe.response = malloc(probe.capacity);
+    if (probe.response == NULL) return ERR_OUT_OF_MEMORY;
+
+    static const char request[] = "GET /imgfs/list HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    size_t body = 0;
+    size_t size = 0;
+    const int status = exchange(&probe, request, strlen(request), NULL, 0, &body, &size);
+    if (probe.socket >= 0) close(probe.socket);
+    if (status != 200) {
+        free(probe.response);
+        return ERR_IO;
+    }
+    if (size > probe.capacity - body - 1) size = probe.capacity - body - 1; // IDs cut short
+    char* json = probe.response + body;
+    json[size] = '\0';
+
+    // {"Images": ["id1", "id2", ...]}: the strings after the '['
+    const char* p = strchr(json, '[');
+    while (p != NULL && config->nb_ids < MAX_IDS) {
+        const char* open = strchr(p, '"');
+        if (open == NULL) break;
+        const char* close_quote = strchr(open + 1, '"');
+        if (close_quote == NULL) break;
+        const size_t length = (size_t) (close_quote - open - 1);
+        if (length > 0 && length <= MAX_ID_LENGTH) {
+            memcpy(config->ids[config->nb_ids], open + 1, length);
+            config->ids[config->nb_ids][length] = '\0';
+            config->nb_ids++;
+        }
+        p = close_quote + 1;
+    }
+    free(probe.response);
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Weights of the mix, e.g. "thumb:80,insert:20"; unnamed kinds get 0.
+ */
+static int parse_mix(const char* text, struct load_config* config)
+{
+    char copy[256];
+    if (strlen(text) >= sizeof(copy)) return ERR_INVALID_ARGUMENT;
+    strcpy(copy, text);
+    memset(config->weights, 0, sizeof(config->weights));
+    config->total_weight = 0;
+
+    for (char* item = strtok(copy, ","); item != NULL; item = strtok(NULL, ",")) {
+        char* colon = strchr(item, ':');
+        if (colon == NULL) return ERR_INVALID_ARGUMENT;
+        *colon = '\0';
+        int op = -1;
+        for (int i = 0; i < NB_OPS; ++i) {
+            if (strcmp(item, op_names[i]) == 0) op = i;
+        }
+        if (op < 0) return ERR_INVALID_ARGUMENT;
+        config->weights[op] = atouint16(colon + 1);
+        config->total_weight += config->weights[op];
+    }
+    return config->total_weight > 0 ? ERR_NONE : ERR_INVALID_ARGUMENT;
+}
+
+static int read_image(const char* path, struct load_config* config)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return ERR_IO;
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* image = size > 8 ? malloc((size_t) size) : NULL;
+    if (image == NULL || fread(image, (size_t) size, 1, file) != 1) {
+        free(image);
+        fclose(file);
+        return ERR_IO;
+    }
+    fclose(file);
+    config->image = image;
+    config->image_size = (size_t) size;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Throughput and latencies of each kind of request, and in all
+ */
+static void report(const struct histogram* hist, const uint64_t* errors, double seconds, FILE* hist_file)
+{
+    struct histogram all;
+    memset(&all, 0, sizeof(all));
+    uint64_t all_errors = 0;
+
+    printf("op,requests,errors,per_sec,p50_ms,p99_ms,p999_ms,max_ms\n");
+    for (int op = 0; op <= NB_OPS; ++op) {
+        const struct histogram* h = op < NB_OPS ? &hist[op] : &all;
+        const uint64_t nb_errors = op < NB_OPS ? errors[op] : all_errors;
+        if (op < NB_OPS) {
+            hist_add(&all, h);
+            all_errors += nb_errors;
+            if (h->total == 0 && nb_errors == 0) continue;
+        }
+        printf("%s,%llu,%llu,%.1f,%.3f,%.3f,%.3f,%.3f\n", op < NB_OPS ? op_names[op] : "all",
+               (unsigned long long) h->total, (unsigned long long) nb_errors, (double) h->total / seconds,
+               hist_percentile_ms(h, 50), hist_percentile_ms(h, 99), hist_percentile_ms(h, 99.9),
+               (double) h->max_us / 1e3);
+    }
+
+    if (hist_file != NULL) {
+        fprintf(hist_file, "op,upto_us,count\n");
+        for (int op = 0; op < NB_OPS; ++op) {
+            for (size_t b = 0; b < HIST_SIZE; ++b) {
+                if (hist[op].counts[b] == 0) continue;
+                fprintf(hist_file, "%s,%llu,%llu\n", op_names[op], (unsigned long long) bucket_top(b),
+                        (unsigned long long) hist[op].counts[b]);
+            }
+        }
+    }
+}
+
+/********************************************************************/
+int main(int argc, char** argv)
+{
+    // A connection the server closed is reported by send(), not by a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    struct load_config config;
+    memset(&config, 0, sizeof(config));
+    config.nb_connections = DEFAULT_CONNECTIONS;
+    config.duration = DEFAULT_DURATION;
+    config.keep_alive = 1;
+    const char* image_path = DEFAULT_IMAGE;
+    const char* hist_path = NULL;
+    int err = parse_mix(DEFAULT_MIX, &config);
+
+    argc--;
+    argv++;
+    while (argc >= 1 && argv[0][0] == '-' && err == ERR_NONE) {
+        if (strcmp(argv[0], "-close") == 0) {
+            config.keep_alive = 0;
+            argc--;
+            argv++;
+            continue;
+        }
+        if (argc < 2) {
+            err = ERR_NOT_ENOUGH_ARGUMENTS;
+        } else if (strcmp(argv[0], "-c") == 0) {
+            config.nb_connections = atouint16(argv[1]);
+            if (config.nb_connections == 0 || config.nb_connections > MAX_CONNECTIONS) err = ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[0], "-d") == 0) {
+            config.duration = atouint32(argv[1]);
+            if (config.duration <= 0) err = ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[0], "-r") == 0) {
+            config.rate = atouint32(argv[1]);
+        } else if (strcmp(argv[0], "-mix") == 0) {
+            err = parse_mix(argv[1], &config);
+        } else if (strcmp(argv[0], "-image") == 0) {
+            image_path = argv[1];
+        } else if (strcmp(argv[0], "-hist") == 0) {
+            hist_path = argv[1];
+        } else {
+            err = ERR_INVALID_ARGUMENT;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (err == ERR_NONE && argc != 1) err = argc < 1 ? ERR_NOT_ENOUGH_ARGUMENTS : ERR_INVALID_COMMAND;
+    if (err == ERR_NONE) {
+        config.port = atouint16(argv[0]);
+        if (config.port == 0) err = ERR_INVALID_ARGUMENT;
+    }
+    if (err == ERR_NONE && config.weights[OP_INSERT] > 0) err = read_image(image_path, &config);
+
+    if (err == ERR_NONE) {
+        config.ids = calloc(MAX_IDS, sizeof(*config.ids));
+        err = config.ids == NULL ? ERR_OUT_OF_MEMORY : fetch_ids(&config);
+    }
+    struct load_thread* threads = err == ERR_NONE ? calloc(config.nb_connections, sizeof(struct load_thread)) : NULL;
+    if (err == ERR_NONE && threads == NULL) err = ERR_OUT_OF_MEMORY;
+    if (err != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+        free(config.ids);
+        free((void*) (uintptr_t) config.image);
+        return err;
+    }
+    fprintf(stderr, "%zu images to read; %u connections, %s loop, %.0f s\n", config.nb_ids,
+            config.nb_connections, config.rate > 0 ? "open" : "closed", config.duration);
+
+    pthread_t ids[MAX_CONNECTIONS];
+    unsigned started = 0;
+    const double start = now_s();
+    for (unsigned t = 0; t < config.nb_connections && err == ERR_NONE; ++t) {
+        struct load_thread* thread = &threads[t];
+        thread->config = &config;
+        thread->number = t;
+        thread->rng = 0x9E3779B97F4A7C15ULL * (t + 1);
+        thread->socket = -1;
+        thread->capacity = RESPONSE_BUFFER_SIZE;
+        thread->response = malloc(thread->capacity);
+        thread->own = malloc(MAX_OWN_IDS * sizeof(uint32_t));
+        thread->copy = config.image_size > 0 ? malloc(config.image_size) : NULL;
+        if (thread->response == NULL || thread->own == NULL || (config.image_size > 0 && thread->copy == NULL)) {
+            err = ERR_OUT_OF_MEMORY;
+            break;
+        }
+        if (thread->copy != NULL) memcpy(thread->copy, config.image, config.image_size);
+        if (pthread_create(&ids[t], NULL, load_worker, thread) != 0) {
+            err = ERR_THREADING;
+            break;
+        }
+        ++started;
+    }
+
+    struct histogram* hist = calloc(NB_OPS, sizeof(struct histogram));
+    uint64_t errors[NB_OPS] = { 0 };
+    for (unsigned t = 0; t < started; ++t) {
+        pthread_join(ids[t], NULL);
+        for (int op = 0; op < NB_OPS && hist != NULL; ++op) {
+            hist_add(&hist[op], &threads[t].hist[op]);
+            errors[op] += threads[t].errors[op];
+        }
+    }
+    const double seconds = now_s() - start;
+    if (hist == NULL) err = ERR_OUT_OF_MEMORY;
+
+    if (err == ERR_NONE) {
+        FILE* hist_file = hist_path != NULL ? fopen(hist_path, "w") : NULL;
+        if (hist_path != NULL && hist_file == NULL) err = ERR_IO;
+        report(hist, errors, seconds, hist_file);
+        if (hist_file != NULL) fclose(hist_file);
+    }
+
+    for (unsigned t = 0; t < config.nb_connections; ++t) {
+        free(threads[t].response);
+        free(threads[t].own);
+        free(threads[t].copy);
+    }
+    free(threads);
+    free(hist);
+    free(config.ids);
+    free((void*) (uintptr_t) config.image);
+    if (err != ERR_NONE) fprintf(stderr, "ERROR: %s\n", ERR_MSG(err));
+    return err;
+}
@@ -11,6 +11,15 @@
  * should be stored as raw bytes appended at the end of the imgFS
  * file and addressed by offsets in the metadata structure.
  *
+ * In the paged revision (IMGFS_REVISION_PAGED), the metadata array and
+ * the data each start on an IMGFS_PAGE_SIZE boundary, so that metadata
+ * writes cover whole pages; use metadata_offset() and data_offset()
+ * rather than assuming the original layout.
+ *
+ * Optional features live in an extension block, addressed by
+ * imgfs_header.ext_offset (0 if the imgFS has none), which is itself
+ * appended to the file the first time it is needed.
+ *
  * @author Mia Primorac
  */
 
@@ -41,6 +50,23 @@
 #define ORIG_RES  2
 #define NB_RES    3
 
+// Encodings in which derived (thumbnail, small...) images can be stored
+#define ENC_JPEG     0
+#define ENC_WEBP     1
+#define ENC_AVIF     2
+#define NB_ENCODINGS 3
+
+// Layout revisions, in imgfs_header.revision
+#define IMGFS_REVISION_ORIGINAL 0
+#define IMGFS_REVISION_PAGED    1 // metadata and data aligned on IMGFS_PAGE_SIZE
+
+#define IMGFS_PAGE_SIZE 4096
+
+// Max. number of variants (derived images in another encoding or size) per image
+#define MAX_VARIANTS 8
+// Max. width and height of an on-demand size
+#define MAX_VARIANT_RES 2048
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -51,8 +77,8 @@ struct imgfs_header {
     uint32_t nb_files;                                 // Current number of images
     uint32_t max_files;                                // Maximum number of images the system can contain
     uint16_t resized_res[2 * (NB_RES - 1)];            // Resolutions of thumbnail and small images
-    uint32_t unused_32;                                // Unused 32-bit unsigned int
-    uint64_t unused_64;                                // Unused 64-bit unsigned int
+    uint32_t revision;                                 // Layout revision (one of the IMGFS_REVISION_ codes)
+    uint64_t ext_offset;                               // Position of the extension block, 0 if none
 };
 
 struct img_metadata {
@@ -65,6 +91,32 @@ struct img_metadata {
     uint16_t unused_16;                                // Not used, reserved for future use
 };
 
+struct imgfs_ext {
+    uint64_t variant_index;                            // Position of max_files variant table offsets, 0 if none
+    uint64_t data_end;                                 // Logical end of the data, if preallocated
+    uint64_t prealloc_chunk;                           // Size by which the data region grows, 0 if not preallocated
+    uint64_t arena_segment;                            // Size of the segments holding derived images, 0 if none
+    uint64_t arena_next;                               // Next free position in the current segment
+    uint64_t arena_end;                                // End of the current segment
+    uint64_t prealloc_end;                             // End of the region allocated to the file so far, if preallocated
+    uint64_t reserved;                                 // Not used, reserved for future use (zero)
+};
+
+struct img_variant {
+    uint16_t width;                                    // Box the image was resized to fit in
+    uint16_t height;
+    uint16_t encoding;                                 // One of the ENC_ codes
+    uint16_t is_valid;                                 // Indicates whether the entry is in use
+    uint32_t size;                                     // Memory size (in bytes) of the variant
+    uint32_t check;                                    // First bytes of the SHA-256 of the content, 0 if not recorded
+    uint64_t offset;                                   // Position of the variant in the image database file
+};
+
+struct img_variant_table {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];           // Hash of the image the variants were made from
+    struct img_variant variants[MAX_VARIANTS];
+};
+
 struct imgfs_file {
     FILE* file;                                        // File containing everything
     struct imgfs_header header;                               // Header of the image database
@@ -143,6 +195,33 @@ int do_list(const struct imgfs_file* imgfs_file,
  */
 int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Creates the imgFS called imgfs_filename with the given layout
+ *        revision (do_create() uses IMGFS_REVISION_ORIGINAL).
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param revision One of the IMGFS_REVISION_ codes
+ */
+int do_create_revision(const char* imgfs_filename, struct imgfs_file* imgfs_file, uint32_t revision);
+
+/**
+ * @brief Position of the metadata array in the imgFS file.
+ *
+ * @param header The header of the imgFS
+ * @return The position, in bytes
+ */
+uint64_t metadata_offset(const struct imgfs_header* header);
+
+/**
+ * @brief Position of the first byte after the metadata array (and its
+ *        padding, in the paged revision).
+ *
+ * @param header The header of the imgFS
+ * @return The position, in bytes
+ */
+uint64_t data_offset(const struct imgfs_header* header);
+
 /**
  * @brief Deletes an image from a imgFS imgFS.
  *
@@ -166,6 +245,30 @@ int do_delete(const char* img_id, struct imgfs_file* imgfs_file);
  */
 int resolution_atoi(const char* resolution);
 
+/**
+ * @brief Buffer that successive reads reuse: grown when an image does not
+ *        fit, never shrunk, so that reads of images that fit allocate
+ *        nothing.
+ */
+struct read_buffer {
+    char* data;       // NULL until the first read
+    size_t capacity;
+};
+
+/**
+ * @brief Makes a reused buffer at least size bytes big.
+ *
+ * @param buffer The buffer
+ * @param size The size needed
+ * @return Some error code. 0 if no error.
+ */
+int read_buffer_reserve(struct read_buffer* buffer, size_t size);
+
+/**
+ * @brief Frees the content of a reused buffer, which may then be reused again.
+ */
+void read_buffer_free(struct read_buffer* buffer);
+
 /**
  * @brief Reads the content of an image from a imgFS.
  *
@@ -179,6 +282,79 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Reads the content of an image from a imgFS into a reused buffer.
+ *
+ * As do_read, but the buffer is only allocated (or grown) when the image
+ * does not fit in it; it is kept by the caller on error.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param buffer The buffer the image content is read into
+ * @param image_size Location of the image size variable
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_into(const char* img_id, int resolution, struct read_buffer* buffer,
+                 uint32_t* image_size, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Reads the content of an image from a imgFS in a given encoding.
+ *
+ * Originals are always returned as stored. Derived resolutions in another
+ * encoding than ENC_JPEG are created on first read and kept as variants.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param resolution The desired resolution for the image read.
+ * @param encoding The desired encoding (one of the ENC_ codes).
+ * @param buffer The buffer the image content is read into (see do_read_into)
+ * @param image_size Location of the image size variable
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_encoded(const char* img_id, int resolution, int encoding, struct read_buffer* buffer,
+                    uint32_t* image_size, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Reads an image from a imgFS resized to fit in any box.
+ *
+ * Sizes other than the preset ones are created on first read and kept as
+ * variants (up to MAX_VARIANTS per image; beyond that they are created on
+ * each read). A box at least as big as the original yields the original.
+ *
+ * @param img_id The ID of the image to be read.
+ * @param width, height The box, at most MAX_VARIANT_RES each.
+ * @param encoding The desired encoding (one of the ENC_ codes); on return,
+ *        the encoding of the image read (ENC_JPEG for an original).
+ * @param buffer The buffer the image content is read into (see do_read_into)
+ * @param image_size Location of the image size variable
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_read_sized(const char* img_id, uint16_t width, uint16_t height, int* encoding,
+                  struct read_buffer* buffer, uint32_t* image_size, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Reads the extension block of a imgFS (all zeros if it has none).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param ext Where to put the extension block
+ * @return Some error code. 0 if no error.
+ */
+int read_ext(const struct imgfs_file* imgfs_file, struct imgfs_ext* ext);
+
+/**
+ * @brief Writes the extension block of a imgFS, appending it to the file
+ *        (and updating the header) if it has none yet. Like the header,
+ *        the block reaches the file as the commit mode says (see
+ *        imgfs_commit.h), so the caller commits the change.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param ext The extension block to write
+ * @return Some error code. 0 if no error.
+ */
+int write_ext(struct imgfs_file* imgfs_file, const struct imgfs_ext* ext);
+
 /**
  * @brief Insert image in the imgFS file
  *
@@ -190,6 +366,35 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 int do_insert(const char* image_buffer, size_t image_size,
               const char* img_id, struct imgfs_file* imgfs_file);
 
+// Max. number of threads hashing and probing the images of a batch
+#define INSERT_BATCH_MAX_THREADS 16
+
+struct insert_request {
+    const char* image_buffer;                          // Raw image content
+    size_t image_size;                                 // Image size
+    const char* img_id;                                // Image ID
+    int result;                                        // Set by do_insert_batch(): error code for this image
+};
+
+/**
+ * @brief Inserts several images in the imgFS file at once.
+ *
+ * The images are hashed and their dimensions probed in parallel,
+ * duplicates are resolved within the batch and against the imgFS, the new
+ * contents are appended in one run and all the slots are committed
+ * together. Each image succeeds or fails on its own, as with do_insert().
+ *
+ * @param requests The images, with their result on return
+ * @param nb_requests Number of images
+ * @param nb_threads Number of threads probing the images; 0 means one per
+ *        online CPU (at most INSERT_BATCH_MAX_THREADS either way)
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code if the batch as a whole failed (then no image
+ *         was inserted, or their commit failed). 0 otherwise.
+ */
+int do_insert_batch(struct insert_request* requests, size_t nb_requests, size_t nb_threads,
+                    struct imgfs_file* imgfs_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
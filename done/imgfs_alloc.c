@@ -0,0 +1,244 @@
+/**
+ * @file imgfs_alloc.c
+ * @brief Placement of the blobs appended to an imgFS.
+ */
+
+#include "imgfs_alloc.h"
+#include "imgfs_commit.h"
+#include "imgfs_direct.h"
+#include "imgfs_trace.h"
+#include "imgfs_slowlog.h"
+#include "error.h"
+
+#include <fcntl.h>    // posix_fallocate()
+#include <sys/stat.h> // fstat()
+
+/*******************************************************************
+ * Grows the file by whole chunks until it holds `end` bytes; the file
+ * size is looked up only past the region known to be allocated
+ */
+static int reserve(FILE* file, struct imgfs_ext* ext, uint64_t end)
+{
+    if (end <= ext->prealloc_end) return ERR_NONE;
+
+    struct stat st;
+    if (fflush(file) != 0 || fstat(fileno(file), &st) != 0) return ERR_IO;
+    uint64_t size = (uint64_t) st.st_size;
+    if (end > size) {
+        const uint64_t grow = (end - size + ext->prealloc_chunk - 1) / ext->prealloc_chunk * ext->prealloc_chunk;
+        if (posix_fallocate(fileno(file), (off_t) size, (off_t) grow) != 0) return ERR_IO;
+        size += grow;
+    }
+    ext->prealloc_end = size;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Preallocate from now on
+ */
+int enable_prealloc(struct imgfs_file* imgfs_file, uint64_t chunk_size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    if (chunk_size < PREALLOC_MIN_CHUNK) return ERR_INVALID_ARGUMENT;
+
+    struct imgfs_ext ext;
+    int err = read_ext(imgfs_file, &ext);
+    if (err != ERR_NONE) return err;
+    if (ext.prealloc_chunk != 0) {
+        ext.prealloc_chunk = chunk_size;
+        err = write_ext(imgfs_file, &ext);
+        return err == ERR_NONE ? commit_changes(imgfs_file) : err;
+    }
+
+    //The data starts after the extension block
+    if (imgfs_file->header.ext_offset == 0) {
+        err = write_ext(imgfs_file, &ext);
+        if (err != ERR_NONE) return err;
+    }
+    if (fseek(imgfs_file->file, 0, SEEK_END) != 0) return ERR_IO;
+    const long end = ftell(imgfs_file->file);
+    if (end < 0) return ERR_IO;
+
+    ext.data_end = (uint64_t) end;
+    ext.prealloc_chunk = chunk_size;
+    ext.prealloc_end = 0;
+    err = reserve(imgfs_file->file, &ext, ext.data_end + chunk_size);
+    if (err == ERR_NONE) err = write_ext(imgfs_file, &ext);
+    return err == ERR_NONE ? commit_changes(imgfs_file) : err;
+}
+
+/*******************************************************************
+ * Derived images in arena segments from now on
+ */
+int enable_arena(struct imgfs_file* imgfs_file, uint64_t segment_size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    if (segment_size < ARENA_MIN_SEGMENT) return ERR_INVALID_ARGUMENT;
+
+    struct imgfs_ext ext;
+    int err = read_ext(imgfs_file, &ext);
+    if (err != ERR_NONE) return err;
+    ext.arena_segment = segment_size; // the current segment, if any, is kept
+    err = write_ext(imgfs_file, &ext);
+    return err == ERR_NONE ? commit_changes(imgfs_file) : err;
+}
+
+/*******************************************************************
+ * Room for a blob starting at a multiple of `align`
+ */
+int alloc_data_aligned(struct imgfs_file* imgfs_file, size_t size, uint64_t align, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(offset);
+    if (align == 0) return ERR_INVALID_ARGUMENT;
+
+    struct imgfs_ext ext;
+    int err = read_ext(imgfs_file, &ext);
+    if (err != ERR_NONE) return err;
+
+    if (ext.prealloc_chunk == 0) {
+        if (fseek(imgfs_file->file, 0, SEEK_END) != 0) return ERR_IO;
+        const long end = ftell(imgfs_file->file);
+        if (end < 0) return ERR_IO;
+        *offset = ((uint64_t) end + align - 1) / align * align;
+    } else {
+        *offset = (ext.data_end + align - 1) / align * align;
+        ext.data_end = *offset + size;
+        err = reserve(imgfs_file->file, &ext, ext.data_end);
+        if (err == ERR_NONE) err = write_ext(imgfs_file, &ext);
+        if (err != ERR_NONE) return err;
+    }
+
+    mark_data_dirty(imgfs_file);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Room for a blob
+ */
+int alloc_data(struct imgfs_file* imgfs_file, size_t size, uint64_t* offset)
+{
+    return alloc_data_aligned(imgfs_file, size, 1, offset);
+}
+
+/*******************************************************************
+ * Room for a blob, and the blob
+ */
+int append_data(struct imgfs_file* imgfs_file, const void* data, size_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(data);
+
+    if (direct_applies(imgfs_file, size)) {
+        // Whole blocks, so that the blob can be read back with O_DIRECT as well
+        const size_t rounded = (size + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+        int err = alloc_data_aligned(imgfs_file, rounded, DIRECT_IO_ALIGN, offset);
+        if (err != ERR_NONE) return err;
+        const uint64_t span_start = trace_now();
+        err = direct_write(imgfs_file, *offset, data, size);
+        trace_span("disk write", span_start);
+        slowlog_disk_write(size);
+        return err;
+    }
+
+    int err = alloc_data(imgfs_file, size, offset);
+    if (err != ERR_NONE) return err;
+
+    const uint64_t span_start = trace_now();
+    if (fseek(imgfs_file->file, (long) *offset, SEEK_SET) != 0
+        || fwrite(data, size, 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    trace_span("disk write", span_start);
+    slowlog_disk_write(size);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Starts a new arena segment, made of whole pages
+ */
+static int new_segment(struct imgfs_file* imgfs_file, struct imgfs_ext* ext)
+{
+    uint64_t start = 0;
+    int err = alloc_data_aligned(imgfs_file, ext->arena_segment, IMGFS_PAGE_SIZE, &start);
+    if (err != ERR_NONE) return err;
+    //Make the file hold the whole segment, so that the next blob goes after it
+    if (fflush(imgfs_file->file) != 0
+        || posix_fallocate(fileno(imgfs_file->file), (off_t) start, (off_t) ext->arena_segment) != 0) {
+        return ERR_IO;
+    }
+    //The allocation may have changed the extension block
+    const uint64_t segment = ext->arena_segment;
+    err = read_ext(imgfs_file, ext);
+    if (err != ERR_NONE) return err;
+    ext->arena_segment = segment;
+    ext->arena_next = start;
+    ext->arena_end = start + segment;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Room for a derived image, and the image
+ */
+int append_derived(struct imgfs_file* imgfs_file, const void* data, size_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(data);
+    M_REQUIRE_NON_NULL(offset);
+
+    struct imgfs_ext ext;
+    int err = read_ext(imgfs_file, &ext);
+    if (err != ERR_NONE) return err;
+    if (ext.arena_segment == 0 || size > ext.arena_segment) {
+        return append_data(imgfs_file, data, size, offset);
+    }
+
+    if (ext.arena_end - ext.arena_next < size) {
+        err = new_segment(imgfs_file, &ext);
+        if (err != ERR_NONE) return err;
+    }
+    *offset = ext.arena_next;
+    ext.arena_next += size;
+    err = write_ext(imgfs_file, &ext);
+    if (err != ERR_NONE) return err;
+    mark_data_dirty(imgfs_file);
+
+    const uint64_t span_start = trace_now();
+    if (fseek(imgfs_file->file, (long) *offset, SEEK_SET) != 0
+        || fwrite(data, size, 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    trace_span("disk write", span_start);
+    slowlog_disk_write(size);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * A stored blob
+ */
+int read_data(struct imgfs_file* imgfs_file, uint64_t offset, size_t size, void* buffer)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    const uint64_t span_start = trace_now();
+    if (direct_applies(imgfs_file, size)) {
+        // The FILE may still hold writes that are not on disk yet
+        if (fflush(imgfs_file->file) != 0) return ERR_IO;
+        const int err = direct_read(imgfs_file, offset, buffer, size);
+        trace_span("disk read", span_start);
+        slowlog_disk_read(size);
+        return err;
+    }
+    if (fseek(imgfs_file->file, (long) offset, SEEK_SET) != 0
+        || fread(buffer, size, 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    trace_span("disk read", span_start);
+    slowlog_disk_read(size);
+    return ERR_NONE;
+}
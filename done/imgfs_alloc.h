@@ -0,0 +1,118 @@
+/**
+ * @file imgfs_alloc.h
+ * @brief Placement of the blobs appended to an imgFS.
+ *
+ * By default blobs go at the end of the file, which then grows by a few
+ * KB to a few MB at a time. An imgFS may instead preallocate its data
+ * region in large chunks (see enable_prealloc()): blobs are then handed
+ * out from the reserved tail, and the logical end of the data, kept in the
+ * extension block, is distinct from the size of the file. Sequential
+ * ingest then gets contiguous extents from the filesystem.
+ *
+ * An imgFS may also keep its derived images (thumbnails, small images
+ * and variants) apart from the originals, in arena segments (see
+ * enable_arena()): a segment is reserved as a whole and filled with
+ * derived images only, so that a gallery reads a few contiguous pages
+ * instead of one scattered page per image.
+ *
+ * With O_DIRECT I/O enabled (see imgfs_direct.h), the large blobs are
+ * placed at block boundaries and take whole blocks.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PREALLOC_MIN_CHUNK (1UL << 20) // 1 MiB
+#define ARENA_MIN_SEGMENT (64UL << 10)  // 64 KiB
+
+/**
+ * @brief Preallocates the data region of an imgFS from now on.
+ *
+ * The logical end of the data starts at the current end of the file (after
+ * the extension block, which is created if needed).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param chunk_size Size by which the reserved tail grows, at least
+ *        PREALLOC_MIN_CHUNK.
+ * @return Some error code. 0 if no error.
+ */
+int enable_prealloc(struct imgfs_file* imgfs_file, uint64_t chunk_size);
+
+/**
+ * @brief Places the derived images of an imgFS in arena segments from now on.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param segment_size Size of each segment, at least ARENA_MIN_SEGMENT;
+ *        derived images larger than that are placed like originals.
+ * @return Some error code. 0 if no error.
+ */
+int enable_arena(struct imgfs_file* imgfs_file, uint64_t segment_size);
+
+/**
+ * @brief Reserves room for a blob at the logical end of the data.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param size Size of the blob
+ * @param offset Location of the position of the blob
+ * @return Some error code. 0 if no error.
+ */
+int alloc_data(struct imgfs_file* imgfs_file, size_t size, uint64_t* offset);
+
+/**
+ * @brief Reserves room for a blob at the first multiple of align from the
+ *        logical end of the data; the bytes skipped read as zeros.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param size Size of the blob
+ * @param align Alignment of its position
+ * @param offset Location of the position of the blob
+ * @return Some error code. 0 if no error.
+ */
+int alloc_data_aligned(struct imgfs_file* imgfs_file, size_t size, uint64_t align, uint64_t* offset);
+
+/**
+ * @brief Reserves room for a blob and writes it there.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param data The blob
+ * @param size Its size
+ * @param offset Location of the position of the blob
+ * @return Some error code. 0 if no error.
+ */
+int append_data(struct imgfs_file* imgfs_file, const void* data, size_t size, uint64_t* offset);
+
+/**
+ * @brief Reserves room for a derived image and writes it there: in the
+ *        current arena segment if the imgFS has arenas, else like
+ *        append_data().
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param data The derived image
+ * @param size Its size
+ * @param offset Location of the position of the image
+ * @return Some error code. 0 if no error.
+ */
+int append_derived(struct imgfs_file* imgfs_file, const void* data, size_t size, uint64_t* offset);
+
+/**
+ * @brief Reads a stored blob.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param offset Position of the blob
+ * @param size Its size
+ * @param buffer Where to put it
+ * @return Some error code. 0 if no error.
+ */
+int read_data(struct imgfs_file* imgfs_file, uint64_t offset, size_t size, void* buffer);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,789 @@
+/**
+ * @file imgfs_commit.c
+ * @brief Commit layer for the header and metadata of an imgFS.
+ *
+ * struct imgfs_file has a fixed layout, so the commit state of each open
+ * imgFS lives in a registry keyed by the imgfs_file (and its FILE*).
+ * A store without an entry is in COMMIT_DIRECT mode.
+ *
+ * In the other modes, a commit syncs the blobs appended since the last
+ * one, then appends the changed parts to the journal (see imgfs_journal.h)
+ * and syncs it; the header, slots and extension block themselves are
+ * written to the imgFS, in file order, at the next checkpoint: when the
+ * journal reaches JOURNAL_MAX_SIZE, and at do_close().
+ *
+ * In the paged revision, the metadata array is written by whole
+ * IMGFS_PAGE_SIZE pages of the file, never by single slots, so that the
+ * kernel does not have to read a page back to merge a partial write. The
+ * pages are built from a shadow copy of the array as last committed (or,
+ * in COMMIT_DIRECT mode, from the pages in the file), with only the marked
+ * slots taken from memory, so that the other slots keep their bytes in the
+ * file whatever their in-memory copy holds. In the original layout, where
+ * slots straddle pages anyway, only the marked slots are written (by runs).
+ */
+
+#include "imgfs_commit.h"
+#include "imgfs_journal.h"
+#include "imgfs_trace.h"
+#include "error.h"
+#include "util.h"   // for _unused
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> // fdatasync()
+
+// What the second half of a commit must sync
+#define SYNC_JOURNAL 1
+
+// Marks of the header and of each metadata slot
+#define MARK_DIRTY     1 // changed since the last journal transaction
+#define MARK_JOURNALED 2 // in the journal, not yet in the imgFS
+
+struct commit_state {
+    struct imgfs_file* imgfs_file;
+    FILE* file;
+    FILE* journal;
+    char journal_path[FILENAME_MAX];
+    int mode;
+    struct imgfs_lock* caller_lock;
+
+    // Written under the caller lock
+    unsigned char* dirty;            // MARK_ flags of each metadata slot
+    struct img_metadata* shadow;     // the metadata array as last committed
+    unsigned char* dirty_pages;      // metadata pages (see slot_pages()) to write at the next checkpoint
+    size_t nb_pages;
+    int header_dirty;                // MARK_ flags of the header
+    int ext_dirty;                   // MARK_ flags of the extension block...
+    struct imgfs_ext ext;            // ...and its last marked content
+    int data_dirty;                  // blobs appended since the last commit
+
+    pthread_mutex_t lock;            // protects what follows
+    pthread_cond_t synced;           // broadcast at the end of each group sync
+    pthread_cond_t wakeup;           // signaled to stop the flusher
+    int pending;                     // something is marked but not journaled
+    uint64_t requested;              // number of commits requested...
+    uint64_t durable;                // ...and made durable
+    int syncing;
+    int error;                       // of the last sync, for the commits it covered
+    int stopping;
+    int has_flusher;
+    pthread_t flusher;
+
+    struct commit_state* next;       // in the registry
+};
+
+static struct commit_state* states = NULL; // one per open imgFS in a mode other than COMMIT_DIRECT
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static int default_mode = COMMIT_DIRECT;
+static struct imgfs_lock* default_caller_lock = NULL;
+
+static const char* const mode_names[NB_COMMIT_MODES] = { "direct", "per-op", "group", "async" };
+
+/*******************************************************************
+ * Name to mode code
+ */
+int commit_mode_atoi(const char* mode)
+{
+    if (mode == NULL) return -1;
+
+    for (int i = 0; i < NB_COMMIT_MODES; ++i) {
+        if (strcmp(mode, mode_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+/*******************************************************************
+ * Mode of the stores opened from now on
+ */
+int commit_configure(int mode, struct imgfs_lock* caller_lock)
+{
+    if (mode < 0 || mode >= NB_COMMIT_MODES) return ERR_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&registry_lock);
+    default_mode = mode;
+    default_caller_lock = caller_lock;
+    pthread_mutex_unlock(&registry_lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Commit state of a store, NULL in COMMIT_DIRECT mode
+ */
+static struct commit_state* find_state(const struct imgfs_file* imgfs_file)
+{
+    struct commit_state* found = NULL;
+    pthread_mutex_lock(&registry_lock);
+    for (struct commit_state* st = states; st != NULL && found == NULL; st = st->next) {
+        if (st->imgfs_file == imgfs_file && st->file == imgfs_file->file) found = st;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return found;
+}
+
+/*******************************************************************
+ * Single writes of the header and of runs of metadata pages
+ */
+static int write_header(struct imgfs_file* imgfs_file)
+{
+    // In the paged revision, the header has its page to itself
+    char page[IMGFS_PAGE_SIZE];
+    size_t size = sizeof(struct imgfs_header);
+    memset(page, 0, sizeof(page));
+    memcpy(page, &imgfs_file->header, size);
+    if (imgfs_file->header.revision == IMGFS_REVISION_PAGED) size = sizeof(page);
+
+    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0 || fwrite(page, size, 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+// Index, from the first page of the metadata array, of the pages holding a
+// slot; in the original layout, the "pages" are the slots themselves
+static void slot_pages(const struct imgfs_header* header, size_t index, size_t* first, size_t* last)
+{
+    if (header->revision != IMGFS_REVISION_PAGED) {
+        *first = *last = index;
+        return;
+    }
+    const uint64_t array_page = metadata_offset(header) / IMGFS_PAGE_SIZE;
+    const uint64_t start = metadata_offset(header) + index * sizeof(struct img_metadata);
+    *first = (size_t) (start / IMGFS_PAGE_SIZE - array_page);
+    *last = (size_t) ((start + sizeof(struct img_metadata) - 1) / IMGFS_PAGE_SIZE - array_page);
+}
+
+// File range of pages first to last (from the first page of the metadata array), clipped to the array
+static void pages_range(const struct imgfs_header* header, size_t first, size_t last,
+                        uint64_t* from, uint64_t* to)
+{
+    const uint64_t start = metadata_offset(header);
+    const uint64_t end = start + (uint64_t) header->max_files * sizeof(struct img_metadata);
+    const uint64_t array_page = start / IMGFS_PAGE_SIZE;
+
+    *from = (array_page + first) * IMGFS_PAGE_SIZE;
+    *to = (array_page + last + 1) * IMGFS_PAGE_SIZE;
+    if (header->revision != IMGFS_REVISION_PAGED) {
+        *from = start + first * sizeof(struct img_metadata);
+        *to = start + (last + 1) * sizeof(struct img_metadata);
+    }
+    if (*from < start) *from = start;
+    if (*to > end) *to = end;
+}
+
+// Pages first to last, taken from array (a whole metadata array)
+static int write_metadata_pages(struct imgfs_file* imgfs_file, const struct img_metadata* array,
+                                size_t first, size_t last)
+{
+    uint64_t from, to;
+    pages_range(&imgfs_file->header, first, last, &from, &to);
+    const char* bytes = (const char*) array + (from - metadata_offset(&imgfs_file->header));
+    if (fseek(imgfs_file->file, (long) from, SEEK_SET) != 0
+        || fwrite(bytes, (size_t) (to - from), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+// Pages first to last as they are in the file, with the slots given patched in from memory
+static int patch_metadata_pages(struct imgfs_file* imgfs_file, size_t first, size_t last,
+                                const uint32_t* indices, size_t count)
+{
+    if (imgfs_file->header.revision != IMGFS_REVISION_PAGED) {
+        // The run is made of the given slots only
+        return write_metadata_pages(imgfs_file, imgfs_file->metadata, first, last);
+    }
+
+    uint64_t from, to;
+    pages_range(&imgfs_file->header, first, last, &from, &to);
+    char* pages = malloc((size_t) (to - from));
+    if (pages == NULL) return ERR_OUT_OF_MEMORY;
+    int err = ERR_NONE;
+    if (fseek(imgfs_file->file, (long) from, SEEK_SET) != 0
+        || fread(pages, (size_t) (to - from), 1, imgfs_file->file) != 1) {
+        err = ERR_IO;
+    }
+    const uint64_t start = metadata_offset(&imgfs_file->header);
+    for (size_t i = 0; i < count && err == ERR_NONE; ++i) {
+        const uint64_t slot = start + (uint64_t) indices[i] * sizeof(struct img_metadata);
+        memcpy(pages + (slot - from), &imgfs_file->metadata[indices[i]], sizeof(struct img_metadata));
+    }
+    if (err == ERR_NONE
+        && (fseek(imgfs_file->file, (long) from, SEEK_SET) != 0
+            || fwrite(pages, (size_t) (to - from), 1, imgfs_file->file) != 1)) {
+        err = ERR_IO;
+    }
+    free(pages);
+    return err;
+}
+
+// Writes the pages of slots given in increasing order, merging neighbour pages
+static int write_slot_pages(struct imgfs_file* imgfs_file, const uint32_t* indices, size_t count)
+{
+    int err = ERR_NONE;
+    size_t run_first = 0;
+    size_t run_last = 0;
+    size_t run_start = 0; // first of the indices in the run
+    for (size_t i = 0; i < count && err == ERR_NONE; ++i) {
+        size_t first, last;
+        slot_pages(&imgfs_file->header, indices[i], &first, &last);
+        if (i > 0 && first >= run_first && first <= run_last + 1) {
+            if (last > run_last) run_last = last;
+            continue;
+        }
+        if (i > 0) err = patch_metadata_pages(imgfs_file, run_first, run_last, indices + run_start, i - run_start);
+        run_first = first;
+        run_last = last;
+        run_start = i;
+    }
+    if (err == ERR_NONE && count > 0) {
+        err = patch_metadata_pages(imgfs_file, run_first, run_last, indices + run_start, count - run_start);
+    }
+    return err;
+}
+
+static int write_ext_block(struct imgfs_file* imgfs_file, const struct imgfs_ext* ext)
+{
+    if (fseek(imgfs_file->file, (long) imgfs_file->header.ext_offset, SEEK_SET) != 0
+        || fwrite(ext, sizeof(struct imgfs_ext), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+static void mark_pages(struct commit_state* st, size_t index)
+{
+    size_t first, last;
+    slot_pages(&st->imgfs_file->header, index, &first, &last);
+    for (size_t p = first; p <= last; ++p) st->dirty_pages[p] = 1;
+}
+
+/*******************************************************************
+ * Writes the marked parts in file order, merging neighbour pages, and
+ * hands them to the kernel. Called with the caller lock held.
+ */
+static int write_marked(struct commit_state* st)
+{
+    pthread_mutex_lock(&st->lock);
+    st->pending = 0;
+    pthread_mutex_unlock(&st->lock);
+
+    int err = ERR_NONE;
+    if (st->header_dirty) {
+        st->header_dirty = 0;
+        err = write_header(st->imgfs_file);
+    }
+
+    // Only the marked slots have something new for the shadow copy
+    const struct imgfs_file* imgfs_file = st->imgfs_file;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (st->dirty[i] & MARK_DIRTY) st->shadow[i] = imgfs_file->metadata[i];
+    }
+
+    size_t p = 0;
+    while (p < st->nb_pages && err == ERR_NONE) {
+        if (!st->dirty_pages[p]) {
+            ++p;
+            continue;
+        }
+        size_t end = p;
+        while (end < st->nb_pages && st->dirty_pages[end]) {
+            st->dirty_pages[end++] = 0;
+        }
+        err = write_metadata_pages(st->imgfs_file, st->shadow, p, end - 1);
+        p = end;
+    }
+    if (st->ext_dirty && err == ERR_NONE) {
+        st->ext_dirty = 0;
+        err = write_ext_block(st->imgfs_file, &st->ext);
+    }
+    if (err == ERR_NONE) memset(st->dirty, 0, st->imgfs_file->header.max_files);
+
+    if (fflush(st->file) != 0 && err == ERR_NONE) err = ERR_IO;
+    return err;
+}
+
+/*******************************************************************
+ * Makes what was handed to the kernel durable
+ */
+static int sync_file(const struct commit_state* st)
+{
+    return fdatasync(fileno(st->file)) == 0 ? ERR_NONE : ERR_IO;
+}
+
+/*******************************************************************
+ * Makes every marked part durable in the imgFS itself, after which the
+ * journal is of no use anymore. Called with the caller lock held.
+ */
+static int checkpoint(struct commit_state* st)
+{
+    int err = write_marked(st);
+    if (err == ERR_NONE) err = sync_file(st);
+    if (err == ERR_NONE) err = journal_reset(st->journal);
+    return err;
+}
+
+/*******************************************************************
+ * Appends the parts changed since the last transaction to the journal.
+ * Called with the caller lock held.
+ */
+static int journal_dirty(struct commit_state* st)
+{
+    pthread_mutex_lock(&st->lock);
+    st->pending = 0;
+    pthread_mutex_unlock(&st->lock);
+
+    const struct imgfs_file* imgfs_file = st->imgfs_file;
+    uint32_t nb_records = 0;
+    int err = ERR_NONE;
+    if (st->header_dirty & MARK_DIRTY) {
+        err = journal_append(st->journal, JOURNAL_HEADER, 0, &imgfs_file->header, sizeof(struct imgfs_header));
+        st->header_dirty = MARK_JOURNALED;
+        ++nb_records;
+    }
+    for (uint32_t i = 0; i < imgfs_file->header.max_files && err == ERR_NONE; ++i) {
+        if (st->dirty[i] & MARK_DIRTY) {
+            err = journal_append(st->journal, JOURNAL_METADATA, i, &imgfs_file->metadata[i],
+                                 sizeof(struct img_metadata));
+            st->shadow[i] = imgfs_file->metadata[i];
+            st->dirty[i] = MARK_JOURNALED;
+            ++nb_records;
+        }
+    }
+    if ((st->ext_dirty & MARK_DIRTY) && err == ERR_NONE) {
+        err = journal_append(st->journal, JOURNAL_EXT, 0, &st->ext, sizeof(struct imgfs_ext));
+        st->ext_dirty = MARK_JOURNALED;
+        ++nb_records;
+    }
+    if (err == ERR_NONE && nb_records > 0) err = journal_commit(st->journal, nb_records);
+    return err;
+}
+
+/*******************************************************************
+ * First half of a commit, with the caller lock held: syncs the new
+ * blobs and journals the changes, or checkpoints when the journal is full (or could not take
+ * them, as a torn transaction would hide the ones after it). Sets
+ * *to_sync to what commit_sync() must then do.
+ */
+static int commit_prepare(struct commit_state* st, int* to_sync)
+{
+    *to_sync = 0;
+    if (fflush(st->file) != 0) return ERR_IO;
+    if (ftell(st->journal) >= JOURNAL_MAX_SIZE) return checkpoint(st);
+
+    // Blobs are not journaled: the ones appended since the last commit must
+    // be durable before a commit record pointing to them can reach the disk
+    if (st->data_dirty) {
+        const uint64_t span_start = trace_now();
+        const int err = sync_file(st);
+        trace_span("disk sync", span_start);
+        if (err != ERR_NONE) return err;
+        st->data_dirty = 0;
+    }
+
+    if (journal_dirty(st) == ERR_NONE) {
+        *to_sync = SYNC_JOURNAL;
+        return ERR_NONE;
+    }
+    return checkpoint(st);
+}
+
+/*******************************************************************
+ * Second half of a commit, which does not need the caller lock
+ */
+static int commit_sync(const struct commit_state* st, int to_sync)
+{
+    if (!(to_sync & SYNC_JOURNAL)) return ERR_NONE;
+
+    const uint64_t span_start = trace_now();
+    const int err = journal_sync(st->journal);
+    trace_span("disk sync", span_start);
+    return err;
+}
+
+/*******************************************************************
+ * Release the caller lock for a sync, and take it back: the wait goes
+ * to the commit site, the rest of the hold to the caller's
+ */
+static enum lock_site unlock_caller(const struct commit_state* st)
+{
+    const enum lock_site site = (enum lock_site) st->caller_lock->holder;
+    imgfs_lock_release(st->caller_lock);
+    return site;
+}
+
+static void relock_caller(const struct commit_state* st, enum lock_site site)
+{
+    imgfs_lock_retake(st->caller_lock, LOCK_SITE_COMMIT, site);
+}
+
+/*******************************************************************
+ * Group commit: the first operation to find no sync running journals
+ * everything marked so far and syncs it without the caller lock; the
+ * operations committing meanwhile wait for it, and the next of them
+ * leads the following batch.
+ */
+static int group_commit(struct commit_state* st, uint64_t ticket)
+{
+    pthread_mutex_lock(&st->lock);
+    while (st->durable < ticket) {
+        if (!st->syncing) {
+            st->syncing = 1;
+            const uint64_t target = st->requested;
+            pthread_mutex_unlock(&st->lock);
+
+            int to_sync = 0;
+            int err = commit_prepare(st, &to_sync);
+            const enum lock_site site = unlock_caller(st);
+            if (err == ERR_NONE) err = commit_sync(st, to_sync);
+
+            pthread_mutex_lock(&st->lock);
+            st->syncing = 0;
+            st->durable = target;
+            st->error = err;
+            pthread_cond_broadcast(&st->synced);
+            pthread_mutex_unlock(&st->lock);
+            relock_caller(st, site);
+            return err;
+        }
+
+        // Let the other operations run (and join the next batch) during the sync
+        const enum lock_site site = unlock_caller(st);
+        pthread_cond_wait(&st->synced, &st->lock);
+        pthread_mutex_unlock(&st->lock);
+        relock_caller(st, site);
+        pthread_mutex_lock(&st->lock);
+    }
+    const int err = st->error;
+    pthread_mutex_unlock(&st->lock);
+    return err;
+}
+
+/*******************************************************************
+ * Async mode: journals and syncs every COMMIT_ASYNC_INTERVAL_MS
+ */
+static void* commit_flusher(void* arg)
+{
+    struct commit_state* st = arg;
+
+    // Signals are handled by the main thread only
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&st->lock);
+    while (!st->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += COMMIT_ASYNC_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&st->wakeup, &st->lock, &deadline);
+        if (st->stopping || (!st->pending && st->durable == st->requested)) continue;
+        pthread_mutex_unlock(&st->lock);
+
+        imgfs_lock_acquire(st->caller_lock, LOCK_SITE_COMMIT);
+        pthread_mutex_lock(&st->lock);
+        const uint64_t target = st->requested;
+        pthread_mutex_unlock(&st->lock);
+        int to_sync = 0;
+        int err = commit_prepare(st, &to_sync);
+        imgfs_lock_release(st->caller_lock);
+        if (err == ERR_NONE) err = commit_sync(st, to_sync);
+
+        pthread_mutex_lock(&st->lock);
+        st->durable = target;
+        if (err != ERR_NONE) st->error = err;
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/*******************************************************************
+ * Takes an entry out of the registry: the given one, or (if NULL) any
+ * entry for the same structure or FILE* as a store
+ */
+static struct commit_state* take_state(struct commit_state* entry, const struct imgfs_file* imgfs_file)
+{
+    struct commit_state* found = NULL;
+    pthread_mutex_lock(&registry_lock);
+    struct commit_state** link = &states;
+    while (*link != NULL && found == NULL) {
+        struct commit_state* const st = *link;
+        if (entry != NULL ? st == entry : (st->imgfs_file == imgfs_file || st->file == imgfs_file->file)) {
+            *link = st->next;
+            found = st;
+        } else {
+            link = &st->next;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return found;
+}
+
+/*******************************************************************
+ * Frees an entry taken out of the registry (without writing anything)
+ */
+static void release_state(struct commit_state* st)
+{
+    if (st->has_flusher) {
+        pthread_mutex_lock(&st->lock);
+        st->stopping = 1;
+        pthread_cond_signal(&st->wakeup);
+        pthread_mutex_unlock(&st->lock);
+        pthread_join(st->flusher, NULL);
+    }
+    if (st->journal != NULL) fclose(st->journal);
+    free(st->dirty);
+    free(st->dirty_pages);
+    free(st->shadow);
+    pthread_cond_destroy(&st->wakeup);
+    pthread_cond_destroy(&st->synced);
+    pthread_mutex_destroy(&st->lock);
+    free(st);
+}
+
+/*******************************************************************
+ * Registers a freshly opened store
+ */
+int commit_attach(const char* imgfs_filename, struct imgfs_file* imgfs_file, int writable)
+{
+    M_REQUIRE_NON_NULL(imgfs_filename);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    // An entry for the same structure or FILE* belongs to a store that was
+    // never given to do_close(): it is of no use anymore
+    struct commit_state* stale = NULL;
+    while ((stale = take_state(NULL, imgfs_file)) != NULL) {
+        release_state(stale);
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    const int mode = default_mode;
+    struct imgfs_lock* const caller_lock = default_caller_lock;
+    pthread_mutex_unlock(&registry_lock);
+    if (mode == COMMIT_DIRECT || !writable) {
+        return ERR_NONE;
+    }
+
+    struct commit_state* st = calloc(1, sizeof(struct commit_state));
+    if (st == NULL) return ERR_OUT_OF_MEMORY;
+    int err = journal_path(imgfs_filename, st->journal_path, sizeof(st->journal_path));
+    if (err == ERR_NONE) err = journal_open(imgfs_filename, &st->journal);
+    if (err != ERR_NONE) {
+        free(st);
+        return err;
+    }
+    st->dirty = calloc(imgfs_file->header.max_files, sizeof(unsigned char));
+    st->shadow = calloc(imgfs_file->header.max_files, sizeof(struct img_metadata));
+    if (imgfs_file->header.max_files > 0) {
+        size_t first_page, last_page;
+        slot_pages(&imgfs_file->header, imgfs_file->header.max_files - 1, &first_page, &last_page);
+        st->nb_pages = last_page + 1;
+        st->dirty_pages = calloc(st->nb_pages, sizeof(unsigned char));
+    }
+    if ((st->dirty == NULL || st->shadow == NULL || st->dirty_pages == NULL) && imgfs_file->header.max_files > 0) {
+        free(st->dirty);
+        free(st->shadow);
+        free(st->dirty_pages);
+        fclose(st->journal);
+        free(st);
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (imgfs_file->header.max_files > 0) {
+        // What do_open() read, with the journal replayed: what the file holds
+        memcpy(st->shadow, imgfs_file->metadata, imgfs_file->header.max_files * sizeof(struct img_metadata));
+    }
+    st->mode = mode;
+    st->caller_lock = caller_lock;
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->synced, NULL);
+    pthread_cond_init(&st->wakeup, NULL);
+    st->imgfs_file = imgfs_file;
+    st->file = imgfs_file->file;
+
+    if (mode == COMMIT_ASYNC && caller_lock != NULL) {
+        if (pthread_create(&st->flusher, NULL, commit_flusher, st) != 0) {
+            release_state(st);
+            return ERR_THREADING;
+        }
+        st->has_flusher = 1;
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    st->next = states;
+    states = st;
+    pthread_mutex_unlock(&registry_lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Last checkpoint before the store is closed
+ */
+int commit_detach(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    struct commit_state* st = find_state(imgfs_file);
+    if (st == NULL) return ERR_NONE;
+
+    if (st->has_flusher) {
+        pthread_mutex_lock(&st->lock);
+        st->stopping = 1;
+        pthread_cond_signal(&st->wakeup);
+        pthread_mutex_unlock(&st->lock);
+        pthread_join(st->flusher, NULL);
+        st->has_flusher = 0;
+    }
+
+    int err = st->mode == COMMIT_ASYNC ? st->error : ERR_NONE;
+    const int err_checkpoint = checkpoint(st);
+    if (err == ERR_NONE) err = err_checkpoint;
+    // The journal is kept for the next do_open() if the imgFS could not take it all
+    if (err_checkpoint == ERR_NONE) remove(st->journal_path);
+    release_state(take_state(st, imgfs_file));
+    return err;
+}
+
+/*******************************************************************
+ * Marks the header as changed
+ */
+int mark_header_dirty(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    struct commit_state* st = find_state(imgfs_file);
+    if (st == NULL) return write_header(imgfs_file);
+
+    st->header_dirty |= MARK_DIRTY;
+    pthread_mutex_lock(&st->lock);
+    st->pending = 1;
+    pthread_mutex_unlock(&st->lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Marks the extension block as changed
+ */
+int mark_ext_dirty(struct imgfs_file* imgfs_file, const struct imgfs_ext* ext)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(ext);
+    if (imgfs_file->header.ext_offset == 0) return ERR_INVALID_ARGUMENT;
+
+    struct commit_state* st = find_state(imgfs_file);
+    if (st == NULL) return write_ext_block(imgfs_file, ext);
+
+    st->ext = *ext;
+    st->ext_dirty |= MARK_DIRTY;
+    pthread_mutex_lock(&st->lock);
+    st->pending = 1;
+    pthread_mutex_unlock(&st->lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Marks one metadata slot as changed
+ */
+int mark_metadata_dirty(struct imgfs_file* imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (index >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    struct commit_state* st = find_state(imgfs_file);
+    if (st == NULL) {
+        const uint32_t slot = (uint32_t) index;
+        return write_slot_pages(imgfs_file, &slot, 1);
+    }
+
+    st->dirty[index] |= MARK_DIRTY;
+    mark_pages(st, index);
+    pthread_mutex_lock(&st->lock);
+    st->pending = 1;
+    pthread_mutex_unlock(&st->lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Marks several metadata slots as changed
+ */
+int mark_metadata_dirty_batch(struct imgfs_file* imgfs_file, const uint32_t* indices, size_t count)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(indices);
+    for (size_t i = 0; i < count; ++i) {
+        if (indices[i] >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+    }
+
+    struct commit_state* st = find_state(imgfs_file);
+    if (st == NULL) return write_slot_pages(imgfs_file, indices, count);
+
+    for (size_t i = 0; i < count; ++i) {
+        st->dirty[indices[i]] |= MARK_DIRTY;
+        mark_pages(st, indices[i]);
+    }
+    pthread_mutex_lock(&st->lock);
+    st->pending = 1;
+    pthread_mutex_unlock(&st->lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Notes appended blobs
+ */
+void mark_data_dirty(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file == NULL) return;
+
+    struct commit_state* st = find_state(imgfs_file);
+    if (st != NULL) st->data_dirty = 1;
+}
+
+/*******************************************************************
+ * Makes the changes marked so far durable
+ */
+int commit_changes(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    struct commit_state* st = find_state(imgfs_file);
+    if (st == NULL) return ERR_NONE; // already written
+
+    pthread_mutex_lock(&st->lock);
+    const uint64_t ticket = ++st->requested;
+    int err = ERR_NONE;
+    if (st->mode == COMMIT_ASYNC && st->has_flusher) {
+        // Report a failure of the flusher once
+        err = st->error;
+        st->error = ERR_NONE;
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    int to_sync = 0;
+    if (st->mode == COMMIT_ASYNC) {
+        // Without flusher, journaled now and synced at do_close()
+        return st->has_flusher ? err : commit_prepare(st, &to_sync);
+    }
+    if (st->mode == COMMIT_GROUP && st->caller_lock != NULL) {
+        return group_commit(st, ticket);
+    }
+
+    err = commit_prepare(st, &to_sync);
+    if (err == ERR_NONE) err = commit_sync(st, to_sync);
+    pthread_mutex_lock(&st->lock);
+    st->durable = ticket;
+    pthread_mutex_unlock(&st->lock);
+    return err;
+}
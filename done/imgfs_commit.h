@@ -0,0 +1,150 @@
+/**
+ * @file imgfs_commit.h
+ * @brief Commit layer for the header and metadata of an imgFS.
+ *
+ * Operations that change the header or a metadata slot mark it dirty and
+ * then call commit_changes(). How and when the dirty parts reach the disk
+ * depends on the commit mode the imgFS was opened with:
+ *  - COMMIT_DIRECT: each part is written as soon as it is marked, and never
+ *    synced (the historical behaviour, and the default);
+ *  - COMMIT_PER_OP: the dirty parts are journaled and the journal synced
+ *    before each operation returns;
+ *  - COMMIT_GROUP: as COMMIT_PER_OP, but the operations that commit while a
+ *    sync is running are journaled and synced together by the next one, so
+ *    that a burst of operations costs far fewer syncs than operations;
+ *  - COMMIT_ASYNC: operations return at once; a flusher thread journals and
+ *    syncs the dirty parts every COMMIT_ASYNC_INTERVAL_MS, and do_close()
+ *    does it a last time.
+ *
+ * The extension block (see imgfs_ext.h) is handled like the header, so that
+ * the end of the data and the arena and variant positions are journaled in
+ * the same transaction as the metadata pointing into them.
+ *
+ * Outside COMMIT_DIRECT, the header, slots and extension block are written
+ * to the imgFS itself only at checkpoints (see imgfs_journal.h). The in-memory
+ * structure is always up to date, so reads never depend on the mode.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+#include "imgfs_lock.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Commit modes
+#define COMMIT_DIRECT 0
+#define COMMIT_PER_OP 1
+#define COMMIT_GROUP  2
+#define COMMIT_ASYNC  3
+#define NB_COMMIT_MODES 4
+
+#define COMMIT_ASYNC_INTERVAL_MS 100
+
+/**
+ * @brief Transforms a commit mode name ("direct", "per-op", "group" or
+ *        "async") into its code.
+ *
+ * @param mode The name to transform.
+ * @return The mode code, or -1 if the name is not valid.
+ */
+int commit_mode_atoi(const char* mode);
+
+/**
+ * @brief Chooses the commit mode of the imgFS opened from now on.
+ *
+ * @param mode One of the COMMIT_ codes.
+ * @param caller_lock Lock held by the callers of the imgFS functions (may be
+ *        NULL). In COMMIT_GROUP mode it is released while an operation waits
+ *        for its sync, so the caller must re-validate any shared state it
+ *        read before the call; in COMMIT_ASYNC mode the flusher takes it.
+ *        Without it, COMMIT_GROUP behaves as COMMIT_PER_OP, and COMMIT_ASYNC
+ *        journals at each commit (syncing the new blobs first) and syncs
+ *        the journal at do_close() only.
+ * @return Some error code. 0 if no error.
+ */
+int commit_configure(int mode, struct imgfs_lock* caller_lock);
+
+/**
+ * @brief Sets up the commit state of a freshly opened imgFS (called by do_open()).
+ *
+ * @param imgfs_filename Path to the imgFS file, next to which the journal is kept
+ * @param imgfs_file The main in-memory data structure
+ * @param writable Whether the imgFS was opened for writing; a read-only
+ *        imgFS is always in COMMIT_DIRECT mode.
+ * @return Some error code. 0 if no error.
+ */
+int commit_attach(const char* imgfs_filename, struct imgfs_file* imgfs_file, int writable);
+
+/**
+ * @brief Writes and syncs what is still dirty or only journaled, removes
+ *        the journal, then drops the commit state
+ *        (called by do_close(), before the file is closed).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int commit_detach(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Marks the header as changed.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int mark_header_dirty(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Marks the extension block as changed (called by write_ext()).
+ *
+ * @param imgfs_file The main in-memory data structure; its header must
+ *        already point to the block.
+ * @param ext The new content of the block
+ * @return Some error code. 0 if no error.
+ */
+int mark_ext_dirty(struct imgfs_file* imgfs_file, const struct imgfs_ext* ext);
+
+/**
+ * @brief Marks one metadata slot as changed.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param index Index of the slot.
+ * @return Some error code. 0 if no error.
+ */
+int mark_metadata_dirty(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Marks several metadata slots as changed; in COMMIT_DIRECT mode,
+ *        they are written in one pass, merging neighbour slots.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param indices Indices of the slots, best in increasing order
+ * @param count Number of slots
+ * @return Some error code. 0 if no error.
+ */
+int mark_metadata_dirty_batch(struct imgfs_file* imgfs_file, const uint32_t* indices, size_t count);
+
+/**
+ * @brief Notes that blobs were appended, so that the next commit makes
+ *        them durable before the metadata pointing to them.
+ *
+ * @param imgfs_file The main in-memory data structure
+ */
+void mark_data_dirty(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Makes the changes marked so far durable, as the commit mode says.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int commit_changes(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,28 +1,59 @@
 #include "imgfs.h"
+#include "imgfs_journal.h"
 #include "error.h"
 #include <stdio.h>
 #include <string.h>
 #include "stdlib.h"
 
 int do_create(const char *imgfs_filename, struct imgfs_file *imgfs_file)
+{
+    return do_create_revision(imgfs_filename, imgfs_file, IMGFS_REVISION_ORIGINAL);
+}
+
+/*******************************************************************
+ * Zeros up to a position of the file being created
+ */
+static int pad_to(FILE *file, uint64_t position)
+{
+    static const char zeros[IMGFS_PAGE_SIZE];
+    const long current = ftell(file);
+    if (current < 0 || (uint64_t) current > position) return ERR_IO;
+    for (uint64_t left = position - (uint64_t) current; left > 0; ) {
+        const size_t chunk = left < sizeof(zeros) ? (size_t) left : sizeof(zeros);
+        if (fwrite(zeros, chunk, 1, file) != 1) return ERR_IO;
+        left -= chunk;
+    }
+    return ERR_NONE;
+}
+
+int do_create_revision(const char *imgfs_filename, struct imgfs_file *imgfs_file, uint32_t revision)
 {
 
     M_REQUIRE_NON_NULL(imgfs_file);
     M_REQUIRE_NON_NULL(imgfs_filename);
+    if (revision != IMGFS_REVISION_ORIGINAL && revision != IMGFS_REVISION_PAGED) {
+        return ERR_INVALID_ARGUMENT;
+    }
 
     // Initialize the binary file
-    FILE *file = fopen(imgfs_filename, "wb");
+    FILE *file = fopen(imgfs_filename, "wb+");
     if (file == NULL) {
         return ERR_IO;
     }
     imgfs_file->file = file;
 
+    // A journal left by a former imgFS of the same name must not be replayed into this one
+    char journal[FILENAME_MAX];
+    if (journal_path(imgfs_filename, journal, sizeof(journal)) == ERR_NONE) {
+        remove(journal);
+    }
+
     // Initialize the header structure
     strncpy(imgfs_file->header.name, CAT_TXT, MAX_IMGFS_NAME);
     imgfs_file->header.version = 0;
     imgfs_file->header.nb_files = 0;
-    imgfs_file->header.unused_32 = 0;
-    imgfs_file->header.unused_64 = 0;
+    imgfs_file->header.revision = revision;
+    imgfs_file->header.ext_offset = 0;
 
     //Allocate memory for the metadata
     struct img_metadata *metadata = calloc(imgfs_file->header.max_files, sizeof(struct img_metadata));
@@ -39,7 +70,7 @@ int do_create(const char *imgfs_filename, struct imgfs_file *imgfs_file)
 
     //Write the header
     size_t check_written_head = fwrite(&(imgfs_file->header), sizeof(struct imgfs_header), 1, imgfs_file->file);
-    if (check_written_head != 1) {
+    if (check_written_head != 1 || pad_to(imgfs_file->file, metadata_offset(&imgfs_file->header)) != ERR_NONE) {
         free(imgfs_file->metadata);
         imgfs_file->metadata = NULL;
         fclose(imgfs_file->file);
@@ -51,7 +82,8 @@ int do_create(const char *imgfs_filename, struct imgfs_file *imgfs_file)
                                            imgfs_file->header.max_files, imgfs_file->file);
 
 
-    if (check_written_metadata != imgfs_file->header.max_files) {
+    if (check_written_metadata != imgfs_file->header.max_files
+        || pad_to(imgfs_file->file, data_offset(&imgfs_file->header)) != ERR_NONE) {
         free(imgfs_file->metadata);
         imgfs_file->metadata = NULL;
         return ERR_IO;
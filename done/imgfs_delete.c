@@ -1,5 +1,6 @@
 #include "imgfs.h"
 #include "error.h"
+#include "imgfs_commit.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -27,21 +28,16 @@ int do_delete(const char *img_id, struct imgfs_file *imgfs_file)
     imgfs_file->metadata[index].is_valid = EMPTY;
 
     // Adjust the header(+the changes in the disk)
-    size_t location_deleted_image = sizeof(struct imgfs_header) + ((unsigned long) index) * sizeof(struct img_metadata);
-    if (fseek(imgfs_file->file, (long) location_deleted_image, SEEK_SET) != 0) {
-        return ERR_IO;
-    }
-    if (fwrite(&(imgfs_file->metadata[index]), sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+    int err = mark_metadata_dirty(imgfs_file, (size_t) index);
+    if (err != ERR_NONE) {
+        return err;
     }
     imgfs_file->header.nb_files--;
     imgfs_file->header.version++;
-    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0) {
-        return ERR_IO;
-    }
-    if (fwrite(&(imgfs_file->header), sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+    err = mark_header_dirty(imgfs_file);
+    if (err != ERR_NONE) {
+        return err;
     }
 
-    return ERR_NONE;
+    return commit_changes(imgfs_file);
 }
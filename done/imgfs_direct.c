@@ -0,0 +1,191 @@
+/**
+ * @file imgfs_direct.c
+ * @brief Optional O_DIRECT I/O for large blobs.
+ */
+
+#define _GNU_SOURCE // O_DIRECT
+
+#include "imgfs_direct.h"
+#include "error.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // pread(), pwrite(), close()
+
+struct direct_state {
+    const struct imgfs_file* imgfs_file;
+    FILE* file;
+    int fd;
+    size_t threshold;
+    struct direct_state* next;
+};
+
+static struct direct_state* states = NULL; // one per open imgFS with O_DIRECT I/O
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t default_threshold = 0;
+
+static uint64_t align_down(uint64_t value)
+{
+    return value / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+}
+
+static uint64_t align_up(uint64_t value)
+{
+    return align_down(value + DIRECT_IO_ALIGN - 1);
+}
+
+/*******************************************************************
+ * Threshold of the stores opened from now on
+ */
+void direct_io_configure(size_t threshold)
+{
+    pthread_mutex_lock(&registry_lock);
+    default_threshold = threshold;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/*******************************************************************
+ * Entry of a store, NULL if it does not use O_DIRECT I/O
+ */
+static struct direct_state* find_state(const struct imgfs_file* imgfs_file)
+{
+    struct direct_state* found = NULL;
+    pthread_mutex_lock(&registry_lock);
+    for (struct direct_state* st = states; st != NULL && found == NULL; st = st->next) {
+        if (st->imgfs_file == imgfs_file && st->file == imgfs_file->file) found = st;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return found;
+}
+
+/*******************************************************************
+ * Second descriptor of a freshly opened store
+ */
+int direct_attach(const char* imgfs_filename, struct imgfs_file* imgfs_file, int writable)
+{
+    M_REQUIRE_NON_NULL(imgfs_filename);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    direct_detach(imgfs_file); // of a store that was never given to do_close()
+
+    pthread_mutex_lock(&registry_lock);
+    const size_t threshold = default_threshold;
+    pthread_mutex_unlock(&registry_lock);
+    if (threshold == 0) return ERR_NONE;
+
+    const int fd = open(imgfs_filename, (writable ? O_RDWR : O_RDONLY) | O_DIRECT);
+    if (fd < 0) {
+        return errno == EINVAL ? ERR_NONE : ERR_IO; // EINVAL: no O_DIRECT on this filesystem
+    }
+
+    struct direct_state* st = calloc(1, sizeof(struct direct_state));
+    if (st == NULL) {
+        close(fd);
+        return ERR_OUT_OF_MEMORY;
+    }
+    st->imgfs_file = imgfs_file;
+    st->file = imgfs_file->file;
+    st->fd = fd;
+    st->threshold = threshold;
+
+    pthread_mutex_lock(&registry_lock);
+    st->next = states;
+    states = st;
+    pthread_mutex_unlock(&registry_lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Closes the second descriptor
+ */
+void direct_detach(struct imgfs_file* imgfs_file)
+{
+    pthread_mutex_lock(&registry_lock);
+    struct direct_state** link = &states;
+    while (*link != NULL) {
+        struct direct_state* const st = *link;
+        if (st->imgfs_file == imgfs_file || st->file == imgfs_file->file) {
+            *link = st->next;
+            close(st->fd);
+            free(st);
+        } else {
+            link = &st->next;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/********************************************************************/
+int direct_applies(const struct imgfs_file* imgfs_file, size_t size)
+{
+    const struct direct_state* st = find_state(imgfs_file);
+    return st != NULL && size >= st->threshold;
+}
+
+/*******************************************************************
+ * Aligned write, through a bounce buffer
+ */
+int direct_write(struct imgfs_file* imgfs_file, uint64_t offset, const void* data, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(data);
+    const struct direct_state* st = find_state(imgfs_file);
+    if (st == NULL || offset % DIRECT_IO_ALIGN != 0) return ERR_INVALID_ARGUMENT;
+
+    // What is buffered must not be written over the blob later, nor read in place of it
+    if (fflush(imgfs_file->file) != 0) return ERR_IO;
+
+    const size_t length = (size_t) align_up(size);
+    void* bounce = NULL;
+    if (posix_memalign(&bounce, DIRECT_IO_ALIGN, length) != 0) return ERR_OUT_OF_MEMORY;
+    memcpy(bounce, data, size);
+    memset((char*) bounce + size, 0, length - size);
+
+    int err = ERR_NONE;
+    for (size_t done = 0; done < length && err == ERR_NONE; ) {
+        const ssize_t written = pwrite(st->fd, (char*) bounce + done, length - done, (off_t) (offset + done));
+        if (written <= 0) {
+            err = ERR_IO;
+        } else {
+            done += (size_t) written;
+        }
+    }
+    free(bounce);
+    return err;
+}
+
+/*******************************************************************
+ * Aligned read of the blocks holding the blob, through a bounce buffer
+ */
+int direct_read(struct imgfs_file* imgfs_file, uint64_t offset, void* buffer, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(buffer);
+    const struct direct_state* st = find_state(imgfs_file);
+    if (st == NULL) return ERR_INVALID_ARGUMENT;
+
+    const uint64_t start = align_down(offset);
+    const size_t length = (size_t) (align_up(offset + size) - start);
+    void* bounce = NULL;
+    if (posix_memalign(&bounce, DIRECT_IO_ALIGN, length) != 0) return ERR_OUT_OF_MEMORY;
+
+    // The last block may lie partly past the end of the file
+    const size_t needed = (size_t) (offset - start) + size;
+    size_t done = 0;
+    int err = ERR_NONE;
+    while (done < needed && err == ERR_NONE) {
+        const ssize_t got = pread(st->fd, (char*) bounce + done, length - done, (off_t) (start + done));
+        if (got <= 0) {
+            err = ERR_IO;
+        } else {
+            done += (size_t) got;
+        }
+    }
+    if (err == ERR_NONE) memcpy(buffer, (char*) bounce + (offset - start), size);
+    free(bounce);
+    return err;
+}
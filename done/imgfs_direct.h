@@ -0,0 +1,91 @@
+/**
+ * @file imgfs_direct.h
+ * @brief Optional O_DIRECT I/O for large blobs.
+ *
+ * When enabled (see direct_io_configure()), the blobs of at least the
+ * threshold size are written at IMGFS_PAGE_SIZE boundaries and written
+ * and read through a second, O_DIRECT descriptor of the imgFS, so that
+ * streaming large originals does not evict the metadata and the small
+ * derived images from the page cache. Everything else keeps going through
+ * the FILE* of the imgFS.
+ *
+ * Like the commit state, the descriptor of each open imgFS lives in a
+ * registry keyed by the imgfs_file (and its FILE*). A filesystem that does not
+ * support O_DIRECT leaves the imgFS fully buffered.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DIRECT_IO_ALIGN IMGFS_PAGE_SIZE
+
+/**
+ * @brief Chooses the size from which the blobs of the imgFS opened from
+ *        now on use O_DIRECT I/O.
+ *
+ * @param threshold The size, in bytes; 0 disables O_DIRECT I/O (the default).
+ */
+void direct_io_configure(size_t threshold);
+
+/**
+ * @brief Opens the O_DIRECT descriptor of a freshly opened imgFS, if
+ *        enabled (called by do_open()).
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param imgfs_file The main in-memory data structure
+ * @param writable Whether the imgFS was opened for writing
+ * @return Some error code. 0 if no error (including when the filesystem
+ *         does not support O_DIRECT).
+ */
+int direct_attach(const char* imgfs_filename, struct imgfs_file* imgfs_file, int writable);
+
+/**
+ * @brief Closes the O_DIRECT descriptor of an imgFS (called by do_close()).
+ *
+ * @param imgfs_file The main in-memory data structure
+ */
+void direct_detach(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Whether a blob of this size goes through O_DIRECT I/O.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param size Size of the blob
+ * @return 1 if so, 0 otherwise.
+ */
+int direct_applies(const struct imgfs_file* imgfs_file, size_t size);
+
+/**
+ * @brief Writes a blob with O_DIRECT I/O, zero-padded to a whole number
+ *        of DIRECT_IO_ALIGN blocks.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param offset Position of the blob, a multiple of DIRECT_IO_ALIGN
+ * @param data The blob
+ * @param size Its size
+ * @return Some error code. 0 if no error.
+ */
+int direct_write(struct imgfs_file* imgfs_file, uint64_t offset, const void* data, size_t size);
+
+/**
+ * @brief Reads a blob with O_DIRECT I/O.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param offset Position of the blob (need not be aligned)
+ * @param buffer Where to put the blob
+ * @param size Its size
+ * @return Some error code. 0 if no error.
+ */
+int direct_read(struct imgfs_file* imgfs_file, uint64_t offset, void* buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
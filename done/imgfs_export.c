@@ -0,0 +1,358 @@
+/**
+ * @file imgfs_export.c
+ * @brief Streaming export of an imgFS, to a tar stream or to a compacted imgFS.
+ */
+
+#include "imgfs_export.h"
+#include "imgfs_journal.h"
+#include "error.h"
+
+#include <fcntl.h>  // posix_fadvise()
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h> // stat(), fstat()
+#include <time.h>
+#include <unistd.h> // pread(), fdatasync()
+
+#define TAR_BLOCK 512
+#define TAR_NAME_SIZE 100
+
+// One stored image (of any resolution) to copy
+struct extent {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t index;                                    // Slot
+    int resolution;
+};
+
+// Reads the extents in order, with readahead, reusing the last content when shared
+struct extent_reader {
+    int fd;
+    char* buffer;
+    size_t capacity;
+    uint64_t buffered_offset;                          // Extent in the buffer, if buffered_size > 0
+    uint32_t buffered_size;
+    uint64_t advised_until;
+    struct export_stats stats;
+};
+
+/********************************************************************/
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int compare_extents(const void* a, const void* b)
+{
+    const struct extent* x = a;
+    const struct extent* y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    if (x->index != y->index) return x->index < y->index ? -1 : 1;
+    return x->resolution - y->resolution;
+}
+
+/*******************************************************************
+ * The extents of the valid images, in the order of their position
+ */
+static int list_extents(const struct imgfs_file* imgfs_file, int with_derived,
+                        struct extent** extents, size_t* nb_extents)
+{
+    *extents = calloc((size_t) imgfs_file->header.max_files * NB_RES, sizeof(struct extent));
+    if (*extents == NULL) return ERR_OUT_OF_MEMORY;
+
+    size_t count = 0;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* metadata = &imgfs_file->metadata[i];
+        if (metadata->is_valid == EMPTY) continue;
+        for (int res = 0; res < NB_RES; ++res) {
+            if (res != ORIG_RES && !with_derived) continue;
+            if (metadata->size[res] == 0 || metadata->offset[res] == 0) continue;
+            (*extents)[count++] = (struct extent) { metadata->offset[res], metadata->size[res], i, res };
+        }
+    }
+    qsort(*extents, count, sizeof(struct extent), compare_extents);
+    *nb_extents = count;
+    return ERR_NONE;
+}
+
+static int reader_init(struct extent_reader* reader, struct imgfs_file* imgfs_file)
+{
+    memset(reader, 0, sizeof(*reader));
+    if (fflush(imgfs_file->file) != 0) return ERR_IO;
+    reader->fd = fileno(imgfs_file->file);
+    (void) posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    reader->stats.seconds = now_seconds();
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Content of an extent, valid until the next call
+ */
+static int read_extent(struct extent_reader* reader, const struct extent* extent, const char** content)
+{
+    if (reader->buffered_size == extent->size && reader->buffered_offset == extent->offset) {
+        *content = reader->buffer; // shared with the previous image
+        return ERR_NONE;
+    }
+
+    if (extent->offset + extent->size > reader->advised_until) {
+        (void) posix_fadvise(reader->fd, (off_t) extent->offset, (off_t) EXPORT_READAHEAD, POSIX_FADV_WILLNEED);
+        reader->advised_until = extent->offset + EXPORT_READAHEAD;
+    }
+
+    if (extent->size > reader->capacity) {
+        char* buffer = realloc(reader->buffer, extent->size);
+        if (buffer == NULL) return ERR_OUT_OF_MEMORY;
+        reader->buffer = buffer;
+        reader->capacity = extent->size;
+    }
+    reader->buffered_size = 0;
+    for (size_t done = 0; done < extent->size; ) {
+        const ssize_t got = pread(reader->fd, reader->buffer + done, extent->size - done,
+                                  (off_t) (extent->offset + done));
+        if (got <= 0) return ERR_IO;
+        done += (size_t) got;
+    }
+    reader->buffered_offset = extent->offset;
+    reader->buffered_size = extent->size;
+    reader->stats.nb_bytes += extent->size;
+    *content = reader->buffer;
+    return ERR_NONE;
+}
+
+static void reader_end(struct extent_reader* reader, struct export_stats* stats)
+{
+    free(reader->buffer);
+    reader->stats.seconds = now_seconds() - reader->stats.seconds;
+    if (stats != NULL) *stats = reader->stats;
+}
+
+/*******************************************************************
+ * One ustar header block
+ */
+static int write_tar_header(FILE* tar, const char* name, uint64_t size, char type)
+{
+    char block[TAR_BLOCK];
+    memset(block, 0, sizeof(block));
+    strncpy(block, name, TAR_NAME_SIZE);               // need not be terminated
+    snprintf(block + 100, 8, "%07o", 0644);
+    snprintf(block + 108, 8, "%07o", 0);
+    snprintf(block + 116, 8, "%07o", 0);
+    snprintf(block + 124, 12, "%011llo", (unsigned long long) size);
+    snprintf(block + 136, 12, "%011llo", (unsigned long long) time(NULL));
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+
+    memset(block + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (size_t i = 0; i < sizeof(block); ++i) checksum += (unsigned char) block[i];
+    snprintf(block + 148, 8, "%06o", checksum);        // followed by NUL and the space left above
+
+    return fwrite(block, sizeof(block), 1, tar) == 1 ? ERR_NONE : ERR_IO;
+}
+
+static int write_tar_padding(FILE* tar, uint64_t size)
+{
+    static const char zeros[TAR_BLOCK];
+    const size_t padding = (size_t) ((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+    return padding == 0 || fwrite(zeros, padding, 1, tar) == 1 ? ERR_NONE : ERR_IO;
+}
+
+/*******************************************************************
+ * One member, preceded by a GNU long name member if needed
+ */
+static int write_tar_member(FILE* tar, const char* name, const char* content, uint32_t size)
+{
+    const size_t name_length = strlen(name);
+    int err = ERR_NONE;
+    if (name_length > TAR_NAME_SIZE) {
+        err = write_tar_header(tar, "././@LongLink", name_length + 1, 'L');
+        if (err == ERR_NONE && fwrite(name, name_length + 1, 1, tar) != 1) err = ERR_IO;
+        if (err == ERR_NONE) err = write_tar_padding(tar, name_length + 1);
+    }
+    if (err == ERR_NONE) err = write_tar_header(tar, name, size, '0');
+    if (err == ERR_NONE && fwrite(content, size, 1, tar) != 1) err = ERR_IO;
+    if (err == ERR_NONE) err = write_tar_padding(tar, size);
+    return err;
+}
+
+/********************************************************************//**
+ * Export to a tar stream
+ ********************************************************************** */
+int do_export_tar(struct imgfs_file* imgfs_file, FILE* tar, int with_derived, struct export_stats* stats)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(tar);
+
+    static const char* const suffixes[NB_RES] = { "_thumb", "_small", "" };
+
+    struct extent* extents = NULL;
+    size_t nb_extents = 0;
+    int err = list_extents(imgfs_file, with_derived, &extents, &nb_extents);
+    if (err != ERR_NONE) return err;
+
+    struct extent_reader reader;
+    err = reader_init(&reader, imgfs_file);
+    for (size_t i = 0; i < nb_extents && err == ERR_NONE; ++i) {
+        const struct extent* extent = &extents[i];
+        const char* content = NULL;
+        err = read_extent(&reader, extent, &content);
+        if (err != ERR_NONE) break;
+
+        char name[MAX_IMG_ID + 16];
+        snprintf(name, sizeof(name), "%s%s.jpg", imgfs_file->metadata[extent->index].img_id,
+                 suffixes[extent->resolution]);
+        err = write_tar_member(tar, name, content, extent->size);
+        if (err == ERR_NONE) reader.stats.nb_images++;
+    }
+
+    // End of archive: two zero blocks
+    static const char zeros[2 * TAR_BLOCK];
+    if (err == ERR_NONE && (fwrite(zeros, sizeof(zeros), 1, tar) != 1 || fflush(tar) != 0)) {
+        err = ERR_IO;
+    }
+
+    reader_end(&reader, stats);
+    free(extents);
+    return err;
+}
+
+/*******************************************************************
+ * Padding of the layout of the paged revision
+ */
+static int write_zeros(FILE* file, uint64_t size)
+{
+    static const char zeros[IMGFS_PAGE_SIZE];
+    while (size > 0) {
+        const size_t chunk = size < sizeof(zeros) ? (size_t) size : sizeof(zeros);
+        if (fwrite(zeros, chunk, 1, file) != 1) return ERR_IO;
+        size -= chunk;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Gives the extents their position in the compacted imgFS, in the
+ * metadata copy
+ */
+static void place_extents(const struct extent* extents, size_t nb_extents,
+                              struct img_metadata* metadata, uint64_t start)
+{
+    uint64_t end = start;
+    uint64_t previous_offset = 0;
+    uint32_t previous_size = 0;
+    for (size_t i = 0; i < nb_extents; ++i) {
+        const struct extent* extent = &extents[i];
+        if (extent->offset != previous_offset || extent->size != previous_size) {
+            previous_offset = extent->offset;
+            previous_size = extent->size;
+            end += extent->size;
+        }
+        metadata[extent->index].offset[extent->resolution] = end - extent->size;
+    }
+}
+
+/*******************************************************************
+ * Whether a path names the file of an imgFS (e.g. the same path, another
+ * path to it or a hard link): replacing it would destroy the source
+ */
+static int is_source(const struct imgfs_file* imgfs_file, const char* filename)
+{
+    struct stat source;
+    struct stat target;
+    return fstat(fileno(imgfs_file->file), &source) == 0 && stat(filename, &target) == 0
+           && source.st_dev == target.st_dev && source.st_ino == target.st_ino;
+}
+
+/********************************************************************//**
+ * Export to a compacted imgFS
+ ********************************************************************** */
+int do_export_imgfs(struct imgfs_file* imgfs_file, const char* imgfs_filename, int with_derived,
+                    struct export_stats* stats)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_filename);
+
+    // Neither its journal nor its content may be replaced while it is read
+    if (is_source(imgfs_file, imgfs_filename)) return ERR_INVALID_FILENAME;
+
+    const uint32_t max_files = imgfs_file->header.max_files;
+    struct extent* extents = NULL;
+    size_t nb_extents = 0;
+    int err = list_extents(imgfs_file, with_derived, &extents, &nb_extents);
+    if (err != ERR_NONE) return err;
+    struct extent_reader reader;
+    err = reader_init(&reader, imgfs_file);
+    if (err != ERR_NONE) {
+        free(extents);
+        return err;
+    }
+
+    // The header and metadata of the copy: only the valid images, and only what is copied
+    struct imgfs_header header = imgfs_file->header;
+    header.ext_offset = 0;
+    struct img_metadata* metadata = calloc(max_files, sizeof(struct img_metadata));
+    if (metadata == NULL) {
+        reader_end(&reader, stats);
+        free(extents);
+        return ERR_OUT_OF_MEMORY;
+    }
+    header.nb_files = 0;
+    for (uint32_t i = 0; i < max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid == EMPTY) continue;
+        metadata[i] = imgfs_file->metadata[i];
+        if (!with_derived) {
+            metadata[i].offset[THUMB_RES] = metadata[i].offset[SMALL_RES] = 0;
+            metadata[i].size[THUMB_RES] = metadata[i].size[SMALL_RES] = 0;
+        }
+        header.nb_files++;
+    }
+    place_extents(extents, nb_extents, metadata, data_offset(&header));
+
+    // A journal left by a former imgFS of the same name must not be replayed into the copy
+    char journal[FILENAME_MAX];
+    if (journal_path(imgfs_filename, journal, sizeof(journal)) == ERR_NONE) {
+        remove(journal);
+    }
+
+    FILE* copy = fopen(imgfs_filename, "wb");
+    if (copy == NULL) {
+        reader_end(&reader, stats);
+        free(metadata);
+        free(extents);
+        return ERR_IO;
+    }
+    if (fwrite(&header, sizeof(header), 1, copy) != 1
+        || write_zeros(copy, metadata_offset(&header) - sizeof(header)) != ERR_NONE
+        || fwrite(metadata, sizeof(struct img_metadata), max_files, copy) != max_files
+        || write_zeros(copy, data_offset(&header) - metadata_offset(&header)
+                       - (uint64_t) max_files * sizeof(struct img_metadata)) != ERR_NONE) {
+        err = ERR_IO;
+    }
+
+    for (size_t i = 0; i < nb_extents && err == ERR_NONE; ++i) {
+        const struct extent* extent = &extents[i];
+        const int shared = reader.buffered_size == extent->size && reader.buffered_offset == extent->offset;
+        const char* content = NULL;
+        err = read_extent(&reader, extent, &content);
+        if (err == ERR_NONE && !shared && fwrite(content, extent->size, 1, copy) != 1) err = ERR_IO;
+        if (err == ERR_NONE) reader.stats.nb_images++;
+    }
+    if (err == ERR_NONE && (fflush(copy) != 0 || fdatasync(fileno(copy)) != 0)) {
+        err = ERR_IO;
+    }
+    if (fclose(copy) != 0 && err == ERR_NONE) err = ERR_IO;
+    if (err != ERR_NONE) remove(imgfs_filename);
+
+    reader_end(&reader, stats);
+    free(metadata);
+    free(extents);
+    return err;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file imgfs_export.h
+ * @brief Streaming export of an imgFS, to a tar stream or to a compacted imgFS.
+ *
+ * The images are copied in the order of their position in the imgFS, so
+ * that the source is read sequentially (with readahead advice) whatever
+ * the order of the slots. Only the originals are copied, unless the
+ * derived resolutions are asked for too; the encoded and on-demand
+ * variants (see image_variant.h) are never copied and are made again on
+ * the next read.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+#include <stdio.h>  // for FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EXPORT_READAHEAD (8UL * 1024 * 1024) // 8 MiB ahead of the image being copied
+
+struct export_stats {
+    size_t nb_images;                                  // Images (of any resolution) written
+    uint64_t nb_bytes;                                 // Bytes of images read
+    double seconds;                                    // Duration of the export
+};
+
+/**
+ * @brief Writes the images of an imgFS as a tar (ustar) stream.
+ *
+ * Originals are named "<img_id>.jpg", so that the stream can be imported
+ * back (see imgfs_import.h); derived images "<img_id>_thumb.jpg" and
+ * "<img_id>_small.jpg".
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param tar Where to write the stream, e.g. stdout
+ * @param with_derived Whether to also write the stored derived resolutions
+ * @param stats Location of the totals (may be NULL)
+ * @return Some error code. 0 if no error.
+ */
+int do_export_tar(struct imgfs_file* imgfs_file, FILE* tar, int with_derived, struct export_stats* stats);
+
+/**
+ * @brief Copies an imgFS into a new imgFS with no unused space: deleted
+ *        images, superseded variants and preallocated space are left out,
+ *        and images that shared their content still do.
+ *
+ * The new imgFS has the same slots, resolutions and version; it is synced
+ * before this function returns.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param imgfs_filename Path to the new imgFS (replaced if it exists; it
+ *        may not be the file of the source: ERR_INVALID_FILENAME)
+ * @param with_derived Whether to also copy the stored derived resolutions
+ * @param stats Location of the totals (may be NULL)
+ * @return Some error code. 0 if no error.
+ */
+int do_export_imgfs(struct imgfs_file* imgfs_file, const char* imgfs_filename, int with_derived,
+                    struct export_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
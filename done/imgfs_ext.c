@@ -0,0 +1,173 @@
+/**
+ * @file imgfs_ext.c
+ * @brief Extension block of an imgFS, kept in memory while it is open.
+ */
+
+#include "imgfs_ext.h"
+#include "imgfs_commit.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ext_state {
+    const struct imgfs_file* imgfs_file;
+    FILE* file;
+    struct imgfs_ext ext;
+    struct ext_state* next;
+};
+
+static struct ext_state* states = NULL; // one per open imgFS with an extension block
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*******************************************************************
+ * Entry of a store, NULL if it has none
+ */
+static struct ext_state* find_state(const struct imgfs_file* imgfs_file)
+{
+    struct ext_state* found = NULL;
+    pthread_mutex_lock(&registry_lock);
+    for (struct ext_state* st = states; st != NULL && found == NULL; st = st->next) {
+        if (st->imgfs_file == imgfs_file && st->file == imgfs_file->file) found = st;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return found;
+}
+
+/*******************************************************************
+ * New entry of a store
+ */
+static int add_state(const struct imgfs_file* imgfs_file, const struct imgfs_ext* ext)
+{
+    struct ext_state* st = calloc(1, sizeof(struct ext_state));
+    if (st == NULL) return ERR_OUT_OF_MEMORY;
+    st->imgfs_file = imgfs_file;
+    st->file = imgfs_file->file;
+    st->ext = *ext;
+
+    pthread_mutex_lock(&registry_lock);
+    st->next = states;
+    states = st;
+    pthread_mutex_unlock(&registry_lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * The block as it is in the file
+ */
+static int read_block(const struct imgfs_file* imgfs_file, struct imgfs_ext* ext)
+{
+    memset(ext, 0, sizeof(*ext));
+    if (imgfs_file->header.ext_offset == 0) {
+        return ERR_NONE;
+    }
+    if (fseek(imgfs_file->file, (long) imgfs_file->header.ext_offset, SEEK_SET) != 0
+        || fread(ext, sizeof(struct imgfs_ext), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * In-memory block of a freshly opened store
+ */
+int ext_attach(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    ext_detach(imgfs_file); // of a store that was never given to do_close()
+
+    if (imgfs_file->header.ext_offset == 0) return ERR_NONE; // an entry comes with the block
+
+    struct imgfs_ext ext;
+    const int err = read_block(imgfs_file, &ext);
+    return err != ERR_NONE ? err : add_state(imgfs_file, &ext);
+}
+
+/*******************************************************************
+ * Drops the in-memory block
+ */
+void ext_detach(struct imgfs_file* imgfs_file)
+{
+    pthread_mutex_lock(&registry_lock);
+    struct ext_state** link = &states;
+    while (*link != NULL) {
+        struct ext_state* const st = *link;
+        if (st->imgfs_file == imgfs_file || st->file == imgfs_file->file) {
+            *link = st->next;
+            free(st);
+        } else {
+            link = &st->next;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/*******************************************************************
+ * read the extension block
+ */
+int read_ext(const struct imgfs_file *imgfs_file, struct imgfs_ext *ext)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(ext);
+
+    const struct ext_state* st = find_state(imgfs_file);
+    if (st == NULL) return read_block(imgfs_file, ext);
+
+    *ext = st->ext;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * write the extension block, creating it if needed
+ */
+int write_ext(struct imgfs_file *imgfs_file, const struct imgfs_ext *ext)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(ext);
+
+    if (imgfs_file->header.ext_offset == 0) {
+        //Room for the block at the end of the file; the header points to
+        //it in the same commit as its content
+        if (fseek(imgfs_file->file, 0, SEEK_END) != 0) {
+            return ERR_IO;
+        }
+        const long end = ftell(imgfs_file->file);
+        if (end < 0 || fwrite(ext, sizeof(struct imgfs_ext), 1, imgfs_file->file) != 1) {
+            return ERR_IO;
+        }
+        imgfs_file->header.ext_offset = (uint64_t) end;
+        const int err = mark_header_dirty(imgfs_file);
+        if (err != ERR_NONE) {
+            imgfs_file->header.ext_offset = 0;
+            return err;
+        }
+    }
+
+    struct ext_state* st = find_state(imgfs_file);
+    if (st != NULL) {
+        st->ext = *ext;
+    } else {
+        const int err = add_state(imgfs_file, ext);
+        if (err != ERR_NONE) return err;
+    }
+    return mark_ext_dirty(imgfs_file, ext);
+}
+
+/*******************************************************************
+ * Replaces the in-memory block
+ */
+int ext_replace(struct imgfs_file* imgfs_file, const struct imgfs_ext* ext)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(ext);
+
+    struct ext_state* st = find_state(imgfs_file);
+    if (st == NULL) return add_state(imgfs_file, ext); // a block the journal created
+    st->ext = *ext;
+    return ERR_NONE;
+}
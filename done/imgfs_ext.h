@@ -0,0 +1,51 @@
+/**
+ * @file imgfs_ext.h
+ * @brief Extension block of an imgFS, kept in memory while it is open.
+ *
+ * The extension block (see struct imgfs_ext) changes with most blob
+ * allocations, so read_ext() and write_ext() work on an in-memory copy
+ * instead of the file. Like the commit state, the copy of each open imgFS
+ * lives in a registry keyed by the imgfs_file. Only an imgFS with a block
+ * has an entry, from do_open() or from the write_ext() that creates the
+ * block; an imgFS without an entry (e.g. one fresh from do_create()) has
+ * its block read from the file at each call. Changes reach the file
+ * through the commit layer (see mark_ext_dirty()).
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Reads the extension block of a freshly opened imgFS into memory
+ *        (called by do_open()).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int ext_attach(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Replaces the in-memory extension block of an imgFS, without
+ *        writing it (used by the journal replay).
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param ext The new content of the block
+ * @return Some error code. 0 if no error.
+ */
+int ext_replace(struct imgfs_file* imgfs_file, const struct imgfs_ext* ext);
+
+/**
+ * @brief Drops the in-memory extension block of an imgFS (called by do_close()).
+ *
+ * @param imgfs_file The main in-memory data structure
+ */
+void ext_detach(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
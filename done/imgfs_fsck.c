@@ -0,0 +1,272 @@
+/**
+ * @file imgfs_fsck.c
+ * @brief Consistency check of an imgFS.
+ */
+
+#include "imgfs_fsck.h"
+#include "imgfs_commit.h"
+#include "error.h"
+
+#include <fcntl.h>  // posix_fadvise()
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h> // pread(), sysconf()
+
+// One original to hash, possibly shared by several slots
+struct fsck_extent {
+    uint64_t offset;
+    uint32_t size;
+    int readable;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+};
+
+struct fsck_pool {
+    int fd;
+    struct fsck_extent* extents;
+    size_t nb_extents;
+    size_t next;                                       // Next extent to hash
+    uint64_t nb_bytes;
+    int err;
+    pthread_mutex_t lock;
+};
+
+/********************************************************************/
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int compare_extents(const void* a, const void* b)
+{
+    const struct fsck_extent* x = a;
+    const struct fsck_extent* y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->size < y->size ? -1 : x->size > y->size;
+}
+
+// By ID, then by slot
+static int compare_slots_by_id(const void* a, const void* b)
+{
+    const struct img_metadata* x = *(const struct img_metadata* const*) a;
+    const struct img_metadata* y = *(const struct img_metadata* const*) b;
+    const int order = strncmp(x->img_id, y->img_id, MAX_IMG_ID + 1);
+    if (order != 0) return order;
+    return x < y ? -1 : x > y;
+}
+
+/*******************************************************************
+ * Hashes the extents, taking them in order
+ */
+static void* fsck_worker(void* arg)
+{
+    struct fsck_pool* pool = arg;
+    char* buffer = NULL;
+    size_t capacity = 0;
+    uint64_t nb_bytes = 0;
+    int err = ERR_NONE;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        const size_t i = pool->next < pool->nb_extents && pool->err == ERR_NONE ? pool->next++ : SIZE_MAX;
+        pthread_mutex_unlock(&pool->lock);
+        if (i == SIZE_MAX) break;
+
+        struct fsck_extent* extent = &pool->extents[i];
+        if (extent->size > capacity) {
+            char* bigger = realloc(buffer, extent->size);
+            if (bigger == NULL) {
+                err = ERR_OUT_OF_MEMORY;
+                break;
+            }
+            buffer = bigger;
+            capacity = extent->size;
+        }
+        size_t done = 0;
+        while (done < extent->size) {
+            const ssize_t got = pread(pool->fd, buffer + done, extent->size - done, (off_t) (extent->offset + done));
+            if (got <= 0) break;
+            done += (size_t) got;
+        }
+        extent->readable = done == extent->size;
+        if (extent->readable) {
+            SHA256((const unsigned char*) buffer, extent->size, extent->SHA);
+            nb_bytes += extent->size;
+        }
+    }
+    free(buffer);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->nb_bytes += nb_bytes;
+    if (err != ERR_NONE) pool->err = err;
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int hash_extents(struct fsck_pool* pool, size_t nb_threads)
+{
+    if (nb_threads == 0) {
+        const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_threads = nb_cpus > 0 ? (size_t) nb_cpus : 1;
+    }
+    if (nb_threads > FSCK_MAX_THREADS) nb_threads = FSCK_MAX_THREADS;
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0) return ERR_THREADING;
+    (void) posix_fadvise(pool->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    pthread_t threads[FSCK_MAX_THREADS];
+    size_t nb_started = 0;
+    for (size_t t = 1; t < nb_threads; ++t) {
+        if (pthread_create(&threads[nb_started], NULL, fsck_worker, pool) != 0) break;
+        ++nb_started;
+    }
+    fsck_worker(pool);
+    for (size_t t = 0; t < nb_started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    return pool->err;
+}
+
+/*******************************************************************
+ * Index of the extent of an original, among the sorted ones
+ */
+static size_t find_extent(const struct fsck_extent* extents, size_t nb_extents, uint64_t offset, uint32_t size)
+{
+    const struct fsck_extent key = { offset, size, 0, { 0 } };
+    const struct fsck_extent* found = bsearch(&key, extents, nb_extents, sizeof(key), compare_extents);
+    return found == NULL ? SIZE_MAX : (size_t) (found - extents);
+}
+
+static void report_problem(fsck_problem problem, void* arg, uint32_t index,
+                           const struct imgfs_file* imgfs_file, const char* what)
+{
+    if (problem != NULL) problem(index, imgfs_file->metadata[index].img_id, what, arg);
+}
+
+/********************************************************************//**
+ * Check an imgFS
+ ********************************************************************** */
+int do_fsck(struct imgfs_file* imgfs_file, size_t nb_threads, int repair,
+            fsck_problem problem, void* arg, struct fsck_report* report)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(report);
+
+    memset(report, 0, sizeof(*report));
+    const double start = now_seconds();
+    const uint32_t max_files = imgfs_file->header.max_files;
+    const struct img_metadata* metadata = imgfs_file->metadata;
+
+    struct stat st;
+    if (fflush(imgfs_file->file) != 0 || fstat(fileno(imgfs_file->file), &st) != 0) return ERR_IO;
+    const uint64_t file_size = (uint64_t) st.st_size;
+    const uint64_t data_start = data_offset(&imgfs_file->header);
+
+    const struct img_metadata** by_id = calloc(max_files, sizeof(struct img_metadata*));
+    struct fsck_extent* extents = calloc(max_files, sizeof(struct fsck_extent));
+    unsigned char* bad_extent = calloc(max_files, sizeof(unsigned char));
+    if (by_id == NULL || extents == NULL || bad_extent == NULL) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+        free((void*) by_id);
+#pragma GCC diagnostic pop
+        free(extents);
+        free(bad_extent);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // Extents, and the originals to hash
+    size_t nb_extents = 0;
+    for (uint32_t i = 0; i < max_files; ++i) {
+        if (metadata[i].is_valid == EMPTY) continue;
+        by_id[report->nb_valid++] = &metadata[i];
+        for (int res = 0; res < NB_RES; ++res) {
+            const uint64_t offset = metadata[i].offset[res];
+            const uint32_t size = metadata[i].size[res];
+            if (offset == 0 && size == 0 && res != ORIG_RES) continue; // not made yet
+            if (offset < data_start || size == 0 || offset > file_size || size > file_size - offset) {
+                bad_extent[i] = 1;
+            }
+        }
+        if (!bad_extent[i]) {
+            extents[nb_extents++] = (struct fsck_extent) { metadata[i].offset[ORIG_RES], metadata[i].size[ORIG_RES], 0, { 0 } };
+        }
+    }
+    qsort(extents, nb_extents, sizeof(struct fsck_extent), compare_extents);
+    size_t nb_distinct = 0;
+    for (size_t i = 0; i < nb_extents; ++i) {
+        if (nb_distinct == 0 || compare_extents(&extents[nb_distinct - 1], &extents[i]) != 0) {
+            extents[nb_distinct++] = extents[i];
+        }
+    }
+
+    struct fsck_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.fd = fileno(imgfs_file->file);
+    pool.extents = extents;
+    pool.nb_extents = nb_distinct;
+    int err = hash_extents(&pool, nb_threads);
+    report->nb_bytes = pool.nb_bytes;
+
+    if (err == ERR_NONE) {
+        // Duplicate IDs: neighbours once sorted by ID, the first slot keeping it
+        unsigned char* duplicate = calloc(max_files, sizeof(unsigned char));
+        if (duplicate == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else {
+            qsort(by_id, report->nb_valid, sizeof(struct img_metadata*), compare_slots_by_id);
+            for (uint32_t k = 1; k < report->nb_valid; ++k) {
+                if (strncmp(by_id[k - 1]->img_id, by_id[k]->img_id, MAX_IMG_ID + 1) == 0) {
+                    duplicate[by_id[k] - metadata] = 1;
+                }
+            }
+
+            if (imgfs_file->header.nb_files != report->nb_valid) {
+                report->nb_bad_count = 1;
+                if (problem != NULL) problem(UINT32_MAX, "", "header does not count the valid images", arg);
+            }
+            for (uint32_t i = 0; i < max_files; ++i) {
+                if (metadata[i].is_valid == EMPTY) continue;
+                if (duplicate[i]) {
+                    report->nb_duplicate_id++;
+                    report_problem(problem, arg, i, imgfs_file, "duplicate image ID");
+                }
+                if (bad_extent[i]) {
+                    report->nb_bad_extent++;
+                    report_problem(problem, arg, i, imgfs_file, "image out of the data region");
+                    continue;
+                }
+                const size_t e = find_extent(extents, nb_distinct, metadata[i].offset[ORIG_RES], metadata[i].size[ORIG_RES]);
+                if (e == SIZE_MAX || !extents[e].readable
+                    || memcmp(extents[e].SHA, metadata[i].SHA, SHA256_DIGEST_LENGTH) != 0) {
+                    report->nb_bad_sha++;
+                    report_problem(problem, arg, i, imgfs_file, "original does not match its SHA");
+                }
+            }
+            free(duplicate);
+        }
+    }
+
+    if (err == ERR_NONE && repair && report->nb_bad_count) {
+        imgfs_file->header.nb_files = report->nb_valid;
+        err = mark_header_dirty(imgfs_file);
+        if (err == ERR_NONE) err = commit_changes(imgfs_file);
+        report->repaired = err == ERR_NONE;
+    }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    free((void*) by_id);
+#pragma GCC diagnostic pop
+    free(extents);
+    free(bad_extent);
+    report->seconds = now_seconds() - start;
+    return err;
+}
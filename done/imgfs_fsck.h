@@ -0,0 +1,62 @@
+/**
+ * @file imgfs_fsck.h
+ * @brief Consistency check of an imgFS.
+ *
+ * Checks that the header counts the valid slots, that image IDs are
+ * unique, that every stored image lies within the data region of the
+ * file, and that each original still hashes to the SHA of its slot. The
+ * originals are hashed on a pool of threads taking them in the order of
+ * their position, so that the file is read about sequentially; images
+ * sharing their content are hashed once.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FSCK_MAX_THREADS 64
+
+struct fsck_report {
+    uint32_t nb_valid;                                 // Valid slots
+    size_t nb_bad_count;                               // 1 if the header does not count nb_valid images
+    size_t nb_duplicate_id;                            // Slots whose ID is also used by an earlier slot
+    size_t nb_bad_extent;                              // Slots with an image out of the data region
+    size_t nb_bad_sha;                                 // Slots whose original does not match their SHA
+    int repaired;                                      // Whether the header count was fixed
+    uint64_t nb_bytes;                                 // Bytes hashed
+    double seconds;                                    // Duration of the check
+};
+
+/**
+ * @brief Called for each problem found, in the order of the slots.
+ */
+typedef void (*fsck_problem)(uint32_t index, const char* img_id, const char* problem, void* arg);
+
+/**
+ * @brief Checks an imgFS.
+ *
+ * @param imgfs_file The main in-memory data structure
+ * @param nb_threads Number of hashing threads; 0 means one per online CPU
+ *        (at most FSCK_MAX_THREADS either way)
+ * @param repair Whether to fix the number of images in the header (the
+ *        imgFS must then be open for writing); the other problems are
+ *        only reported.
+ * @param problem Called for each problem (may be NULL)
+ * @param arg Passed to problem
+ * @param report Location of the results
+ * @return Some error code if the check could not run. 0 otherwise, even if
+ *         problems were found.
+ */
+int do_fsck(struct imgfs_file* imgfs_file, size_t nb_threads, int repair,
+            fsck_problem problem, void* arg, struct fsck_report* report);
+
+#ifdef __cplusplus
+}
+#endif
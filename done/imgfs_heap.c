@@ -0,0 +1,65 @@
+/**
+ * @file imgfs_heap.c
+ * @brief Accounting of the heap allocations, by thread.
+ */
+
+#include "imgfs_heap.h"
+
+#include <stddef.h> // for size_t
+
+static __thread uint64_t allocations = 0;
+static __thread uint64_t bytes = 0;
+
+// The functions wrapped, as the linker names them
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t number, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+int __real_posix_memalign(void** ptr, size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size);
+void* __wrap_calloc(size_t number, size_t size);
+void* __wrap_realloc(void* ptr, size_t size);
+int __wrap_posix_memalign(void** ptr, size_t alignment, size_t size);
+
+/********************************************************************/
+static void count(size_t size)
+{
+    allocations++;
+    bytes += size;
+}
+
+void* __wrap_malloc(size_t size)
+{
+    void* ptr = __real_malloc(size);
+    if (ptr != NULL) count(size);
+    return ptr;
+}
+
+void* __wrap_calloc(size_t number, size_t size)
+{
+    void* ptr = __real_calloc(number, size);
+    if (ptr != NULL) count(number * size);
+    return ptr;
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    void* moved = __real_realloc(ptr, size);
+    if (moved != NULL) count(size);
+    return moved;
+}
+
+int __wrap_posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    const int err = __real_posix_memalign(ptr, alignment, size);
+    if (err == 0) count(size);
+    return err;
+}
+
+/********************************************************************/
+void heap_usage_get(struct heap_usage* usage)
+{
+    if (usage == NULL) return;
+    usage->allocations = allocations;
+    usage->bytes = bytes;
+}
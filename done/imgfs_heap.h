@@ -0,0 +1,36 @@
+/**
+ * @file imgfs_heap.h
+ * @brief Accounting of the heap allocations, by thread.
+ *
+ * Linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=posix_memalign
+ * (see the Makefile), the calls of imgfs's own code to these functions go
+ * through counting wrappers; the allocations libraries make internally
+ * (libvips, json-c, the C library itself) are not seen. Each thread counts
+ * its own allocations, so that the difference between two readings on a
+ * thread is what it allocated meanwhile. Without the wrapping, all counts
+ * stay at 0.
+ */
+
+#pragma once
+
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct heap_usage {
+    uint64_t allocations; // successful allocations, reallocations included
+    uint64_t bytes;       // bytes asked for by them
+};
+
+/**
+ * @brief Reads the counts of the calling thread, since it started.
+ *
+ * @param usage Where to put them
+ */
+void heap_usage_get(struct heap_usage* usage);
+
+#ifdef __cplusplus
+}
+#endif
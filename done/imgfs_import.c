@@ -0,0 +1,364 @@
+/**
+ * @file imgfs_import.c
+ * @brief Bulk import of images into an open imgFS.
+ */
+
+#include "imgfs_import.h"
+#include "error.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define TAR_BLOCK 512
+
+struct import_batch {
+    struct insert_request requests[IMPORT_BATCH_SIZE];
+    char ids[IMPORT_BATCH_SIZE][MAX_IMG_ID + 2];       // One more character, so that too long IDs are caught
+    char* names[IMPORT_BATCH_SIZE];                    // For the failure reports
+    size_t count;
+    size_t bytes;
+};
+
+struct importer {
+    struct imgfs_file* imgfs_file;
+    struct import_options options;
+    struct import_stats stats;
+    double start;
+    struct import_batch batch;
+};
+
+/********************************************************************/
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*******************************************************************
+ * "dir/papillon.jpg" -> "papillon"
+ */
+static void make_id(const char* name, char* id, size_t size)
+{
+    const char* base = strrchr(name, '/');
+    base = base == NULL ? name : base + 1;
+    const char* dot = strrchr(base, '.');
+    size_t length = dot == NULL || dot == base ? strlen(base) : (size_t) (dot - base);
+    if (length >= size) length = size - 1;
+    memcpy(id, base, length);
+    id[length] = '\0';
+}
+
+static void report_failure(struct importer* importer, const char* name, int error)
+{
+    importer->stats.nb_failed++;
+    if (importer->options.failure != NULL) {
+        importer->options.failure(name, error, importer->options.arg);
+    }
+}
+
+/*******************************************************************
+ * Inserts the pending images
+ */
+static int flush_batch(struct importer* importer)
+{
+    struct import_batch* batch = &importer->batch;
+    if (batch->count == 0) return ERR_NONE;
+
+    const int err = do_insert_batch(batch->requests, batch->count, importer->options.nb_threads,
+                                    importer->imgfs_file);
+    for (size_t i = 0; i < batch->count; ++i) {
+        if (batch->requests[i].result == ERR_NONE) {
+            importer->stats.nb_inserted++;
+        } else {
+            report_failure(importer, batch->names[i], batch->requests[i].result);
+        }
+        free(batch->names[i]);
+        // The buffers were allocated by the readers below
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+        free((char*) batch->requests[i].image_buffer);
+#pragma GCC diagnostic pop
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+
+    importer->stats.seconds = now_seconds() - importer->start;
+    if (importer->options.progress != NULL) {
+        importer->options.progress(&importer->stats, importer->options.arg);
+    }
+    return err;
+}
+
+/*******************************************************************
+ * Queues one image, taking ownership of its buffer
+ */
+static int add_image(struct importer* importer, const char* name, char* buffer, size_t size)
+{
+    struct import_batch* batch = &importer->batch;
+    importer->stats.nb_read++;
+    importer->stats.nb_bytes += size;
+
+    if (batch->count == IMPORT_BATCH_SIZE
+        || (batch->count > 0 && batch->bytes + size > IMPORT_BATCH_MAX_BYTES)) {
+        const int err = flush_batch(importer);
+        if (err != ERR_NONE) {
+            free(buffer);
+            return err;
+        }
+    }
+
+    char* name_copy = malloc(strlen(name) + 1);
+    if (name_copy == NULL) {
+        free(buffer);
+        return ERR_OUT_OF_MEMORY;
+    }
+    strcpy(name_copy, name);
+
+    const size_t i = batch->count++;
+    make_id(name, batch->ids[i], sizeof(batch->ids[i]));
+    batch->names[i] = name_copy;
+    batch->requests[i] = (struct insert_request) { buffer, size, batch->ids[i], ERR_NONE };
+    batch->bytes += size;
+    return ERR_NONE;
+}
+
+static int start_import(struct importer* importer, struct imgfs_file* imgfs_file,
+                        const struct import_options* options)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    memset(importer, 0, sizeof(*importer));
+    importer->imgfs_file = imgfs_file;
+    if (options != NULL) importer->options = *options;
+    importer->start = now_seconds();
+    return ERR_NONE;
+}
+
+static int end_import(struct importer* importer, int err, struct import_stats* stats)
+{
+    if (err == ERR_NONE) {
+        err = flush_batch(importer);
+    } else {
+        // Drop what was not inserted
+        for (size_t i = 0; i < importer->batch.count; ++i) {
+            free(importer->batch.names[i]);
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+            free((char*) importer->batch.requests[i].image_buffer);
+#pragma GCC diagnostic pop
+        }
+    }
+    importer->stats.seconds = now_seconds() - importer->start;
+    if (stats != NULL) *stats = importer->stats;
+    return err;
+}
+
+/*******************************************************************
+ * Reads a whole file
+ */
+static int read_file(const char* path, char** buffer, size_t* size)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return ERR_IO;
+
+    int err = ERR_NONE;
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) {
+        err = ERR_IO;
+    } else if (st.st_size <= 0 || (uint64_t) st.st_size > UINT32_MAX) {
+        err = ERR_INVALID_ARGUMENT;
+    } else {
+        *size = (size_t) st.st_size;
+        *buffer = malloc(*size);
+        if (*buffer == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else if (fread(*buffer, *size, 1, file) != 1) {
+            free(*buffer);
+            err = ERR_IO;
+        }
+    }
+    fclose(file);
+    return err;
+}
+
+static int visible_entry(const struct dirent* entry)
+{
+    return entry->d_name[0] != '.';
+}
+
+/********************************************************************//**
+ * Import the files of a directory
+ ********************************************************************** */
+int do_import_dir(const char* path, struct imgfs_file* imgfs_file,
+                  const struct import_options* options, struct import_stats* stats)
+{
+    M_REQUIRE_NON_NULL(path);
+
+    struct importer* importer = malloc(sizeof(struct importer));
+    if (importer == NULL) return ERR_OUT_OF_MEMORY;
+    int err = start_import(importer, imgfs_file, options);
+    if (err != ERR_NONE) {
+        free(importer);
+        return err;
+    }
+
+    struct dirent** entries = NULL;
+    const int nb_entries = scandir(path, &entries, visible_entry, alphasort);
+    if (nb_entries < 0) {
+        free(importer);
+        return ERR_IO;
+    }
+
+    for (int i = 0; i < nb_entries; ++i) {
+        char file_path[FILENAME_MAX];
+        struct stat st;
+        const int written = snprintf(file_path, sizeof(file_path), "%s/%s", path, entries[i]->d_name);
+        if (err == ERR_NONE && written > 0 && (size_t) written < sizeof(file_path)
+            && stat(file_path, &st) == 0 && S_ISREG(st.st_mode)) {
+            char* buffer = NULL;
+            size_t size = 0;
+            const int read_err = read_file(file_path, &buffer, &size);
+            if (read_err == ERR_OUT_OF_MEMORY) {
+                err = read_err;
+            } else if (read_err != ERR_NONE) {
+                report_failure(importer, file_path, read_err);
+            } else {
+                err = add_image(importer, file_path, buffer, size);
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    err = end_import(importer, err, stats);
+    free(importer);
+    return err;
+}
+
+/*******************************************************************
+ * Parses a numeric field of a tar header
+ */
+static int tar_octal(const char* field, size_t size, uint64_t* value)
+{
+    *value = 0;
+    size_t i = 0;
+    while (i < size && field[i] == ' ') ++i;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+        *value = (*value << 3) | (uint64_t) (field[i] - '0');
+    }
+    return i == size || field[i] == '\0' || field[i] == ' ' ? ERR_NONE : ERR_IO;
+}
+
+static int tar_checksum_ok(const unsigned char* block)
+{
+    uint64_t expected = 0;
+    if (tar_octal((const char*) block + 148, 8, &expected) != ERR_NONE) return 0;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; ++i) {
+        sum += i >= 148 && i < 156 ? (unsigned char) ' ' : block[i];
+    }
+    return sum == expected;
+}
+
+static int tar_skip(FILE* tar, uint64_t size)
+{
+    char scratch[TAR_BLOCK];
+    while (size > 0) {
+        const size_t chunk = size < sizeof(scratch) ? (size_t) size : sizeof(scratch);
+        if (fread(scratch, chunk, 1, tar) != 1) return ERR_IO;
+        size -= chunk;
+    }
+    return ERR_NONE;
+}
+
+// Size of a member rounded up to whole blocks
+static uint64_t tar_padded(uint64_t size)
+{
+    return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+/********************************************************************//**
+ * Import the files of a tar stream
+ ********************************************************************** */
+int do_import_tar(FILE* tar, struct imgfs_file* imgfs_file,
+                  const struct import_options* options, struct import_stats* stats)
+{
+    M_REQUIRE_NON_NULL(tar);
+
+    struct importer* importer = malloc(sizeof(struct importer));
+    if (importer == NULL) return ERR_OUT_OF_MEMORY;
+    int err = start_import(importer, imgfs_file, options);
+    if (err != ERR_NONE) {
+        free(importer);
+        return err;
+    }
+
+    char long_name[FILENAME_MAX] = "";                 // From a GNU 'L' member, for the next member
+    unsigned char block[TAR_BLOCK];
+    while (err == ERR_NONE) {
+        if (fread(block, sizeof(block), 1, tar) != 1) {
+            err = ERR_IO;                              // No end-of-archive block
+            break;
+        }
+        if (block[0] == '\0') break;                    // End-of-archive (the second zero block is not read)
+        if (!tar_checksum_ok(block)) {
+            err = ERR_IO;
+            break;
+        }
+
+        uint64_t size = 0;
+        if (tar_octal((const char*) block + 124, 12, &size) != ERR_NONE) {
+            err = ERR_IO;
+            break;
+        }
+        const char type = (char) block[156];
+
+        // name[100] and the ustar prefix[155] need not be terminated
+        char name[FILENAME_MAX];
+        if (long_name[0] != '\0') {
+            strcpy(name, long_name);
+            long_name[0] = '\0';
+        } else if (memcmp(block + 257, "ustar", 5) == 0 && block[345] != '\0') {
+            snprintf(name, sizeof(name), "%.155s/%.100s", (const char*) block + 345, (const char*) block);
+        } else {
+            snprintf(name, sizeof(name), "%.100s", (const char*) block);
+        }
+
+        if (type == 'L' && size < sizeof(long_name)) {
+            if (fread(long_name, (size_t) size, 1, tar) != 1) {
+                err = ERR_IO;
+                break;
+            }
+            long_name[size] = '\0';
+            err = tar_skip(tar, tar_padded(size) - size);
+        } else if ((type == '0' || type == '\0') && size > 0 && size <= UINT32_MAX) {
+            char* buffer = malloc((size_t) size);
+            if (buffer == NULL) {
+                err = ERR_OUT_OF_MEMORY;
+            } else if (fread(buffer, (size_t) size, 1, tar) != 1) {
+                free(buffer);
+                err = ERR_IO;
+            } else {
+                err = tar_skip(tar, tar_padded(size) - size);
+                if (err == ERR_NONE) {
+                    err = add_image(importer, name, buffer, (size_t) size);
+                } else {
+                    free(buffer);
+                }
+            }
+        } else {
+            if (type == '0' || type == '\0') report_failure(importer, name, ERR_INVALID_ARGUMENT);
+            err = tar_skip(tar, tar_padded(size));
+        }
+    }
+
+    err = end_import(importer, err, stats);
+    free(importer);
+    return err;
+}
@@ -0,0 +1,85 @@
+/**
+ * @file imgfs_import.h
+ * @brief Bulk import of images into an open imgFS.
+ *
+ * Images are read in batches of at most IMPORT_BATCH_SIZE images (or
+ * IMPORT_BATCH_MAX_BYTES bytes) and each batch goes through
+ * do_insert_batch(), so that hashing and probing run on several threads
+ * and the metadata is committed once per batch instead of once per image.
+ *
+ * The ID of an image is the name of its file without directory and
+ * extension; files whose ID is too long, duplicated or whose content is
+ * not a valid image are reported and skipped.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+#include <stdio.h>  // for FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IMPORT_BATCH_SIZE 64
+#define IMPORT_BATCH_MAX_BYTES (64UL * 1024 * 1024) // 64 MiB of images per batch
+
+struct import_stats {
+    size_t nb_read;                                    // Files read so far
+    size_t nb_inserted;                                // Images inserted so far
+    size_t nb_failed;                                  // Files rejected so far
+    uint64_t nb_bytes;                                 // Bytes read so far
+    double seconds;                                    // Time elapsed since the start
+};
+
+/**
+ * @brief Called after each batch with the running totals.
+ */
+typedef void (*import_progress)(const struct import_stats* stats, void* arg);
+
+/**
+ * @brief Called for each file that could not be inserted.
+ */
+typedef void (*import_failure)(const char* name, int error, void* arg);
+
+struct import_options {
+    size_t nb_threads;                                 // Threads probing each batch, 0 for one per online CPU
+    import_progress progress;                          // May be NULL
+    import_failure failure;                            // May be NULL
+    void* arg;                                         // Passed to the callbacks
+};
+
+/**
+ * @brief Imports the regular files of a directory (not recursively,
+ *        skipping hidden files), in the order of their names.
+ *
+ * @param path The directory
+ * @param imgfs_file The main in-memory data structure, opened for writing
+ * @param options How to run the import (may be NULL for the defaults)
+ * @param stats Location of the final totals (may be NULL)
+ * @return Some error code if the import had to stop. 0 otherwise, even if
+ *         some files were rejected.
+ */
+int do_import_dir(const char* path, struct imgfs_file* imgfs_file,
+                  const struct import_options* options, struct import_stats* stats);
+
+/**
+ * @brief Imports the regular files of a tar (ustar) stream, in the order
+ *        of the stream; the other members are skipped.
+ *
+ * @param tar The stream, e.g. stdin
+ * @param imgfs_file The main in-memory data structure, opened for writing
+ * @param options How to run the import (may be NULL for the defaults)
+ * @param stats Location of the final totals (may be NULL)
+ * @return Some error code if the import had to stop. 0 otherwise, even if
+ *         some files were rejected.
+ */
+int do_import_tar(FILE* tar, struct imgfs_file* imgfs_file,
+                  const struct import_options* options, struct import_stats* stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,8 +2,14 @@
 #include "image_dedup.h"
 #include "error.h"
 #include "image_content.h"
+#include "imgfs_alloc.h"
+#include "imgfs_commit.h"
+#include "imgfs_direct.h"
 #include <openssl/sha.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h> // sysconf()
 
 
 /********************************************************************//**
@@ -60,9 +66,11 @@ int do_insert(const char* image_buffer, size_t image_size,
     }
 
     if (imgfs_file->metadata[empty_entry].offset[ORIG_RES]==0) {
-        fseek(imgfs_file->file,0,SEEK_END);
-        imgfs_file->metadata[empty_entry].offset[ORIG_RES] = (uint64_t) ftell(imgfs_file->file);
-        fwrite(image_buffer,image_size,1,imgfs_file->file);
+        int append_error= append_data(imgfs_file,image_buffer,image_size,
+                                      &imgfs_file->metadata[empty_entry].offset[ORIG_RES]);
+        if (append_error!=ERR_NONE) {
+            return append_error;
+        }
     }
 
 
@@ -75,20 +83,375 @@ int do_insert(const char* image_buffer, size_t image_size,
     imgfs_file->header.version++;
 
 
-    //write header to disk
-    fseek(imgfs_file->file,0,SEEK_SET);
-    size_t err_write= fwrite(&(imgfs_file->header), sizeof(struct imgfs_header),1,imgfs_file->file);
-    if (err_write!=1) {
-        return ERR_IO;
+    //write header and metadata to disk
+    int err_write= mark_header_dirty(imgfs_file);
+    if (err_write!=ERR_NONE) {
+        return err_write;
+    }
+    err_write= mark_metadata_dirty(imgfs_file, empty_entry);
+    if (err_write!=ERR_NONE) {
+        return err_write;
+    }
+
+    return commit_changes(imgfs_file);
+}
+
+/*******************************************************************
+ * Batch insertion
+ */
+
+// What the parallel phase finds out about one image of a batch
+struct batch_item {
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t width;
+    uint32_t height;
+    int probe_error;
+    uint32_t index;                                    // Slot given to the image
+    uint32_t source;                                   // Slot (< max_files) or batch item (>= max_files) whose content it shares, UINT32_MAX if new
+    uint64_t offset;                                   // Position of new content from the start of the appended run
+    int direct;                                        // Whether new content is written with O_DIRECT, at a block boundary
+};
+
+struct batch_worker {
+    const struct insert_request* requests;
+    struct batch_item* items;
+    size_t first;
+    size_t step;
+    size_t nb_requests;
+};
+
+static void* batch_probe(void* arg)
+{
+    const struct batch_worker* worker = arg;
+    for (size_t i = worker->first; i < worker->nb_requests; i += worker->step) {
+        const struct insert_request* request = &worker->requests[i];
+        struct batch_item* item = &worker->items[i];
+        if (request->image_buffer == NULL) {
+            item->probe_error = ERR_INVALID_ARGUMENT;
+            continue;
+        }
+        SHA256((const unsigned char*) request->image_buffer, request->image_size, item->SHA);
+        item->probe_error = get_resolution(&item->height, &item->width,
+                                           request->image_buffer, request->image_size);
+    }
+    return NULL;
+}
+
+/**
+ * Hashes and probes the images, on several threads if there are several.
+ * Falls back to the calling thread for the workers that cannot be started.
+ */
+static void probe_batch(const struct insert_request* requests, struct batch_item* items, size_t nb_requests,
+                        size_t nb_threads)
+{
+    if (nb_threads == 0) {
+        const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_threads = nb_cpus > 0 ? (size_t) nb_cpus : 1;
+    }
+    if (nb_threads > INSERT_BATCH_MAX_THREADS) nb_threads = INSERT_BATCH_MAX_THREADS;
+    if (nb_threads > nb_requests) nb_threads = nb_requests;
+
+    pthread_t threads[INSERT_BATCH_MAX_THREADS];
+    struct batch_worker workers[INSERT_BATCH_MAX_THREADS];
+    int started[INSERT_BATCH_MAX_THREADS] = { 0 };
+    for (size_t t = 0; t < nb_threads; ++t) {
+        workers[t] = (struct batch_worker) { requests, items, t, nb_threads, nb_requests };
+        if (t > 0) started[t] = pthread_create(&threads[t], NULL, batch_probe, &workers[t]) == 0;
+    }
+    batch_probe(&workers[0]);
+    for (size_t t = 1; t < nb_threads; ++t) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        } else {
+            batch_probe(&workers[t]);
+        }
+    }
+}
+
+/**
+ * Open-addressing table of slot/item keys, looked up by image ID or by SHA.
+ * Keys below max_files are slots of the imgFS, the others batch items.
+ */
+struct batch_table {
+    uint32_t* keys;
+    size_t mask;
+    size_t count;
+};
+
+#define TABLE_FREE UINT32_MAX
+
+static uint64_t name_hash(const char* name)
+{
+    uint64_t hash = 14695981039346656037u;
+    for (; *name != '\0'; ++name) {
+        hash ^= (unsigned char) *name;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static uint64_t sha_hash(const unsigned char* sha)
+{
+    uint64_t hash = 0;
+    memcpy(&hash, sha, sizeof(hash)); // already uniformly distributed
+    return hash;
+}
+
+struct batch_context {
+    const struct imgfs_file* imgfs_file;
+    const struct insert_request* requests;
+    const struct batch_item* items;
+};
+
+static const char* key_name(const struct batch_context* ctx, uint32_t key)
+{
+    const uint32_t max_files = ctx->imgfs_file->header.max_files;
+    return key < max_files ? ctx->imgfs_file->metadata[key].img_id : ctx->requests[key - max_files].img_id;
+}
+
+static const unsigned char* key_sha(const struct batch_context* ctx, uint32_t key)
+{
+    const uint32_t max_files = ctx->imgfs_file->header.max_files;
+    return key < max_files ? ctx->imgfs_file->metadata[key].SHA : ctx->items[key - max_files].SHA;
+}
+
+static int table_init(struct batch_table* table, size_t nb_keys)
+{
+    size_t size = 16;
+    while (size < 2 * nb_keys) size <<= 1;
+    table->keys = malloc(size * sizeof(uint32_t));
+    if (table->keys == NULL) return ERR_OUT_OF_MEMORY;
+    memset(table->keys, 0xff, size * sizeof(uint32_t)); // all TABLE_FREE
+    table->mask = size - 1;
+    table->count = 0;
+    return ERR_NONE;
+}
+
+// Lookups and insertions probe each entry at most once, so a full table cannot make them loop
+static uint32_t find_name(const struct batch_table* table, const struct batch_context* ctx, const char* name)
+{
+    size_t at = name_hash(name) & table->mask;
+    for (size_t n = 0; n <= table->mask && table->keys[at] != TABLE_FREE; ++n, at = (at + 1) & table->mask) {
+        if (strcmp(key_name(ctx, table->keys[at]), name) == 0) return table->keys[at];
+    }
+    return TABLE_FREE;
+}
+
+static uint32_t find_sha(const struct batch_table* table, const struct batch_context* ctx, const unsigned char* sha)
+{
+    size_t at = sha_hash(sha) & table->mask;
+    for (size_t n = 0; n <= table->mask && table->keys[at] != TABLE_FREE; ++n, at = (at + 1) & table->mask) {
+        if (memcmp(key_sha(ctx, table->keys[at]), sha, SHA256_DIGEST_LENGTH) == 0) return table->keys[at];
+    }
+    return TABLE_FREE;
+}
+
+// Keys are only added when not found, so no duplicates are stored
+static int table_add(struct batch_table* table, uint64_t hash, uint32_t key)
+{
+    if (table->count > table->mask) return ERR_OUT_OF_MEMORY;
+    size_t at = hash & table->mask;
+    while (table->keys[at] != TABLE_FREE) at = (at + 1) & table->mask;
+    table->keys[at] = key;
+    ++table->count;
+    return ERR_NONE;
+}
+
+/**
+ * Gives each accepted image its slot and, for new content, its position
+ * in the appended run (whose total size is returned in *total).
+ * Returns the number of accepted images.
+ */
+static size_t plan_batch(struct insert_request* requests, struct batch_item* items, size_t nb_requests,
+                         const struct imgfs_file* imgfs_file, struct batch_table* names,
+                         struct batch_table* shas, uint64_t* total)
+{
+    const struct batch_context ctx = { imgfs_file, requests, items };
+    const uint32_t max_files = imgfs_file->header.max_files;
+
+    int err = ERR_NONE;
+    for (uint32_t i = 0; i < max_files && err == ERR_NONE; ++i) {
+        if (imgfs_file->metadata[i].is_valid == EMPTY) continue;
+        err = table_add(names, name_hash(imgfs_file->metadata[i].img_id), i);
+        if (err == ERR_NONE) err = table_add(shas, sha_hash(imgfs_file->metadata[i].SHA), i);
+    }
+    if (err != ERR_NONE) {
+        for (size_t r = 0; r < nb_requests; ++r) requests[r].result = err;
+        return 0;
     }
 
-    //write metadata to disk
-    fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) + empty_entry * sizeof(struct img_metadata)), SEEK_SET);
-    err_write= fwrite(&(imgfs_file->metadata[empty_entry]), sizeof(struct img_metadata),1,imgfs_file->file);
-    if (err_write!=1) {
-        return ERR_IO;
+    size_t accepted = 0;
+    uint32_t free_slot = 0;
+    uint32_t nb_files = imgfs_file->header.nb_files;
+    *total = 0;
+    for (size_t r = 0; r < nb_requests; ++r) {
+        struct insert_request* request = &requests[r];
+        struct batch_item* item = &items[r];
+        const uint32_t key = max_files + (uint32_t) r;
+
+        if (request->img_id == NULL || request->image_buffer == NULL) {
+            request->result = ERR_INVALID_ARGUMENT;
+            continue;
+        }
+        if (request->img_id[0] == '\0' || strlen(request->img_id) > MAX_IMG_ID) {
+            request->result = ERR_INVALID_IMGID;
+            continue;
+        }
+        if (nb_files >= max_files) {
+            request->result = ERR_IMGFS_FULL;
+            continue;
+        }
+        if (item->probe_error != ERR_NONE) {
+            request->result = item->probe_error;
+            continue;
+        }
+        if (find_name(names, &ctx, request->img_id) != TABLE_FREE) {
+            request->result = ERR_DUPLICATE_ID;
+            continue;
+        }
+
+        // The tables are sized for every key, so this only guards the additions below
+        if (names->count > names->mask || shas->count > shas->mask) {
+            request->result = ERR_OUT_OF_MEMORY;
+            continue;
+        }
+
+        while (free_slot < max_files && imgfs_file->metadata[free_slot].is_valid != EMPTY) ++free_slot;
+        if (free_slot >= max_files) {
+            request->result = ERR_IMGFS_FULL;
+            continue;
+        }
+        item->index = free_slot++;
+        ++nb_files;
+
+        item->source = find_sha(shas, &ctx, item->SHA);
+        if (item->source == TABLE_FREE) {
+            item->source = UINT32_MAX;
+            item->direct = direct_applies(imgfs_file, request->image_size);
+            if (item->direct) {
+                *total = (*total + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+            }
+            item->offset = *total;
+            *total += item->direct
+                      ? (request->image_size + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN
+                      : request->image_size;
+            table_add(shas, sha_hash(item->SHA), key);
+        }
+        table_add(names, name_hash(request->img_id), key);
+        request->result = ERR_NONE;
+        ++accepted;
     }
+    return accepted;
+}
 
+/**
+ * Writes the new contents of the batch in one run at *base.
+ */
+static int append_batch(const struct insert_request* requests, const struct batch_item* items,
+                        size_t nb_requests, struct imgfs_file* imgfs_file, uint64_t total, uint64_t* base)
+{
+    uint64_t align = 1;
+    for (size_t r = 0; r < nb_requests; ++r) {
+        if (requests[r].result == ERR_NONE && items[r].source == UINT32_MAX && items[r].direct) align = DIRECT_IO_ALIGN;
+    }
+    int err = alloc_data_aligned(imgfs_file, total, align, base);
+    if (err != ERR_NONE) return err;
 
+    for (size_t r = 0; r < nb_requests; ++r) {
+        if (requests[r].result != ERR_NONE || items[r].source != UINT32_MAX) continue;
+        const uint64_t offset = *base + items[r].offset;
+        if (items[r].direct) {
+            err = direct_write(imgfs_file, offset, requests[r].image_buffer, requests[r].image_size);
+            if (err != ERR_NONE) return err;
+        } else if (fseek(imgfs_file->file, (long) offset, SEEK_SET) != 0
+                   || fwrite(requests[r].image_buffer, requests[r].image_size, 1, imgfs_file->file) != 1) {
+            return ERR_IO;
+        }
+    }
     return ERR_NONE;
 }
+
+/********************************************************************//**
+ * Insert several images in the imgFS file
+ ********************************************************************** */
+int do_insert_batch(struct insert_request* requests, size_t nb_requests, size_t nb_threads,
+                    struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(requests);
+    if (nb_requests == 0) return ERR_NONE;
+    if (nb_requests > UINT32_MAX - imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    struct batch_item* items = calloc(nb_requests, sizeof(struct batch_item));
+    uint32_t* indices = calloc(nb_requests, sizeof(uint32_t));
+    struct batch_table names = { NULL, 0, 0 };
+    struct batch_table shas = { NULL, 0, 0 };
+    // Sized from the slots in use rather than nb_files, which a damaged imgFS may undercount
+    size_t nb_keys = nb_requests;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid != EMPTY) ++nb_keys;
+    }
+    int err = items == NULL || indices == NULL ? ERR_OUT_OF_MEMORY : table_init(&names, nb_keys);
+    if (err == ERR_NONE) err = table_init(&shas, nb_keys);
+
+    size_t accepted = 0;
+    uint64_t total = 0;
+    uint64_t base = 0;
+    if (err == ERR_NONE) {
+        probe_batch(requests, items, nb_requests, nb_threads);
+        accepted = plan_batch(requests, items, nb_requests, imgfs_file, &names, &shas, &total);
+        if (accepted > 0 && total > 0) {
+            err = append_batch(requests, items, nb_requests, imgfs_file, total, &base);
+        }
+    }
+
+    // Only now that all the contents are written do the slots change
+    size_t nb_indices = 0;
+    for (size_t r = 0; r < nb_requests && err == ERR_NONE; ++r) {
+        if (requests[r].result != ERR_NONE) continue;
+        const struct batch_item* item = &items[r];
+        struct img_metadata* metadata = &imgfs_file->metadata[item->index];
+
+        memset(metadata, 0, sizeof(*metadata));
+        strncpy(metadata->img_id, requests[r].img_id, MAX_IMG_ID);
+        memcpy(metadata->SHA, item->SHA, SHA256_DIGEST_LENGTH);
+        metadata->orig_res[0] = item->width;
+        metadata->orig_res[1] = item->height;
+        metadata->size[ORIG_RES] = (uint32_t) requests[r].image_size;
+        if (item->source == UINT32_MAX) {
+            metadata->offset[ORIG_RES] = base + item->offset;
+        } else {
+            // Batch items are filled in order, so an earlier one is already set.
+            // All the resolutions are shared, as in do_name_and_content_dedup()
+            const uint32_t max_files = imgfs_file->header.max_files;
+            const uint32_t slot = item->source < max_files ? item->source : items[item->source - max_files].index;
+            for (int res = THUMB_RES; res <= ORIG_RES; ++res) {
+                metadata->offset[res] = imgfs_file->metadata[slot].offset[res];
+                metadata->size[res] = imgfs_file->metadata[slot].size[res];
+            }
+        }
+        metadata->is_valid = NON_EMPTY;
+        imgfs_file->header.nb_files++;
+        imgfs_file->header.version++;
+        indices[nb_indices++] = item->index;
+    }
+
+    if (err == ERR_NONE && nb_indices > 0) {
+        err = mark_metadata_dirty_batch(imgfs_file, indices, nb_indices);
+        if (err == ERR_NONE) err = mark_header_dirty(imgfs_file);
+        if (err == ERR_NONE) err = commit_changes(imgfs_file);
+    }
+    if (err != ERR_NONE) {
+        for (size_t r = 0; r < nb_requests; ++r) {
+            if (requests[r].result == ERR_NONE) requests[r].result = err;
+        }
+    }
+
+    free(shas.keys);
+    free(names.keys);
+    free(indices);
+    free(items);
+    return err;
+}
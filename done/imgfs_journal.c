@@ -0,0 +1,303 @@
+/**
+ * @file imgfs_journal.c
+ * @brief Write-ahead journal of the header and metadata changes of an imgFS.
+ */
+
+#include "imgfs_journal.h"
+#include "imgfs_commit.h"
+#include "imgfs_ext.h"
+#include "error.h"
+
+#include <openssl/sha.h>
+#include <stddef.h> // offsetof()
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // fdatasync(), ftruncate()
+
+/*******************************************************************
+ * FNV-1a hash, to tell a torn record from a complete one
+ */
+static uint32_t fnv1a(uint32_t hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t record_checksum(const struct journal_record* record, const void* image)
+{
+    const uint32_t hash = fnv1a(2166136261u, record, offsetof(struct journal_record, checksum));
+    return fnv1a(hash, image, record->size);
+}
+
+/*******************************************************************
+ * "<name>.journal"
+ */
+int journal_path(const char* imgfs_filename, char* path, size_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_filename);
+    M_REQUIRE_NON_NULL(path);
+
+    const int written = snprintf(path, size, "%s" JOURNAL_SUFFIX, imgfs_filename);
+    if (written < 0 || (size_t) written >= size) return ERR_INVALID_FILENAME;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Open for appending
+ */
+int journal_open(const char* imgfs_filename, FILE** journal)
+{
+    M_REQUIRE_NON_NULL(journal);
+
+    char path[FILENAME_MAX];
+    int err = journal_path(imgfs_filename, path, sizeof(path));
+    if (err != ERR_NONE) return err;
+
+    *journal = fopen(path, "ab");
+    return *journal == NULL ? ERR_IO : ERR_NONE;
+}
+
+/*******************************************************************
+ * One record and its image
+ */
+int journal_append(FILE* journal, uint32_t type, uint32_t index, const void* image, uint32_t size)
+{
+    M_REQUIRE_NON_NULL(journal);
+    M_REQUIRE_NON_NULL(image);
+
+    struct journal_record record = { type, index, size, 0 };
+    record.checksum = record_checksum(&record, image);
+    if (fwrite(&record, sizeof(record), 1, journal) != 1
+        || fwrite(image, size, 1, journal) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * End of a transaction
+ */
+int journal_commit(FILE* journal, uint32_t nb_records)
+{
+    M_REQUIRE_NON_NULL(journal);
+
+    struct journal_record record = { JOURNAL_COMMIT, nb_records, 0, 0 };
+    record.checksum = record_checksum(&record, NULL);
+    if (fwrite(&record, sizeof(record), 1, journal) != 1 || fflush(journal) != 0) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Durability of the committed transactions
+ */
+int journal_sync(FILE* journal)
+{
+    M_REQUIRE_NON_NULL(journal);
+
+    return fdatasync(fileno(journal)) == 0 ? ERR_NONE : ERR_IO;
+}
+
+/*******************************************************************
+ * Empty the journal
+ */
+int journal_reset(FILE* journal)
+{
+    M_REQUIRE_NON_NULL(journal);
+
+    if (fflush(journal) != 0 || ftruncate(fileno(journal), 0) != 0 || fsync(fileno(journal)) != 0) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Reads the whole journal, ERR_NONE with a NULL buffer if there is none
+ */
+static int read_journal(const char* path, char** buffer, size_t* size)
+{
+    *buffer = NULL;
+    *size = 0;
+    FILE* journal = fopen(path, "rb");
+    if (journal == NULL) return ERR_NONE;
+
+    int err = ERR_NONE;
+    if (fseek(journal, 0, SEEK_END) != 0) err = ERR_IO;
+    const long length = ftell(journal);
+    if (err == ERR_NONE && length > 0) {
+        *buffer = malloc((size_t) length);
+        if (*buffer == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else if (fseek(journal, 0, SEEK_SET) != 0
+                   || fread(*buffer, (size_t) length, 1, journal) != 1) {
+            free(*buffer);
+            *buffer = NULL;
+            err = ERR_IO;
+        } else {
+            *size = (size_t) length;
+        }
+    }
+    fclose(journal);
+    return err;
+}
+
+/*******************************************************************
+ * Whether a replayed image still has the content it was inserted with
+ */
+static int content_matches(struct imgfs_file* imgfs_file, const struct img_metadata* metadata)
+{
+    const uint32_t size = metadata->size[ORIG_RES];
+    char* content = malloc(size);
+    if (content == NULL) return 0;
+
+    int matches = 0;
+    if (fseek(imgfs_file->file, (long) metadata->offset[ORIG_RES], SEEK_SET) == 0
+        && fread(content, size, 1, imgfs_file->file) == 1) {
+        unsigned char sha[SHA256_DIGEST_LENGTH];
+        SHA256((const unsigned char*) content, size, sha);
+        matches = memcmp(sha, metadata->SHA, SHA256_DIGEST_LENGTH) == 0;
+    }
+    free(content);
+    return matches;
+}
+
+/*******************************************************************
+ * Applies the committed transactions of the journal in memory, and
+ * flags the slots they touch; the last extension block is left in `ext`.
+ * The extension block never moves once created, so a header image keeps
+ * the position the imgFS already has.
+ */
+static void apply_transactions(const char* buffer, size_t size, struct imgfs_file* imgfs_file,
+                               unsigned char* touched, int* header_touched,
+                               struct imgfs_ext* ext, int* ext_touched)
+{
+    size_t pos = 0;
+    size_t transaction = 0; // start of the current transaction
+    uint32_t nb_records = 0;
+
+    while (pos + sizeof(struct journal_record) <= size) {
+        struct journal_record record;
+        memcpy(&record, buffer + pos, sizeof(record));
+        const char* image = buffer + pos + sizeof(record);
+        if (record.size > size - pos - sizeof(record) || record_checksum(&record, image) != record.checksum) {
+            break; // torn tail
+        }
+
+        if (record.type == JOURNAL_COMMIT) {
+            if (record.index != nb_records) break;
+            // The records of the transaction were all checked below
+            for (size_t at = transaction; at < pos; ) {
+                struct journal_record applied;
+                memcpy(&applied, buffer + at, sizeof(applied));
+                const char* applied_image = buffer + at + sizeof(applied);
+                if (applied.type == JOURNAL_HEADER) {
+                    const uint64_t ext_offset = imgfs_file->header.ext_offset;
+                    memcpy(&imgfs_file->header, applied_image, sizeof(struct imgfs_header));
+                    if (ext_offset != 0) imgfs_file->header.ext_offset = ext_offset;
+                    *header_touched = 1;
+                } else if (applied.type == JOURNAL_EXT) {
+                    memcpy(ext, applied_image, sizeof(struct imgfs_ext));
+                    *ext_touched = 1;
+                } else {
+                    memcpy(&imgfs_file->metadata[applied.index], applied_image, sizeof(struct img_metadata));
+                    touched[applied.index] = 1;
+                }
+                at += sizeof(applied) + applied.size;
+            }
+            transaction = pos + sizeof(record);
+            nb_records = 0;
+        } else if (record.type == JOURNAL_HEADER) {
+            struct imgfs_header header;
+            if (record.size != sizeof(header)) break;
+            memcpy(&header, image, sizeof(header));
+            if (header.max_files != imgfs_file->header.max_files) break;
+            ++nb_records;
+        } else if (record.type == JOURNAL_METADATA) {
+            if (record.size != sizeof(struct img_metadata) || record.index >= imgfs_file->header.max_files) break;
+            ++nb_records;
+        } else if (record.type == JOURNAL_EXT) {
+            if (record.size != sizeof(struct imgfs_ext)) break;
+            ++nb_records;
+        } else {
+            break;
+        }
+        pos += sizeof(record) + record.size;
+    }
+}
+
+/*******************************************************************
+ * Recovery
+ */
+int journal_replay(const char* imgfs_filename, struct imgfs_file* imgfs_file, int writable)
+{
+    M_REQUIRE_NON_NULL(imgfs_filename);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    char path[FILENAME_MAX];
+    int err = journal_path(imgfs_filename, path, sizeof(path));
+    if (err != ERR_NONE) return err;
+
+    char* buffer = NULL;
+    size_t size = 0;
+    err = read_journal(path, &buffer, &size);
+    if (err != ERR_NONE || buffer == NULL) {
+        // Nothing to replay; an empty journal left by a clean close can go
+        if (err == ERR_NONE && writable) remove(path);
+        return err;
+    }
+
+    unsigned char* touched = calloc(imgfs_file->header.max_files, sizeof(unsigned char));
+    if (touched == NULL) {
+        free(buffer);
+        return ERR_OUT_OF_MEMORY;
+    }
+    int header_touched = 0;
+    struct imgfs_ext ext;
+    int ext_touched = 0;
+    apply_transactions(buffer, size, imgfs_file, touched, &header_touched, &ext, &ext_touched);
+    free(buffer);
+    if (imgfs_file->header.ext_offset == 0) ext_touched = 0;
+    if (ext_touched) err = ext_replace(imgfs_file, &ext);
+
+    // Blobs are not journaled, but the ones of the replayed slots, derived
+    // images included, were synced before their commit record: check the originals
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (!touched[i]) continue;
+        struct img_metadata* metadata = &imgfs_file->metadata[i];
+        if (metadata->is_valid == NON_EMPTY && !content_matches(imgfs_file, metadata)) {
+            metadata->is_valid = EMPTY;
+            if (imgfs_file->header.nb_files > 0) imgfs_file->header.nb_files--;
+            header_touched = 1;
+        }
+    }
+
+    if (writable) {
+        // There is no commit state yet, so these write at once (by whole pages)
+        if (header_touched && err == ERR_NONE) err = mark_header_dirty(imgfs_file);
+        if (ext_touched && err == ERR_NONE) err = mark_ext_dirty(imgfs_file, &ext);
+        uint32_t* indices = malloc(imgfs_file->header.max_files * sizeof(uint32_t));
+        if (indices == NULL && err == ERR_NONE) err = ERR_OUT_OF_MEMORY;
+        if (err == ERR_NONE) {
+            size_t nb_touched = 0;
+            for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+                if (touched[i]) indices[nb_touched++] = i;
+            }
+            err = mark_metadata_dirty_batch(imgfs_file, indices, nb_touched);
+        }
+        free(indices);
+        if (err == ERR_NONE && (fflush(imgfs_file->file) != 0 || fdatasync(fileno(imgfs_file->file)) != 0)) {
+            err = ERR_IO;
+        }
+        // Only once everything is durable in the imgFS
+        if (err == ERR_NONE) remove(path);
+    }
+    free(touched);
+    return err;
+}
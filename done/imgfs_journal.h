@@ -0,0 +1,119 @@
+/**
+ * @file imgfs_journal.h
+ * @brief Write-ahead journal of the header and metadata changes of an imgFS.
+ *
+ * The journal is an append-only file next to the imgFS ("<name>.journal").
+ * Each transaction is a run of header, metadata and extension block images
+ * followed by a commit record; once the commit record is synced, the
+ * changes may reach the imgFS itself at any later time (see
+ * imgfs_commit.h). do_open() replays the committed transactions and
+ * ignores a torn tail, so recovery reads the journal instead of checking
+ * every slot.
+ *
+ * Blobs are not journaled, but synced before the commit record of the
+ * slots pointing to them: the replayed slots keep their derived
+ * resolutions, and an image whose content does not match its SHA after
+ * replay (appended but never synced) is dropped.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#include <stdint.h> // for uint32_t
+#include <stdio.h>  // for FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAX_SIZE (256 * 1024) // journal size at which changes are checkpointed into the imgFS
+
+// Record types
+#define JOURNAL_HEADER   1
+#define JOURNAL_METADATA 2
+#define JOURNAL_COMMIT   3
+#define JOURNAL_EXT      4
+
+struct journal_record {
+    uint32_t type;                                     // One of the JOURNAL_ types
+    uint32_t index;                                    // Metadata slot, or number of records of the transaction
+    uint32_t size;                                     // Size of the image that follows
+    uint32_t checksum;                                 // FNV-1a of the fields above and of the image
+};
+
+/**
+ * @brief Builds the path of the journal of an imgFS.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param path Buffer for the journal path
+ * @param size Size of the buffer
+ * @return Some error code. 0 if no error.
+ */
+int journal_path(const char* imgfs_filename, char* path, size_t size);
+
+/**
+ * @brief Opens (creating it if needed) the journal of an imgFS for appending.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param journal Location of the journal file pointer
+ * @return Some error code. 0 if no error.
+ */
+int journal_open(const char* imgfs_filename, FILE** journal);
+
+/**
+ * @brief Appends the image of the header, of one metadata slot or of the
+ *        extension block.
+ *
+ * @param journal The journal
+ * @param type JOURNAL_HEADER, JOURNAL_METADATA or JOURNAL_EXT
+ * @param index The metadata slot (0 for the header and the extension block)
+ * @param image The header, metadata or extension block
+ * @param size Its size
+ * @return Some error code. 0 if no error.
+ */
+int journal_append(FILE* journal, uint32_t type, uint32_t index, const void* image, uint32_t size);
+
+/**
+ * @brief Ends a transaction and hands it to the kernel (without syncing).
+ *
+ * @param journal The journal
+ * @param nb_records Number of records appended since the last commit
+ * @return Some error code. 0 if no error.
+ */
+int journal_commit(FILE* journal, uint32_t nb_records);
+
+/**
+ * @brief Makes the committed transactions durable.
+ *
+ * @param journal The journal
+ * @return Some error code. 0 if no error.
+ */
+int journal_sync(FILE* journal);
+
+/**
+ * @brief Empties the journal, once everything in it is durable in the imgFS.
+ *
+ * @param journal The journal
+ * @return Some error code. 0 if no error.
+ */
+int journal_reset(FILE* journal);
+
+/**
+ * @brief Replays the committed transactions of the journal of an imgFS
+ *        whose header and metadata were just read (called by do_open()).
+ *
+ * If the imgFS is writable, the replayed parts are written and synced and
+ * the journal is removed; otherwise they are only applied in memory.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param imgfs_file The main in-memory data structure
+ * @param writable Whether the imgFS was opened for writing
+ * @return Some error code. 0 if no error.
+ */
+int journal_replay(const char* imgfs_filename, struct imgfs_file* imgfs_file, int writable);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,201 @@
+/**
+ * @file imgfs_lock.c
+ * @brief Mutex that profiles its contention, by call site.
+ */
+
+#include "imgfs_lock.h"
+#include "imgfs_trace.h"
+#include "imgfs_slowlog.h"
+#include "error.h"
+
+#include <errno.h>
+#include <stddef.h> // offsetof()
+#include <string.h>
+#include <time.h>
+
+static const char* const site_names[NB_LOCK_SITES] = { "list", "read", "insert", "delete", "resize", "commit" };
+
+static pthread_mutex_t locks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct imgfs_lock* all_locks = NULL;
+
+// Lock held by the calling thread, if any (the imgFS code never holds two at once)
+static __thread const struct imgfs_lock* held_lock = NULL;
+
+/********************************************************************/
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// Only the holder of the lock writes its statistics, but they may be read meanwhile
+static void bump(uint64_t* counter, uint64_t amount)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+static void raise_max(uint64_t* max, uint64_t value)
+{
+    if (value > __atomic_load_n(max, __ATOMIC_RELAXED)) __atomic_store_n(max, value, __ATOMIC_RELAXED);
+}
+
+static void snapshot(const struct imgfs_lock* lock, struct lock_site_stats* stats)
+{
+    for (int s = 0; s < NB_LOCK_SITES; ++s) {
+        const struct lock_site_stats* site = &lock->sites[s];
+        stats[s].acquisitions = __atomic_load_n(&site->acquisitions, __ATOMIC_RELAXED);
+        stats[s].contended = __atomic_load_n(&site->contended, __ATOMIC_RELAXED);
+        stats[s].wait_ns = __atomic_load_n(&site->wait_ns, __ATOMIC_RELAXED);
+        stats[s].max_wait_ns = __atomic_load_n(&site->max_wait_ns, __ATOMIC_RELAXED);
+        stats[s].hold_ns = __atomic_load_n(&site->hold_ns, __ATOMIC_RELAXED);
+        stats[s].max_hold_ns = __atomic_load_n(&site->max_hold_ns, __ATOMIC_RELAXED);
+    }
+}
+
+/********************************************************************/
+int imgfs_lock_init(struct imgfs_lock* lock, const char* name)
+{
+    M_REQUIRE_NON_NULL(lock);
+    M_REQUIRE_NON_NULL(name);
+
+    *lock = (struct imgfs_lock) {
+        .name = name
+    };
+    if (pthread_mutex_init(&lock->mutex, NULL) != 0) return ERR_THREADING;
+
+    pthread_mutex_lock(&locks_lock);
+    lock->next = all_locks;
+    all_locks = lock;
+    pthread_mutex_unlock(&locks_lock);
+    return ERR_NONE;
+}
+
+void imgfs_lock_destroy(struct imgfs_lock* lock)
+{
+    if (lock == NULL) return;
+    pthread_mutex_lock(&locks_lock);
+    for (struct imgfs_lock** link = &all_locks; *link != NULL; link = &(*link)->next) {
+        if (*link == lock) {
+            *link = lock->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&locks_lock);
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+/*******************************************************************
+ * Acquire, timing the wait only when the lock is already held
+ */
+void imgfs_lock_acquire(struct imgfs_lock* lock, enum lock_site site)
+{
+    imgfs_lock_retake(lock, site, site);
+}
+
+void imgfs_lock_retake(struct imgfs_lock* lock, enum lock_site wait_site, enum lock_site hold_site)
+{
+    const uint64_t span_start = trace_now();
+    uint64_t waited = 0;
+    int contended = 0;
+    if (pthread_mutex_trylock(&lock->mutex) == EBUSY) {
+        contended = 1;
+        const uint64_t start = now_ns();
+        pthread_mutex_lock(&lock->mutex);
+        lock->acquired_at = now_ns();
+        waited = lock->acquired_at - start;
+        slowlog_lock_wait(waited);
+    } else {
+        lock->acquired_at = now_ns();
+    }
+    trace_span("lock wait", span_start);
+
+    held_lock = lock;
+    lock->holder = (int) hold_site;
+    struct lock_site_stats* stats = &lock->sites[wait_site];
+    bump(&stats->acquisitions, 1);
+    if (contended) {
+        bump(&stats->contended, 1);
+        bump(&stats->wait_ns, waited);
+        raise_max(&stats->max_wait_ns, waited);
+    }
+}
+
+void imgfs_lock_release(struct imgfs_lock* lock)
+{
+    const uint64_t held = now_ns() - lock->acquired_at;
+    struct lock_site_stats* stats = &lock->sites[lock->holder];
+    bump(&stats->hold_ns, held);
+    raise_max(&stats->max_hold_ns, held);
+    if (held_lock == lock) held_lock = NULL;
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+int imgfs_lock_held(const struct imgfs_lock* lock)
+{
+    return lock != NULL && held_lock == lock;
+}
+
+/********************************************************************/
+const char* lock_site_name(enum lock_site site)
+{
+    return site < NB_LOCK_SITES ? site_names[site] : "unknown";
+}
+
+/*******************************************************************
+ * Reporting
+ */
+void imgfs_lock_report(const struct imgfs_lock* lock, FILE* out)
+{
+    if (lock == NULL || out == NULL) return;
+    struct lock_site_stats stats[NB_LOCK_SITES];
+    snapshot(lock, stats);
+
+    fprintf(out, "Lock %s:\n", lock->name);
+    fprintf(out, "%-8s %12s %12s %14s %12s %14s %12s\n", "site", "acquired", "contended",
+            "wait total ms", "wait max ms", "hold total ms", "hold max ms");
+    for (int s = 0; s < NB_LOCK_SITES; ++s) {
+        if (stats[s].acquisitions == 0) continue;
+        fprintf(out, "%-8s %12llu %12llu %14.3f %12.3f %14.3f %12.3f\n", site_names[s],
+                (unsigned long long) stats[s].acquisitions, (unsigned long long) stats[s].contended,
+                (double) stats[s].wait_ns / 1e6, (double) stats[s].max_wait_ns / 1e6,
+                (double) stats[s].hold_ns / 1e6, (double) stats[s].max_hold_ns / 1e6);
+    }
+}
+
+// One metric over all the locks and sites; field is the offset of the value in lock_site_stats
+static void print_metric(FILE* out, const char* name, const char* type, const char* help,
+                         size_t field, double scale)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (const struct imgfs_lock* lock = all_locks; lock != NULL; lock = lock->next) {
+        struct lock_site_stats stats[NB_LOCK_SITES];
+        snapshot(lock, stats);
+        for (int s = 0; s < NB_LOCK_SITES; ++s) {
+            uint64_t value = 0;
+            memcpy(&value, (const char*) &stats[s] + field, sizeof(value));
+            fprintf(out, "%s{lock=\"%s\",site=\"%s\"} ", name, lock->name, site_names[s]);
+            if (scale > 0) fprintf(out, "%.6f\n", (double) value / scale);
+            else fprintf(out, "%llu\n", (unsigned long long) value);
+        }
+    }
+}
+
+void imgfs_lock_print_metrics(FILE* out)
+{
+    if (out == NULL) return;
+    pthread_mutex_lock(&locks_lock);
+    print_metric(out, "imgfs_lock_acquisitions_total", "counter", "Acquisitions of a lock, by call site.",
+                 offsetof(struct lock_site_stats, acquisitions), 0);
+    print_metric(out, "imgfs_lock_contended_total", "counter", "Acquisitions that found the lock held, by call site.",
+                 offsetof(struct lock_site_stats, contended), 0);
+    print_metric(out, "imgfs_lock_wait_seconds_total", "counter", "Time waited for a lock, by call site.",
+                 offsetof(struct lock_site_stats, wait_ns), 1e9);
+    print_metric(out, "imgfs_lock_wait_seconds_max", "gauge", "Longest wait for a lock, by call site.",
+                 offsetof(struct lock_site_stats, max_wait_ns), 1e9);
+    print_metric(out, "imgfs_lock_hold_seconds_total", "counter", "Time a lock was held, by call site.",
+                 offsetof(struct lock_site_stats, hold_ns), 1e9);
+    print_metric(out, "imgfs_lock_hold_seconds_max", "gauge", "Longest hold of a lock, by call site.",
+                 offsetof(struct lock_site_stats, max_hold_ns), 1e9);
+    pthread_mutex_unlock(&locks_lock);
+}
@@ -0,0 +1,117 @@
+/**
+ * @file imgfs_lock.h
+ * @brief Mutex that profiles its contention, by call site.
+ *
+ * Each acquisition names its call site. The lock counts, per site, the
+ * acquisitions, the contended ones (the lock was held when asked for),
+ * the total and max time waited for it and the total and max time it
+ * was then held. The statistics are updated while the lock is held, so
+ * they need no lock of their own.
+ *
+ * When the resize pool or a group commit releases the lock of a request
+ * and takes it back, the retake and its wait are charged to
+ * LOCK_SITE_RESIZE or LOCK_SITE_COMMIT, while both holds (but not the
+ * time in between) stay charged to the request's site. LOCK_SITE_COMMIT
+ * is also the site of the commit flusher.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h> // for FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum lock_site {
+    LOCK_SITE_LIST,
+    LOCK_SITE_READ,
+    LOCK_SITE_INSERT,
+    LOCK_SITE_DELETE,
+    LOCK_SITE_RESIZE,
+    LOCK_SITE_COMMIT,
+    NB_LOCK_SITES
+};
+
+struct lock_site_stats {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t hold_ns;
+    uint64_t max_hold_ns;
+};
+
+struct imgfs_lock {
+    pthread_mutex_t mutex;
+    const char* name;
+    struct imgfs_lock* next; // In the list of the locks shown in the metrics
+    int holder;              // Site of the current holder
+    uint64_t acquired_at;    // ns
+    struct lock_site_stats sites[NB_LOCK_SITES];
+};
+
+/**
+ * @brief Initializes a lock, shown in the metrics until it is destroyed.
+ *
+ * @param lock The lock to initialize
+ * @param name Static name of the lock, e.g. "imgfs_mutex"
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_lock_init(struct imgfs_lock* lock, const char* name);
+
+/**
+ * @brief Destroys a lock, which must not be held.
+ */
+void imgfs_lock_destroy(struct imgfs_lock* lock);
+
+/**
+ * @brief Acquires a lock.
+ *
+ * @param lock The lock
+ * @param site Where it is acquired
+ */
+void imgfs_lock_acquire(struct imgfs_lock* lock, enum lock_site site);
+
+/**
+ * @brief Takes back a lock released in the middle of a hold.
+ *
+ * @param lock The lock
+ * @param wait_site Site charged with the acquisition and its wait
+ * @param hold_site Site charged with the rest of the hold, where the lock was first acquired
+ */
+void imgfs_lock_retake(struct imgfs_lock* lock, enum lock_site wait_site, enum lock_site hold_site);
+
+/**
+ * @brief Releases a lock held by the calling thread.
+ */
+void imgfs_lock_release(struct imgfs_lock* lock);
+
+/**
+ * @brief Whether the calling thread holds a lock.
+ *
+ * @param lock The lock
+ * @return 1 if it does, 0 otherwise.
+ */
+int imgfs_lock_held(const struct imgfs_lock* lock);
+
+/**
+ * @brief Name of a call site, e.g. "read".
+ */
+const char* lock_site_name(enum lock_site site);
+
+/**
+ * @brief Prints the statistics of a lock as a table, e.g. at shutdown.
+ */
+void imgfs_lock_report(const struct imgfs_lock* lock, FILE* out);
+
+/**
+ * @brief Prints the statistics of all the locks in the Prometheus text format.
+ */
+void imgfs_lock_print_metrics(FILE* out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,411 @@
+/**
+ * @file imgfs_metrics.c
+ * @brief Counters and latency histograms of the server and of the resizes.
+ */
+
+#define _GNU_SOURCE // open_memstream()
+
+#include "imgfs_metrics.h"
+#include "imgfs_lock.h"
+#include "imgfs_heap.h"
+#include "image_content.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum metrics_status { STATUS_200, STATUS_302, STATUS_404, STATUS_500, STATUS_OTHER, NB_STATUSES };
+#define NB_ERROR_CODES (ERR_LAST - ERR_FIRST)
+
+static const char* const route_names[NB_ROUTES] = { "index", "list", "read", "delete", "insert", "metrics", "trace", "other" };
+static const char* const status_names[NB_STATUSES] = { "200", "302", "404", "500", "other" };
+
+// Upper bounds of the exported histogram buckets, in seconds
+static const double bucket_bounds[] = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+struct metrics_hist {
+    uint64_t counts[METRICS_HIST_SIZE];
+    uint64_t sum_us;
+};
+
+struct metrics_shard {
+    struct metrics_shard* next;                        // In the list of all shards
+    struct metrics_shard* next_free;                   // In the list of the shards no thread uses
+    uint64_t requests[NB_ROUTES];
+    uint64_t statuses[NB_ROUTES][NB_STATUSES];
+    uint64_t errors[NB_ROUTES][NB_ERROR_CODES];
+    uint64_t bytes_in[NB_ROUTES];
+    uint64_t bytes_out[NB_ROUTES];
+    uint64_t allocations[NB_ROUTES];
+    uint64_t alloc_bytes[NB_ROUTES];
+    uint64_t max_allocations[NB_ROUTES];
+    struct metrics_hist latency[NB_ROUTES];
+    struct metrics_hist resize;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+};
+
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard* all_shards = NULL;
+static struct metrics_shard* free_shards = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct metrics_shard* thread_shard = NULL;
+static __thread int current_route = -1;
+static __thread double current_start = 0;
+static __thread struct heap_usage current_heap;
+
+/********************************************************************/
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Only the owner of a shard writes it, but the metrics may be read meanwhile
+static void bump(uint64_t* counter, uint64_t amount)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t* counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************
+ * Shard of the calling thread, NULL if none could be allocated
+ */
+static void release_shard(void* arg)
+{
+    struct metrics_shard* shard = arg;
+    pthread_mutex_lock(&shards_lock);
+    shard->next_free = free_shards;
+    free_shards = shard;
+    pthread_mutex_unlock(&shards_lock);
+}
+
+static void create_shard_key(void)
+{
+    (void) pthread_key_create(&shard_key, release_shard);
+}
+
+static struct metrics_shard* get_shard(void)
+{
+    if (thread_shard != NULL) return thread_shard;
+    pthread_once(&shard_key_once, create_shard_key);
+
+    pthread_mutex_lock(&shards_lock);
+    struct metrics_shard* shard = free_shards;
+    if (shard != NULL) {
+        free_shards = shard->next_free; // its counts are kept: they are totals
+    } else {
+        shard = calloc(1, sizeof(struct metrics_shard));
+        if (shard != NULL) {
+            shard->next = all_shards;
+            all_shards = shard;
+        }
+    }
+    pthread_mutex_unlock(&shards_lock);
+
+    if (shard != NULL) {
+        (void) pthread_setspecific(shard_key, shard);
+        thread_shard = shard;
+    }
+    return shard;
+}
+
+/*******************************************************************
+ * Histogram buckets
+ */
+static size_t bucket_of(uint64_t us)
+{
+    if (us < METRICS_HIST_LINEAR) return (size_t) us;
+    const unsigned msb = 63 - (unsigned) __builtin_clzll(us);
+    const unsigned shift = msb - 5; // us >> shift is in [METRICS_HIST_HALF, 2 * METRICS_HIST_HALF)
+    if (shift > METRICS_HIST_MAX_SHIFT) return METRICS_HIST_SIZE - 1;
+    return METRICS_HIST_LINEAR + (shift - 1) * METRICS_HIST_HALF + (size_t) ((us >> shift) - METRICS_HIST_HALF);
+}
+
+// Highest value a bucket holds
+static uint64_t bucket_top(size_t bucket)
+{
+    if (bucket < METRICS_HIST_LINEAR) return bucket;
+    const unsigned shift = (unsigned) ((bucket - METRICS_HIST_LINEAR) / METRICS_HIST_HALF) + 1;
+    const uint64_t top = METRICS_HIST_HALF + (bucket - METRICS_HIST_LINEAR) % METRICS_HIST_HALF;
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_record(struct metrics_hist* hist, double seconds)
+{
+    const uint64_t us = seconds > 0 ? (uint64_t) (seconds * 1e6) : 0;
+    bump(&hist->counts[bucket_of(us)], 1);
+    bump(&hist->sum_us, us);
+}
+
+static void hist_add(struct metrics_hist* into, const struct metrics_hist* hist)
+{
+    for (size_t b = 0; b < METRICS_HIST_SIZE; ++b) into->counts[b] += load(&hist->counts[b]);
+    into->sum_us += load(&hist->sum_us);
+}
+
+/*******************************************************************
+ * Recording
+ */
+const char* metrics_route_name(enum metrics_route route)
+{
+    return route < NB_ROUTES ? route_names[route] : route_names[ROUTE_OTHER];
+}
+
+void metrics_request_begin(enum metrics_route route, size_t bytes_in)
+{
+    struct metrics_shard* shard = get_shard();
+    if (shard == NULL || route >= NB_ROUTES) return;
+    current_route = (int) route;
+    current_start = now_seconds();
+    heap_usage_get(&current_heap);
+    bump(&shard->requests[route], 1);
+    bump(&shard->bytes_in[route], bytes_in);
+}
+
+void metrics_reply(const char* status, size_t bytes_out)
+{
+    struct metrics_shard* shard = get_shard();
+    if (shard == NULL || current_route < 0 || status == NULL) return;
+    int code = STATUS_OTHER;
+    for (int s = 0; s < STATUS_OTHER; ++s) {
+        if (strncmp(status, status_names[s], 3) == 0) code = s;
+    }
+    bump(&shard->statuses[current_route][code], 1);
+    bump(&shard->bytes_out[current_route], bytes_out);
+}
+
+void metrics_error(int error)
+{
+    struct metrics_shard* shard = get_shard();
+    if (shard == NULL || current_route < 0 || error <= ERR_FIRST || error >= ERR_LAST) return;
+    bump(&shard->errors[current_route][error - ERR_FIRST], 1);
+}
+
+void metrics_request_end(void)
+{
+    struct metrics_shard* shard = get_shard();
+    if (shard == NULL || current_route < 0) return;
+    hist_record(&shard->latency[current_route], now_seconds() - current_start);
+    struct heap_usage heap;
+    heap_usage_get(&heap);
+    const uint64_t allocations = heap.allocations - current_heap.allocations;
+    bump(&shard->allocations[current_route], allocations);
+    bump(&shard->alloc_bytes[current_route], heap.bytes - current_heap.bytes);
+    if (allocations > load(&shard->max_allocations[current_route])) {
+        __atomic_store_n(&shard->max_allocations[current_route], allocations, __ATOMIC_RELAXED);
+    }
+    current_route = -1;
+}
+
+void metrics_resize(double seconds)
+{
+    struct metrics_shard* shard = get_shard();
+    if (shard != NULL) hist_record(&shard->resize, seconds);
+}
+
+void metrics_cache(int hit)
+{
+    struct metrics_shard* shard = get_shard();
+    if (shard != NULL) bump(hit ? &shard->cache_hits : &shard->cache_misses, 1);
+}
+
+/*******************************************************************
+ * Exposition
+ */
+static void print_metric_header(FILE* out, const char* name, const char* type, const char* help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void print_totals(FILE* out, const char* name, const char* labels, uint64_t sum_us, uint64_t total)
+{
+    const char* lbrace = labels[0] != '\0' ? "{" : "";
+    const char* rbrace = labels[0] != '\0' ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %.6f\n", name, lbrace, labels, rbrace, (double) sum_us / 1e6);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, lbrace, labels, rbrace, (unsigned long long) total);
+}
+
+// As a Prometheus histogram, with the buckets of bucket_bounds
+static void print_hist(FILE* out, const char* name, const char* labels, const struct metrics_hist* hist)
+{
+    uint64_t total = 0;
+    for (size_t b = 0; b < METRICS_HIST_SIZE; ++b) total += hist->counts[b];
+    const char* sep = labels[0] != '\0' ? "," : "";
+
+    size_t b = 0;
+    uint64_t below = 0;
+    for (size_t i = 0; i < sizeof(bucket_bounds) / sizeof(bucket_bounds[0]); ++i) {
+        const uint64_t bound_us = (uint64_t) (bucket_bounds[i] * 1e6 + 0.5);
+        while (b < METRICS_HIST_SIZE && bucket_top(b) <= bound_us) below += hist->counts[b++];
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep, bucket_bounds[i],
+                (unsigned long long) below);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long) total);
+    print_totals(out, name, labels, hist->sum_us, total);
+}
+
+// As a Prometheus summary, with the quantiles of quantiles
+static void print_quantiles(FILE* out, const char* name, const char* labels, const struct metrics_hist* hist)
+{
+    uint64_t total = 0;
+    for (size_t b = 0; b < METRICS_HIST_SIZE; ++b) total += hist->counts[b];
+    const char* sep = labels[0] != '\0' ? "," : "";
+
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); ++q) {
+        const uint64_t rank = (uint64_t) ((double) total * quantiles[q] + 0.5);
+        uint64_t seen = 0;
+        double value = 0;
+        for (size_t b = 0; b < METRICS_HIST_SIZE && total > 0; ++b) {
+            seen += hist->counts[b];
+            if (seen >= rank && seen > 0) {
+                const uint64_t top_us = bucket_top(b);
+                value = (double) top_us / 1e6;
+                break;
+            }
+        }
+        fprintf(out, "%s{%s%squantile=\"%g\"} %.6f\n", name, labels, sep, quantiles[q], value);
+    }
+    print_totals(out, name, labels, hist->sum_us, total);
+}
+
+static void sum_shards(struct metrics_shard* sum)
+{
+    pthread_mutex_lock(&shards_lock);
+    for (const struct metrics_shard* shard = all_shards; shard != NULL; shard = shard->next) {
+        for (int r = 0; r < NB_ROUTES; ++r) {
+            sum->requests[r] += load(&shard->requests[r]);
+            sum->bytes_in[r] += load(&shard->bytes_in[r]);
+            sum->bytes_out[r] += load(&shard->bytes_out[r]);
+            sum->allocations[r] += load(&shard->allocations[r]);
+            sum->alloc_bytes[r] += load(&shard->alloc_bytes[r]);
+            const uint64_t max_allocations = load(&shard->max_allocations[r]);
+            if (max_allocations > sum->max_allocations[r]) sum->max_allocations[r] = max_allocations;
+            for (int s = 0; s < NB_STATUSES; ++s) sum->statuses[r][s] += load(&shard->statuses[r][s]);
+            for (int e = 0; e < NB_ERROR_CODES; ++e) sum->errors[r][e] += load(&shard->errors[r][e]);
+            hist_add(&sum->latency[r], &shard->latency[r]);
+        }
+        hist_add(&sum->resize, &shard->resize);
+        sum->cache_hits += load(&shard->cache_hits);
+        sum->cache_misses += load(&shard->cache_misses);
+    }
+    pthread_mutex_unlock(&shards_lock);
+}
+
+/********************************************************************/
+int metrics_format(char** text, size_t* size)
+{
+    M_REQUIRE_NON_NULL(text);
+    M_REQUIRE_NON_NULL(size);
+
+    struct metrics_shard* sum = calloc(1, sizeof(struct metrics_shard));
+    if (sum == NULL) return ERR_OUT_OF_MEMORY;
+    sum_shards(sum);
+
+    *text = NULL;
+    *size = 0;
+    FILE* out = open_memstream(text, size);
+    if (out == NULL) {
+        free(sum);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    char labels[64];
+    print_metric_header(out, "imgfs_http_requests_total", "counter", "Requests received, by route.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        fprintf(out, "imgfs_http_requests_total{route=\"%s\"} %llu\n", route_names[r],
+                (unsigned long long) sum->requests[r]);
+    }
+    print_metric_header(out, "imgfs_http_responses_total", "counter", "Replies sent, by route and HTTP status.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        for (int s = 0; s < NB_STATUSES; ++s) {
+            if (sum->statuses[r][s] == 0) continue;
+            fprintf(out, "imgfs_http_responses_total{route=\"%s\",status=\"%s\"} %llu\n", route_names[r],
+                    status_names[s], (unsigned long long) sum->statuses[r][s]);
+        }
+    }
+    print_metric_header(out, "imgfs_http_errors_total", "counter", "Requests that failed, by route and error.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        for (int e = 1; e < NB_ERROR_CODES; ++e) {
+            if (sum->errors[r][e] == 0) continue;
+            fprintf(out, "imgfs_http_errors_total{route=\"%s\",error=\"%s\"} %llu\n", route_names[r],
+                    ERR_MSG(e + ERR_FIRST), (unsigned long long) sum->errors[r][e]);
+        }
+    }
+    print_metric_header(out, "imgfs_http_request_body_bytes_total", "counter", "Bytes of request bodies, by route.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        fprintf(out, "imgfs_http_request_body_bytes_total{route=\"%s\"} %llu\n", route_names[r],
+                (unsigned long long) sum->bytes_in[r]);
+    }
+    print_metric_header(out, "imgfs_http_response_body_bytes_total", "counter", "Bytes of reply bodies, by route.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        fprintf(out, "imgfs_http_response_body_bytes_total{route=\"%s\"} %llu\n", route_names[r],
+                (unsigned long long) sum->bytes_out[r]);
+    }
+
+    print_metric_header(out, "imgfs_http_request_allocations_total", "counter", "Heap allocations made serving requests, by route.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        fprintf(out, "imgfs_http_request_allocations_total{route=\"%s\"} %llu\n", route_names[r],
+                (unsigned long long) sum->allocations[r]);
+    }
+    print_metric_header(out, "imgfs_http_request_allocated_bytes_total", "counter", "Bytes of the heap allocations made serving requests, by route.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        fprintf(out, "imgfs_http_request_allocated_bytes_total{route=\"%s\"} %llu\n", route_names[r],
+                (unsigned long long) sum->alloc_bytes[r]);
+    }
+    print_metric_header(out, "imgfs_http_request_allocations_max", "gauge", "Most heap allocations made serving one request, by route.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        fprintf(out, "imgfs_http_request_allocations_max{route=\"%s\"} %llu\n", route_names[r],
+                (unsigned long long) sum->max_allocations[r]);
+    }
+
+    print_metric_header(out, "imgfs_http_request_duration_seconds", "histogram", "Time to serve a request, by route.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        snprintf(labels, sizeof(labels), "route=\"%s\"", route_names[r]);
+        print_hist(out, "imgfs_http_request_duration_seconds", labels, &sum->latency[r]);
+    }
+    print_metric_header(out, "imgfs_http_request_latency_seconds", "summary", "Quantiles of the time to serve a request, by route.");
+    for (int r = 0; r < NB_ROUTES; ++r) {
+        snprintf(labels, sizeof(labels), "route=\"%s\"", route_names[r]);
+        print_quantiles(out, "imgfs_http_request_latency_seconds", labels, &sum->latency[r]);
+    }
+
+    print_metric_header(out, "imgfs_resize_duration_seconds", "histogram", "Time to make a derived image, waiting for the resize pool included.");
+    print_hist(out, "imgfs_resize_duration_seconds", "", &sum->resize);
+    print_metric_header(out, "imgfs_resize_latency_seconds", "summary", "Quantiles of the time to make a derived image.");
+    print_quantiles(out, "imgfs_resize_latency_seconds", "", &sum->resize);
+
+    print_metric_header(out, "imgfs_derived_cache_hits_total", "counter", "Reads of derived images already stored.");
+    fprintf(out, "imgfs_derived_cache_hits_total %llu\n", (unsigned long long) sum->cache_hits);
+    print_metric_header(out, "imgfs_derived_cache_misses_total", "counter", "Reads of derived images that had to be made.");
+    fprintf(out, "imgfs_derived_cache_misses_total %llu\n", (unsigned long long) sum->cache_misses);
+    const uint64_t lookups = sum->cache_hits + sum->cache_misses;
+    print_metric_header(out, "imgfs_derived_cache_hit_ratio", "gauge", "Share of the reads of derived images that were hits.");
+    fprintf(out, "imgfs_derived_cache_hit_ratio %.6f\n", lookups > 0 ? (double) sum->cache_hits / (double) lookups : 0.0);
+
+    imgfs_lock_print_metrics(out);
+    image_print_metrics(out);
+
+    free(sum);
+    const int failed = ferror(out);
+    if (fclose(out) != 0 || failed) {
+        free(*text);
+        *text = NULL;
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
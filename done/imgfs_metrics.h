@@ -0,0 +1,102 @@
+/**
+ * @file imgfs_metrics.h
+ * @brief Counters and latency histograms of the server and of the resizes.
+ *
+ * Each thread records into a shard of its own, so that recording takes
+ * no lock and touches no shared cache line; a shard outlives its thread
+ * and is handed, with its counts, to the next thread that needs one, so
+ * that there are never more shards than threads alive at once. Reading
+ * the metrics sums all the shards.
+ *
+ * Latencies go into HDR-style log-linear histograms: exact to the
+ * microsecond below METRICS_HIST_LINEAR us, then METRICS_HIST_HALF
+ * buckets per power of two (about 3% wide).
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define METRICS_HIST_LINEAR 64
+#define METRICS_HIST_HALF 32
+#define METRICS_HIST_MAX_SHIFT 36
+#define METRICS_HIST_SIZE (METRICS_HIST_LINEAR + METRICS_HIST_MAX_SHIFT * METRICS_HIST_HALF)
+
+enum metrics_route {
+    ROUTE_INDEX,
+    ROUTE_LIST,
+    ROUTE_READ,
+    ROUTE_DELETE,
+    ROUTE_INSERT,
+    ROUTE_METRICS,
+    ROUTE_TRACE,
+    ROUTE_OTHER,
+    NB_ROUTES
+};
+
+/**
+ * @brief Name of a route, e.g. "read".
+ */
+const char* metrics_route_name(enum metrics_route route);
+
+/**
+ * @brief Starts timing a request on the calling thread.
+ *
+ * @param route The route of the request
+ * @param bytes_in Size of its body
+ */
+void metrics_request_begin(enum metrics_route route, size_t bytes_in);
+
+/**
+ * @brief Records the reply to the current request of the calling thread.
+ *
+ * @param status HTTP status line, e.g. "200 OK"
+ * @param bytes_out Size of the body of the reply
+ */
+void metrics_reply(const char* status, size_t bytes_out);
+
+/**
+ * @brief Records the error code the current request of the calling
+ *        thread failed with.
+ *
+ * @param error One of the error codes of error.h
+ */
+void metrics_error(int error);
+
+/**
+ * @brief Records the latency of the current request of the calling thread,
+ *        and the heap allocations it made (see imgfs_heap.h).
+ */
+void metrics_request_end(void);
+
+/**
+ * @brief Records one resize (queueing on the resize pool included).
+ *
+ * @param seconds Its duration
+ */
+void metrics_resize(double seconds);
+
+/**
+ * @brief Records a read of a derived image that was already stored (hit),
+ *        or had to be made (miss).
+ *
+ * @param hit 1 for a hit, 0 for a miss
+ */
+void metrics_cache(int hit);
+
+/**
+ * @brief Formats all the metrics in the Prometheus text format.
+ *
+ * @param text Location of the newly allocated text (to be freed)
+ * @param size Location of its size
+ * @return Some error code. 0 if no error.
+ */
+int metrics_format(char** text, size_t* size);
+
+#ifdef __cplusplus
+}
+#endif
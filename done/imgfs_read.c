@@ -1,35 +1,70 @@
 #include "imgfs.h"
 #include "error.h"
 #include "image_content.h"
+#include "image_variant.h"
+#include "imgfs_alloc.h"
+#include "imgfs_metrics.h"
 #include <stdlib.h>
 #include <string.h>
 
 /********************************************************************//**
- * Reads the content of an image from a imgFS.
+ * Index of a valid image by id, -1 if absent.
  ********************************************************************** */
-int do_read(const char* img_id, int resolution, char** image_buffer,
-            uint32_t* image_size, struct imgfs_file* imgfs_file)
+static int find_image(const char* img_id, const struct imgfs_file* imgfs_file)
 {
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid == NON_EMPTY && strcmp(img_id,imgfs_file->metadata[i].img_id)==0) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/********************************************************************//**
+ * Makes room in a reused buffer.
+ ********************************************************************** */
+int read_buffer_reserve(struct read_buffer* buffer, size_t size)
+{
+    M_REQUIRE_NON_NULL(buffer);
+    if (size <= buffer->capacity && buffer->data != NULL) return ERR_NONE;
+
+    const size_t capacity = size > 0 ? size : 1;
+    char* data = realloc(buffer->data, capacity);
+    if (data == NULL) return ERR_OUT_OF_MEMORY;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return ERR_NONE;
+}
+
+void read_buffer_free(struct read_buffer* buffer)
+{
+    if (buffer == NULL) return;
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+}
 
+/********************************************************************//**
+ * Reads the content of an image from a imgFS into a reused buffer.
+ ********************************************************************** */
+int do_read_into(const char* img_id, int resolution, struct read_buffer* buffer,
+                 uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
     M_REQUIRE_NON_NULL(img_id);
-    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(buffer);
     M_REQUIRE_NON_NULL(image_size);
     M_REQUIRE_NON_NULL(imgfs_file);
 
     if(imgfs_file->header.nb_files == 0)return ERR_IMAGE_NOT_FOUND;
 
-    int index=-1;
-    for (int i = 0; i < (int) imgfs_file->header.max_files; ++i) {
-        if (imgfs_file->metadata[i].is_valid == NON_EMPTY && strcmp(img_id,imgfs_file->metadata[i].img_id)==0) {
-            index=i;
-            break;
-        }
-    }
+    const int index = find_image(img_id, imgfs_file);
     if (index==-1) {
         return ERR_IMAGE_NOT_FOUND;
     }
 
-    if (imgfs_file->metadata[index].offset[resolution]==0 || imgfs_file->metadata[index].size[resolution]==0) {
+    const int stored = imgfs_file->metadata[index].offset[resolution]!=0 && imgfs_file->metadata[index].size[resolution]!=0;
+    if (resolution!=ORIG_RES)metrics_cache(stored);
+    if (!stored) {
         if (resolution==ORIG_RES)return ERR_IMAGE_NOT_FOUND;
         int err_resize= lazily_resize(resolution,imgfs_file,(size_t) index);
         if (err_resize!=ERR_NONE) {
@@ -37,22 +72,100 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
         }
     }
 
+    const uint32_t size = imgfs_file->metadata[index].size[resolution];
+    const int err = read_buffer_reserve(buffer, size);
+    if (err != ERR_NONE) return err;
+
+    if (read_data(imgfs_file, imgfs_file->metadata[index].offset[resolution], size, buffer->data) != ERR_NONE) {
+        return ERR_IO;
+    }
+
+    *image_size=size;
+
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Reads the content of an image from a imgFS.
+ ********************************************************************** */
+int do_read(const char* img_id, int resolution, char** image_buffer,
+            uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    struct read_buffer buffer = { NULL, 0 };
+    const int err = do_read_into(img_id, resolution, &buffer, image_size, imgfs_file);
+    if (err != ERR_NONE) {
+        read_buffer_free(&buffer);
+        return err;
+    }
+    *image_buffer = buffer.data;
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Reads the content of an image from a imgFS in a given encoding.
+ ********************************************************************** */
+int do_read_encoded(const char* img_id, int resolution, int encoding, struct read_buffer* buffer,
+                    uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
 
-    fseek(imgfs_file->file, (long) imgfs_file->metadata[index].offset[resolution], SEEK_SET);
+    if (encoding < 0 || encoding >= NB_ENCODINGS) return ERR_INVALID_ARGUMENT;
+    if (resolution < THUMB_RES || resolution > ORIG_RES) return ERR_RESOLUTIONS;
 
-    *image_buffer= calloc(1,imgfs_file->metadata[index].size[resolution]);
-    if (*image_buffer==NULL) {
-        return ERR_OUT_OF_MEMORY;
+    //Originals and JPEG resolutions are the regular ones
+    if (encoding == ENC_JPEG || resolution == ORIG_RES) {
+        return do_read_into(img_id, resolution, buffer, image_size, imgfs_file);
     }
 
-    size_t read= fread(*image_buffer,imgfs_file->metadata[index].size[resolution],1,imgfs_file->file);
-    if (read!=1) {
-        free(*image_buffer);
-        return ERR_IO;
+    const int index = find_image(img_id, imgfs_file);
+    if (index < 0) return ERR_IMAGE_NOT_FOUND;
+    return read_variant(imgfs_file, (size_t) index, imgfs_file->header.resized_res[2 * resolution],
+                        imgfs_file->header.resized_res[2 * resolution + 1], encoding,
+                        buffer, image_size);
+}
+
+/********************************************************************//**
+ * Reads an image from a imgFS resized to fit in any box.
+ ********************************************************************** */
+int do_read_sized(const char* img_id, uint16_t width, uint16_t height, int* encoding,
+                  struct read_buffer* buffer, uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(encoding);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    if (*encoding < 0 || *encoding >= NB_ENCODINGS) return ERR_INVALID_ARGUMENT;
+    if (width == 0 || height == 0 || width > MAX_VARIANT_RES || height > MAX_VARIANT_RES) {
+        return ERR_RESOLUTIONS;
     }
 
+    const int index = find_image(img_id, imgfs_file);
+    if (index < 0) return ERR_IMAGE_NOT_FOUND;
+    const struct img_metadata* meta = &imgfs_file->metadata[index];
+
+    //Never upscale: the original already fits in the box
+    if (width >= meta->orig_res[0] && height >= meta->orig_res[1]) {
+        *encoding = ENC_JPEG;
+        return do_read_into(img_id, ORIG_RES, buffer, image_size, imgfs_file);
+    }
 
-    *image_size=imgfs_file->metadata[index].size[resolution];
+    //Preset sizes are read (or created) with their resolution code
+    for (int res = THUMB_RES; res < ORIG_RES; ++res) {
+        if (imgfs_file->header.resized_res[2 * res] == width
+            && imgfs_file->header.resized_res[2 * res + 1] == height) {
+            return do_read_encoded(img_id, res, *encoding, buffer, image_size, imgfs_file);
+        }
+    }
 
-    return ERR_NONE;
+    return read_variant(imgfs_file, (size_t) index, width, height, *encoding, buffer, image_size);
 }
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> // strncasecmp
 #include <stdint.h> // uint16_t
 #include <vips/vips.h>
 #include <pthread.h> //multithreading
@@ -17,22 +18,109 @@
 #include "imgfs.h"
 #include "http_net.h"
 #include "imgfs_server_service.h"
+#include "resize_pool.h"
+#include "imgfs_commit.h"
+#include "imgfs_direct.h"
+#include "imgfs_metrics.h"
+#include "imgfs_trace.h"
+#include "imgfs_lock.h"
+#include "imgfs_slowlog.h"
 
 
 // Main in-memory structure for imgFS
 static struct imgfs_file fs_file;
 static uint16_t server_port;
 
-static pthread_mutex_t imgfs_mutex;
+static struct imgfs_lock imgfs_mutex;
+
+// Requests being handled: server_shutdown() stops taking new ones and waits
+// for these before tearing down what they use
+static pthread_mutex_t requests_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requests_done = PTHREAD_COND_INITIALIZER;
+static size_t requests_in_flight = 0;
+static int stopping = 0;
 
 #define URI_ROOT "/imgfs"
 
+// Images are read into a buffer of the connection thread, reused from one
+// read to the next; a buffer grown past READ_BUFFER_KEEP (by an original,
+// say) is freed after its reply rather than kept by an idle connection
+#define READ_BUFFER_KEEP (1 << 20)
+static __thread struct read_buffer read_buffer;
+static pthread_key_t read_buffer_key;
+static pthread_once_t read_buffer_once = PTHREAD_ONCE_INIT;
+
+// Content type of each encoding, and the order in which the server picks among
+// equally acceptable ones for derived images (JPEG first, so that a client
+// accepting anything gets the encoding every client can show)
+static const char* const encoding_mime[NB_ENCODINGS] = { "image/jpeg", "image/webp", "image/avif" };
+static const int encoding_preference[NB_ENCODINGS] = { ENC_JPEG, ENC_AVIF, ENC_WEBP };
+
 /********************************************************************//**
  * Startup function. Create imgFS file and load in-memory structure.
- * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2],
+ * optionnaly followed by "-commit <direct|per-op|group|async>",
+ * "-direct <KiB>", "-trace <spans per thread>", "-slowlog <ms>",
+ * "-vips-threads <n>", "-vips-cache <operations>" and/or "-vips-mem <MiB>"
  ********************************************************************** */
 int server_startup(int argc, char **argv)
 {
+    // Durability of the header and metadata writes (see imgfs_commit.h),
+    // and size from which blobs bypass the page cache (see imgfs_direct.h)
+    int commit_mode = COMMIT_DIRECT;
+    size_t direct_threshold = 0;
+    uint32_t slow_ms = 0;
+    // libvips runs inside the resize pool, which already runs one resize
+    // per CPU: by default, no fan-out of its own, and no operation cache
+    // (each resize decodes a buffer of its own, there is nothing to reuse)
+    int vips_threads = 1;
+    int vips_cache = 0;
+    size_t vips_mem = 0; // 0: the budget of the resize pool, no cap on the cache memory
+    while (argc >= 2) {
+        if (strcmp(argv[argc - 2], "-commit") == 0) {
+            commit_mode = commit_mode_atoi(argv[argc - 1]);
+            if (commit_mode < 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (strcmp(argv[argc - 2], "-direct") == 0) {
+            const uint32_t kib = atouint32(argv[argc - 1]);
+            if (kib == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            direct_threshold = (size_t) kib << 10;
+        } else if (strcmp(argv[argc - 2], "-trace") == 0) {
+            const uint32_t spans = atouint32(argv[argc - 1]);
+            if (spans == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            trace_configure(spans);
+        } else if (strcmp(argv[argc - 2], "-slowlog") == 0) {
+            slow_ms = atouint32(argv[argc - 1]);
+            if (slow_ms == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (strcmp(argv[argc - 2], "-vips-threads") == 0) {
+            vips_threads = atouint16(argv[argc - 1]);
+            if (vips_threads == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (strcmp(argv[argc - 2], "-vips-cache") == 0) {
+            vips_cache = atouint16(argv[argc - 1]);
+            if (vips_cache == 0 && strcmp(argv[argc - 1], "0") != 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+        } else if (strcmp(argv[argc - 2], "-vips-mem") == 0) {
+            const uint32_t mib = atouint32(argv[argc - 1]);
+            if (mib == 0) {
+                return ERR_INVALID_ARGUMENT;
+            }
+            vips_mem = (size_t) mib << 20;
+        } else {
+            break;
+        }
+        argc -= 2;
+    }
+
     // Check if the required number of arguments is provided
     if (argc < 1) {
         return ERR_NOT_ENOUGH_ARGUMENTS;
@@ -46,19 +134,34 @@ int server_startup(int argc, char **argv)
     if (ret != ERR_NONE) {
         return ERR_IMGLIB;
     }
+    vips_concurrency_set(vips_threads);
+    vips_cache_set_max(vips_cache);
+    if (vips_mem > 0) vips_cache_set_max_mem(vips_mem);
 
     // Initialize the mutex for multithreading
-    if (pthread_mutex_init(&imgfs_mutex, NULL) != 0) {
+    if (imgfs_lock_init(&imgfs_mutex, "imgfs_mutex") != ERR_NONE) {
         fprintf(stderr, "Failed to initialize mutex\n");
         vips_shutdown();
         return ERR_THREADING;
     }
 
-    // Open the file system file
+    // Start the resize workers, whose decoded pixels in flight stay within -vips-mem;
+    // request threads release imgfs_mutex while waiting on them
+    int error_pool = resize_pool_init(0, 0, vips_mem, &imgfs_mutex);
+    if (error_pool != ERR_NONE) {
+        vips_shutdown();
+        imgfs_lock_destroy(&imgfs_mutex);
+        return error_pool;
+    }
+
+    // Open the file system file; in group mode, requests release imgfs_mutex while their commit is synced
+    commit_configure(commit_mode, &imgfs_mutex);
+    direct_io_configure(direct_threshold);
     int error_open = do_open(argv[0], "rb+", &fs_file);
     if (error_open < 0) {
+        resize_pool_shutdown();
         vips_shutdown(); // Shut down the VIPS library
-        pthread_mutex_destroy(&imgfs_mutex); // Destroy the mutex
+        imgfs_lock_destroy(&imgfs_mutex); // Destroy the mutex
         return ERR_INVALID_FILENAME;
     }
 
@@ -77,11 +180,23 @@ int server_startup(int argc, char **argv)
     int error_init = http_init(server_port, handle_http_message);
     if (error_init < 0) {
         do_close(&fs_file);
+        resize_pool_shutdown();
         vips_shutdown(); // Shut down the VIPS library
-        pthread_mutex_destroy(&imgfs_mutex); // Destroy the mutex
+        imgfs_lock_destroy(&imgfs_mutex); // Destroy the mutex
         return error_init;
     }
 
+    // Start the writer of the slow-request log
+    int error_log = slowlog_start(slow_ms);
+    if (error_log != ERR_NONE) {
+        http_close();
+        do_close(&fs_file);
+        resize_pool_shutdown();
+        vips_shutdown(); // Shut down the VIPS library
+        imgfs_lock_destroy(&imgfs_mutex); // Destroy the mutex
+        return error_log;
+    }
+
     // Print the server start message
     printf("ImgFS server started on http://localhost:%d\n", server_port);
     return ERR_NONE;
@@ -93,25 +208,44 @@ int server_startup(int argc, char **argv)
 void server_shutdown(void)
 {
     fprintf(stderr, "Shutting down...\n");
-    vips_shutdown(); // Shut down the VIPS library
     http_close(); // Close the HTTP server
+    pthread_mutex_lock(&requests_lock); // Refuse new requests and let the current ones finish
+    stopping = 1;
+    while (requests_in_flight > 0) pthread_cond_wait(&requests_done, &requests_lock);
+    pthread_mutex_unlock(&requests_lock);
+    resize_pool_shutdown(); // Finish the pending resizes before libvips goes away
+    vips_shutdown(); // Shut down the VIPS library
+    slowlog_stop(); // Write the pending slow-request records
     do_close(&fs_file); // Close the file system file
-    pthread_mutex_destroy(&imgfs_mutex); // Destroy the mutex
+    imgfs_lock_report(&imgfs_mutex, stderr); // How contended the mutex was
+    imgfs_lock_destroy(&imgfs_mutex); // Destroy the mutex
 }
 
 
+/**********************************************************************
+ * Sends a reply, counted in the metrics.
+ ********************************************************************** */
+static int reply(int connection, const char* status, const char* headers,
+                 const char *body, size_t body_len)
+{
+    metrics_reply(status, body_len);
+    slowlog_reply(status, body_len);
+    return http_reply(connection, status, headers, body, body_len);
+}
+
 /**********************************************************************
  * Sends error message.
  ********************************************************************** */
 static int reply_error_msg(int connection, int error)
 {
 #define ERR_MSG_SIZE 256
+    metrics_error(error);
     char err_msg[ERR_MSG_SIZE]; // enough for any reasonable err_msg
     if (snprintf(err_msg, ERR_MSG_SIZE, "Error: %s\n", ERR_MSG(error)) < 0) {
         fprintf(stderr, "reply_error_msg(): sprintf() failed...\n");
         return ERR_RUNTIME;
     }
-    return http_reply(connection, "500 Internal Server Error", "",
+    return reply(connection, "500 Internal Server Error", "",
                       err_msg, strlen(err_msg));
 }
 
@@ -126,7 +260,7 @@ static int reply_302_msg(int connection)
         fprintf(stderr, "reply_302_msg(): sprintf() failed...\n");
         return ERR_RUNTIME;
     }
-    return http_reply(connection, "302 Found", location, "", 0);
+    return reply(connection, "302 Found", location, "", 0);
 }
 
 /**********************************************************************
@@ -138,31 +272,119 @@ int handle_http_message(struct http_message* msg, int connection)
     debug_printf("handle_http_message() on connection %d. URI: %.*s\n",
                  connection,
                  (int) msg->uri.len, msg->uri.val);
+
+    pthread_mutex_lock(&requests_lock);
+    const int accepted = !stopping;
+    if (accepted) ++requests_in_flight;
+    pthread_mutex_unlock(&requests_lock);
+    if (!accepted) return http_reply(connection, "503 Service Unavailable", "", "", 0);
+
+    enum metrics_route route = ROUTE_OTHER;
     if (http_match_verb(&msg->uri, "/") || http_match_uri(msg, "/index.html")) {
-        return http_serve_file(connection, BASE_FILE);
-    }
-
-    if (http_match_uri(msg, URI_ROOT "/list") ) {
-        return handle_list_call(connection);
-    }  else if (http_match_uri(msg, URI_ROOT "/read")  ) {
-        return handle_read_call( connection, msg);
-    }  else if (http_match_uri(msg, URI_ROOT "/delete")) {
-        return handle_delete_call( connection, msg);
-    }  else if (http_match_uri(msg, URI_ROOT "/insert")
-                && http_match_verb(&msg->method, "POST")) {
-        return handle_insert_call( connection, msg);
-    } else
-        return reply_error_msg(connection, ERR_INVALID_COMMAND);
+        route = ROUTE_INDEX;
+    } else if (http_match_uri(msg, URI_ROOT "/list")) {
+        route = ROUTE_LIST;
+    } else if (http_match_uri(msg, URI_ROOT "/read")) {
+        route = ROUTE_READ;
+    } else if (http_match_uri(msg, URI_ROOT "/delete")) {
+        route = ROUTE_DELETE;
+    } else if (http_match_uri(msg, URI_ROOT "/insert")
+               && http_match_verb(&msg->method, "POST")) {
+        route = ROUTE_INSERT;
+    } else if (http_match_uri(msg, URI_ROOT "/metrics")) {
+        route = ROUTE_METRICS;
+    } else if (http_match_uri(msg, URI_ROOT "/trace")) {
+        route = ROUTE_TRACE;
+    }
+
+    metrics_request_begin(route, msg->body.len);
+    slowlog_begin(metrics_route_name(route), msg->body.len);
+    const uint64_t span_start = trace_now();
+    int result = ERR_NONE;
+    switch (route) {
+    case ROUTE_INDEX:
+        result = http_serve_file(connection, BASE_FILE);
+        break;
+    case ROUTE_LIST:
+        result = handle_list_call(connection);
+        break;
+    case ROUTE_READ:
+        result = handle_read_call(connection, msg);
+        break;
+    case ROUTE_DELETE:
+        result = handle_delete_call(connection, msg);
+        break;
+    case ROUTE_INSERT:
+        result = handle_insert_call(connection, msg);
+        break;
+    case ROUTE_METRICS:
+        result = handle_metrics_call(connection);
+        break;
+    case ROUTE_TRACE:
+        result = handle_trace_call(connection);
+        break;
+    default:
+        result = reply_error_msg(connection, ERR_INVALID_COMMAND);
+        break;
+    }
+    trace_span(metrics_route_name(route), span_start);
+    metrics_request_end();
+    slowlog_end();
+
+    pthread_mutex_lock(&requests_lock);
+    if (--requests_in_flight == 0) pthread_cond_broadcast(&requests_done);
+    pthread_mutex_unlock(&requests_lock);
+    return result;
 }
+
+/**********************************************************************
+ * Handle the metrics command: counters and histograms, in the
+ * Prometheus text format.
+ ********************************************************************** */
+static int handle_metrics_call(int connection)
+{
+    char* text = NULL;
+    size_t size = 0;
+    const int result = metrics_format(&text, &size);
+    if (result != ERR_NONE) {
+        return reply_error_msg(connection, result);
+    }
+
+    const int ret = reply(connection, HTTP_OK,
+                          "Content-Type: text/plain; version=0.0.4" HTTP_LINE_DELIM,
+                          text, size);
+    free(text);
+    return ret;
+}
+
+/**********************************************************************
+ * Handle the trace command: the last spans of each thread, as Chrome
+ * trace-event JSON.
+ ********************************************************************** */
+static int handle_trace_call(int connection)
+{
+    char* text = NULL;
+    size_t size = 0;
+    const int result = trace_format(&text, &size);
+    if (result != ERR_NONE) {
+        return reply_error_msg(connection, result);
+    }
+
+    const int ret = reply(connection, HTTP_OK, "Content-Type: application/json" HTTP_LINE_DELIM,
+                          text, size);
+    free(text);
+    return ret;
+}
+
 /**********************************************************************
  * Handle the list command.
  ********************************************************************** */
 static int handle_list_call(int connection)
 {
     char *json_response = NULL;
-    pthread_mutex_lock(&imgfs_mutex); // Acquire mutex lock for thread safety
+    imgfs_lock_acquire(&imgfs_mutex, LOCK_SITE_LIST); // Acquire mutex lock for thread safety
     int result = do_list(&fs_file, JSON, &json_response); // Get the list in JSON format
-    pthread_mutex_unlock(&imgfs_mutex); // Release mutex lock
+    imgfs_lock_release(&imgfs_mutex); // Release mutex lock
 
     if (result != ERR_NONE) {
         if(json_response!=NULL)free(json_response);
@@ -178,13 +400,157 @@ static int handle_list_call(int connection)
     }
 
     // Send HTTP response with JSON data
-    result = http_reply(connection, HTTP_OK, headers, json_response, strlen(json_response));
+    result = reply(connection, HTTP_OK, headers, json_response, strlen(json_response));
     free(json_response); // Free the allocated memory for JSON response
 
     return result;
 }
 
 
+/**********************************************************************
+ * Bounds of a string without its leading and trailing spaces.
+ ********************************************************************** */
+static void trim(const char** start, const char** end)
+{
+    while (*start < *end && (**start == ' ' || **start == '\t')) ++*start;
+    while (*end > *start && ((*end)[-1] == ' ' || (*end)[-1] == '\t')) --*end;
+}
+
+/**********************************************************************
+ * Weight of a q parameter, in thousandths; -1 if not a valid qvalue.
+ ********************************************************************** */
+static int parse_qvalue(const char* value, const char* end)
+{
+    if (value >= end || (*value != '0' && *value != '1')) return -1;
+    int q = (*value++ - '0') * 1000;
+    if (value < end && *value == '.') {
+        ++value;
+        for (int scale = 100; value < end && scale > 0 && *value >= '0' && *value <= '9'; scale /= 10) {
+            q += (*value++ - '0') * scale;
+        }
+    }
+    return value == end && q <= 1000 ? q : -1;
+}
+
+/**********************************************************************
+ * How closely a media range matches a content type: 3 for the type
+ * itself, 2 for "image/\*", 1 for "\*\/\*", 0 if it does not match.
+ ********************************************************************** */
+static int media_match(const char* range, size_t len, const char* mime)
+{
+    if (len == strlen(mime) && strncasecmp(range, mime, len) == 0) return 3;
+    if (len == 7 && strncasecmp(range, "image/*", len) == 0) return 2;
+    if (len == 3 && strncmp(range, "*/*", len) == 0) return 1;
+    return 0;
+}
+
+/**********************************************************************
+ * Applies one media range of an Accept header ("type/subtype" followed
+ * by parameters) to the weight of each encoding: the most specific range
+ * matching an encoding gives its weight.
+ ********************************************************************** */
+static void apply_media_range(const char* start, const char* end, int* weight, int* specificity)
+{
+    const char* type_end = memchr(start, ';', (size_t) (end - start));
+    if (type_end == NULL) type_end = end;
+    const char* params = type_end;
+    trim(&start, &type_end);
+
+    int q = 1000;
+    while (params < end) {
+        const char* param = params + 1;
+        params = memchr(param, ';', (size_t) (end - param));
+        if (params == NULL) params = end;
+        const char* param_end = params;
+        trim(&param, &param_end);
+        if (param_end - param >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+            q = parse_qvalue(param + 2, param_end);
+            if (q < 0) return; // ill-formed: the range is ignored
+        }
+    }
+
+    for (int e = 0; e < NB_ENCODINGS; ++e) {
+        const int match = media_match(start, (size_t) (type_end - start), encoding_mime[e]);
+        if (match > specificity[e]) {
+            specificity[e] = match;
+            weight[e] = q;
+        }
+    }
+}
+
+/**********************************************************************
+ * Choose the encoding of a derived image from the Accept header: the
+ * one with the highest weight, the most specific range breaking ties,
+ * then encoding_preference. Encodings of weight 0 (q=0) are refused;
+ * JPEG is the fallback when nothing is acceptable.
+ ********************************************************************** */
+static int negotiate_encoding(const struct http_message *msg)
+{
+    const struct http_string* accept = http_get_header(msg, "Accept");
+    if (accept == NULL) return ENC_JPEG;
+
+    int weight[NB_ENCODINGS] = { 0 };
+    int specificity[NB_ENCODINGS] = { 0 };
+    const char* range = accept->val;
+    const char* const end = accept->val + accept->len;
+    while (range < end) {
+        const char* range_end = memchr(range, ',', (size_t) (end - range));
+        if (range_end == NULL) range_end = end;
+        apply_media_range(range, range_end, weight, specificity);
+        range = range_end < end ? range_end + 1 : end;
+    }
+
+    int best = ENC_JPEG;
+    int best_weight = 0;
+    int best_specificity = 0;
+    for (int i = 0; i < NB_ENCODINGS; ++i) {
+        const int e = encoding_preference[i];
+        if (weight[e] > best_weight || (weight[e] == best_weight && weight[e] > 0 && specificity[e] > best_specificity)) {
+            best = e;
+            best_weight = weight[e];
+            best_specificity = specificity[e];
+        }
+    }
+    return best;
+}
+
+/**********************************************************************
+ * Get a width or height (1 to MAX_VARIANT_RES) from the URI.
+ ********************************************************************** */
+static int get_dimension_var(const struct http_message *msg, const char* name, uint16_t* value)
+{
+    char value_str[6];
+    int result = http_get_var(&msg->uri, name, value_str, sizeof(value_str));
+    if (result == ERR_RUNTIME) return ERR_RESOLUTIONS; // too long
+    else if (result <= 0) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    *value = atouint16(value_str);
+    if (*value == 0 || *value > MAX_VARIANT_RES) return ERR_RESOLUTIONS;
+    return ERR_NONE;
+}
+
+/**********************************************************************
+ * Read buffer of the calling thread, freed when the thread ends.
+ ********************************************************************** */
+static void free_read_buffer(void* arg)
+{
+    read_buffer_free(arg);
+}
+
+static void create_read_buffer_key(void)
+{
+    (void) pthread_key_create(&read_buffer_key, free_read_buffer);
+}
+
+static struct read_buffer* thread_read_buffer(void)
+{
+    if (read_buffer.data == NULL) {
+        pthread_once(&read_buffer_once, create_read_buffer_key);
+        (void) pthread_setspecific(read_buffer_key, &read_buffer);
+    }
+    return &read_buffer;
+}
+
 /**********************************************************************
  * Handle the read command.
  ********************************************************************** */
@@ -192,12 +558,21 @@ static int handle_read_call(int connection, struct http_message *msg)
 {
     char resolution_str[10]; // Buffer to store the resolution string
     char image_id[MAX_IMG_ID]; // Buffer to store the image ID
+    int resolution = -1;
+    uint16_t width = 0, height = 0;
 
-    // Get the resolution from the URI
+    // Get the resolution from the URI: either a preset (res=) or a box (w= and h=)
     int result = http_get_var(&msg->uri, "res", resolution_str, sizeof(resolution_str));
     if(result == ERR_RUNTIME)return reply_error_msg(connection, ERR_RESOLUTIONS); // Reply with error if resolution is too long;
-    else if (result <= 0) {
-        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS); // Reply with error if resolution is missing
+    else if (result > 0) {
+        resolution = resolution_atoi(resolution_str); // Convert resolution string to integer
+        if (resolution < 0) {
+            return reply_error_msg(connection, ERR_RESOLUTIONS); // Reply with error if resolution is invalid
+        }
+    } else {
+        result = get_dimension_var(msg, "w", &width);
+        if (result == ERR_NONE) result = get_dimension_var(msg, "h", &height);
+        if (result != ERR_NONE) return reply_error_msg(connection, result);
     }
 
     // Get the image ID from the URI
@@ -206,36 +581,55 @@ static int handle_read_call(int connection, struct http_message *msg)
     else if (result <= 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS); // Reply with error if image ID is missing
     }
-
-    int resolution = resolution_atoi(resolution_str); // Convert resolution string to integer
-    if (resolution < 0) {
-        return reply_error_msg(connection, ERR_RESOLUTIONS); // Reply with error if resolution is invalid
+    if (resolution >= 0) {
+        slowlog_image(image_id, resolution_str);
+    } else {
+        char box[16];
+        snprintf(box, sizeof(box), "%ux%u", (unsigned) width, (unsigned) height);
+        slowlog_image(image_id, box);
     }
 
-    pthread_mutex_lock(&imgfs_mutex); // Acquire mutex lock for thread safety
-    char *image_data = NULL;
+    // Originals are served as stored; derived images in the best encoding the client accepts
+    int encoding = resolution == ORIG_RES ? ENC_JPEG : negotiate_encoding(msg);
+
+    struct read_buffer* buffer = thread_read_buffer();
+    imgfs_lock_acquire(&imgfs_mutex, LOCK_SITE_READ); // Acquire mutex lock for thread safety
     uint32_t image_size = 0;
-    // Read the image data with the specified resolution
-    result = do_read(image_id, resolution, &image_data, &image_size, &fs_file);
-    pthread_mutex_unlock(&imgfs_mutex); // Release mutex lock
+    if (resolution >= 0) {
+        // Read the image data with the specified resolution
+        result = do_read_encoded(image_id, resolution, encoding, buffer, &image_size, &fs_file);
+        if (result != ERR_NONE && result != ERR_IMAGE_NOT_FOUND && encoding != ENC_JPEG) {
+            // e.g. libvips built without this encoder: JPEG is always there
+            encoding = ENC_JPEG;
+            result = do_read_into(image_id, resolution, buffer, &image_size, &fs_file);
+        }
+    } else {
+        // Read the image data fitted in the requested box
+        result = do_read_sized(image_id, width, height, &encoding, buffer, &image_size, &fs_file);
+        if (result != ERR_NONE && result != ERR_IMAGE_NOT_FOUND && encoding != ENC_JPEG) {
+            encoding = ENC_JPEG;
+            result = do_read_sized(image_id, width, height, &encoding, buffer, &image_size, &fs_file);
+        }
+    }
+    imgfs_lock_release(&imgfs_mutex); // Release mutex lock
 
     if (result != ERR_NONE) {
-        if(image_data != NULL)free(image_data);
         return reply_error_msg(connection, result); // Reply with error if reading fails
     }
 
-    // Create HTTP headers for the response
+    // Create HTTP headers for the response (whatever encoding a derived image got, another
+    // Accept may get another one, so caches must key it on Accept)
     char headers[MAX_HEADER_SIZE];
     if (snprintf(headers, sizeof(headers),
-                 "Content-Type: image/jpeg" HTTP_LINE_DELIM) < 0) {
-        free(image_data); // Free image data if header creation fails
+                 "Content-Type: %s" HTTP_LINE_DELIM "%s", encoding_mime[encoding],
+                 resolution == ORIG_RES ? "" : "Vary: Accept" HTTP_LINE_DELIM) < 0) {
         return reply_error_msg(connection, ERR_RUNTIME); // Reply with runtime error message
     }
 
     // Send HTTP response with image data
-    result = http_reply(connection, HTTP_OK, headers, image_data, image_size);
+    result = reply(connection, HTTP_OK, headers, buffer->data, image_size);
 
-    free(image_data); // Free the allocated memory for image data
+    if (buffer->capacity > READ_BUFFER_KEEP) read_buffer_free(buffer);
 
     return result;
 }
@@ -252,10 +646,11 @@ static int handle_delete_call(int connection, struct http_message *msg)
     else if (result <= 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS); // Reply with error if image ID is missing
     }
+    slowlog_image(image_id, NULL);
 
-    pthread_mutex_lock(&imgfs_mutex); // Acquire mutex lock for thread safety
+    imgfs_lock_acquire(&imgfs_mutex, LOCK_SITE_DELETE); // Acquire mutex lock for thread safety
     result = do_delete(image_id, &fs_file); // Delete the image
-    pthread_mutex_unlock(&imgfs_mutex); // Release mutex lock
+    imgfs_lock_release(&imgfs_mutex); // Release mutex lock
 
     if (result != ERR_NONE) {
         return reply_error_msg(connection, result); // Reply with error if deletion fails
@@ -276,6 +671,7 @@ static int handle_insert_call(int connection, struct http_message *msg)
     else if (result <= 0) {
         return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS); // Reply with error if name is missing
     }
+    slowlog_image(image_name, NULL);
 
     // Allocate memory for the data to be inserted
     char *image_data = malloc(msg->body.len);
@@ -284,10 +680,10 @@ static int handle_insert_call(int connection, struct http_message *msg)
     }
     memcpy(image_data, msg->body.val, msg->body.len); // Copy the data from the message body
 
-    pthread_mutex_lock(&imgfs_mutex); // Acquire mutex lock for thread safety
+    imgfs_lock_acquire(&imgfs_mutex, LOCK_SITE_INSERT); // Acquire mutex lock for thread safety
     // Insert the data with the specified name
     result = do_insert(image_data, msg->body.len, image_name, &fs_file);
-    pthread_mutex_unlock(&imgfs_mutex); // Release mutex lock
+    imgfs_lock_release(&imgfs_mutex); // Release mutex lock
 
     free(image_data); // Free the allocated memory for data
 
@@ -35,4 +35,14 @@ static int handle_delete_call(int connection, struct http_message *msg) ;
 /**********************************************************************
  * Handle the insert command.
  ********************************************************************** */
-static int handle_insert_call(int connection, struct http_message *msg) ;
\ No newline at end of file
+static int handle_insert_call(int connection, struct http_message *msg) ;
+
+/**********************************************************************
+ * Handle the metrics command.
+ ********************************************************************** */
+static int handle_metrics_call(int connection) ;
+
+/**********************************************************************
+ * Handle the trace command.
+ ********************************************************************** */
+static int handle_trace_call(int connection) ;
@@ -0,0 +1,216 @@
+/**
+ * @file imgfs_slowlog.c
+ * @brief Log of the requests slower than a threshold.
+ */
+
+#include "imgfs_slowlog.h"
+#include "imgfs.h"   // for MAX_IMG_ID
+#include "error.h"
+#include "util.h"    // for _unused
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+struct slow_request {
+    time_t started;        // wall clock, for the log
+    double start;          // monotonic
+    double total;          // s
+    const char* route;
+    char img_id[MAX_IMG_ID + 1];
+    char resolution[16];
+    char status[4];
+    uint64_t lock_wait_ns;
+    uint64_t disk_read;
+    uint64_t disk_written;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    unsigned resizes;
+    double resize_seconds;
+};
+
+static struct {
+    double threshold;      // s, 0 if off
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    struct slow_request queue[SLOWLOG_QUEUE_SIZE];
+    size_t head;           // next to write
+    size_t count;
+    unsigned long dropped;
+    int stopping;
+} slowlog;
+
+static __thread struct slow_request current;
+static __thread int active = 0;
+
+/********************************************************************/
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*******************************************************************
+ * One line per record
+ */
+static void print_record(const struct slow_request* r)
+{
+    char when[32];
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", localtime_r(&r->started, &tm));
+    fprintf(stderr, "slow %s route=%s img_id=%s res=%s status=%s total_ms=%.3f lock_wait_ms=%.3f"
+            " resize=%u resize_ms=%.3f disk_read=%llu disk_written=%llu body_in=%llu body_out=%llu\n",
+            when, r->route, r->img_id[0] != '\0' ? r->img_id : "-", r->resolution[0] != '\0' ? r->resolution : "-",
+            r->status[0] != '\0' ? r->status : "-", r->total * 1e3, (double) r->lock_wait_ns / 1e6,
+            r->resizes, r->resize_seconds * 1e3, (unsigned long long) r->disk_read,
+            (unsigned long long) r->disk_written, (unsigned long long) r->bytes_in,
+            (unsigned long long) r->bytes_out);
+}
+
+static void* slowlog_writer(void* arg _unused)
+{
+    // Signals are handled by the main thread only
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&slowlog.lock);
+    while (1) {
+        while (slowlog.count == 0 && slowlog.dropped == 0 && !slowlog.stopping) {
+            pthread_cond_wait(&slowlog.queued, &slowlog.lock);
+        }
+        if (slowlog.count == 0 && slowlog.dropped == 0) break; // stopping and nothing left
+
+        const unsigned long dropped = slowlog.dropped;
+        slowlog.dropped = 0;
+        struct slow_request record;
+        const int has_record = slowlog.count > 0;
+        if (has_record) {
+            record = slowlog.queue[slowlog.head];
+            slowlog.head = (slowlog.head + 1) % SLOWLOG_QUEUE_SIZE;
+            slowlog.count--;
+        }
+        pthread_mutex_unlock(&slowlog.lock);
+
+        if (dropped > 0) fprintf(stderr, "slow: %lu record(s) dropped, the log could not keep up\n", dropped);
+        if (has_record) print_record(&record);
+
+        pthread_mutex_lock(&slowlog.lock);
+    }
+    pthread_mutex_unlock(&slowlog.lock);
+    return NULL;
+}
+
+/********************************************************************/
+int slowlog_start(double threshold_ms)
+{
+    if (threshold_ms <= 0) return ERR_NONE;
+    if (pthread_mutex_init(&slowlog.lock, NULL) != 0) return ERR_THREADING;
+    if (pthread_cond_init(&slowlog.queued, NULL) != 0) {
+        pthread_mutex_destroy(&slowlog.lock);
+        return ERR_THREADING;
+    }
+    slowlog.head = slowlog.count = 0;
+    slowlog.dropped = 0;
+    slowlog.stopping = 0;
+    if (pthread_create(&slowlog.writer, NULL, slowlog_writer, NULL) != 0) {
+        pthread_cond_destroy(&slowlog.queued);
+        pthread_mutex_destroy(&slowlog.lock);
+        return ERR_THREADING;
+    }
+    slowlog.threshold = threshold_ms / 1e3;
+    return ERR_NONE;
+}
+
+void slowlog_stop(void)
+{
+    if (slowlog.threshold <= 0) return;
+    pthread_mutex_lock(&slowlog.lock);
+    slowlog.stopping = 1;
+    pthread_cond_signal(&slowlog.queued);
+    pthread_mutex_unlock(&slowlog.lock);
+    pthread_join(slowlog.writer, NULL);
+    slowlog.threshold = 0;
+    pthread_cond_destroy(&slowlog.queued);
+    pthread_mutex_destroy(&slowlog.lock);
+}
+
+/*******************************************************************
+ * Gathering
+ */
+void slowlog_begin(const char* route, size_t bytes_in)
+{
+    if (slowlog.threshold <= 0) return;
+    memset(&current, 0, sizeof(current));
+    current.started = time(NULL);
+    current.start = now_seconds();
+    current.route = route != NULL ? route : "-";
+    current.bytes_in = bytes_in;
+    active = 1;
+}
+
+void slowlog_image(const char* img_id, const char* resolution)
+{
+    if (!active) return;
+    if (img_id != NULL) {
+        strncpy(current.img_id, img_id, sizeof(current.img_id) - 1);
+    }
+    if (resolution != NULL) {
+        strncpy(current.resolution, resolution, sizeof(current.resolution) - 1);
+    }
+}
+
+void slowlog_lock_wait(uint64_t ns)
+{
+    if (active) current.lock_wait_ns += ns;
+}
+
+void slowlog_disk_read(size_t bytes)
+{
+    if (active) current.disk_read += bytes;
+}
+
+void slowlog_disk_write(size_t bytes)
+{
+    if (active) current.disk_written += bytes;
+}
+
+void slowlog_resize(double seconds)
+{
+    if (!active) return;
+    current.resizes++;
+    current.resize_seconds += seconds;
+}
+
+void slowlog_reply(const char* status, size_t bytes_out)
+{
+    if (!active) return;
+    if (status != NULL) {
+        strncpy(current.status, status, sizeof(current.status) - 1);
+    }
+    current.bytes_out += bytes_out;
+}
+
+void slowlog_end(void)
+{
+    if (!active) return;
+    active = 0;
+    current.total = now_seconds() - current.start;
+    if (slowlog.threshold <= 0 || current.total < slowlog.threshold) return;
+
+    pthread_mutex_lock(&slowlog.lock);
+    if (slowlog.count < SLOWLOG_QUEUE_SIZE) {
+        slowlog.queue[(slowlog.head + slowlog.count) % SLOWLOG_QUEUE_SIZE] = current;
+        slowlog.count++;
+    } else {
+        slowlog.dropped++;
+    }
+    pthread_cond_signal(&slowlog.queued);
+    pthread_mutex_unlock(&slowlog.lock);
+}
@@ -0,0 +1,88 @@
+/**
+ * @file imgfs_slowlog.h
+ * @brief Log of the requests slower than a threshold.
+ *
+ * While a request is served, its thread gathers its context: route,
+ * image ID and resolution, time waited for the locks, bytes read and
+ * written on disk and received and sent, whether a resize ran and for
+ * how long, reply status. When the request ends after the threshold or
+ * later, the record is queued for a writer thread, which prints it as one
+ * line on stderr; the request thread never waits for the write, and when
+ * the queue is full the record is dropped (and counted).
+ *
+ * With no threshold (the default), all the functions return at once.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SLOWLOG_QUEUE_SIZE 256
+
+/**
+ * @brief Starts logging the requests slower than a threshold.
+ *
+ * @param threshold_ms The threshold, in milliseconds; 0 keeps the log off.
+ * @return Some error code. 0 if no error.
+ */
+int slowlog_start(double threshold_ms);
+
+/**
+ * @brief Writes the queued records and stops the writer.
+ */
+void slowlog_stop(void);
+
+/**
+ * @brief Starts gathering the context of a request on the calling thread.
+ *
+ * @param route Static name of its route
+ * @param bytes_in Size of its body
+ */
+void slowlog_begin(const char* route, size_t bytes_in);
+
+/**
+ * @brief Records the image a request is about.
+ *
+ * @param img_id Its ID (copied)
+ * @param resolution Its resolution, e.g. "thumb" or "320x200" (copied; may be NULL)
+ */
+void slowlog_image(const char* img_id, const char* resolution);
+
+/**
+ * @brief Adds to the time the current request waited for a lock.
+ */
+void slowlog_lock_wait(uint64_t ns);
+
+/**
+ * @brief Adds to the bytes the current request read from disk.
+ */
+void slowlog_disk_read(size_t bytes);
+
+/**
+ * @brief Adds to the bytes the current request wrote to disk.
+ */
+void slowlog_disk_write(size_t bytes);
+
+/**
+ * @brief Records a resize run for the current request.
+ */
+void slowlog_resize(double seconds);
+
+/**
+ * @brief Records the reply to the current request.
+ */
+void slowlog_reply(const char* status, size_t bytes_out);
+
+/**
+ * @brief Ends the current request, queuing its record if it was slow.
+ */
+void slowlog_end(void);
+
+#ifdef __cplusplus
+}
+#endif
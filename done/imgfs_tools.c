@@ -6,6 +6,10 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_commit.h"
+#include "imgfs_direct.h"
+#include "imgfs_ext.h"
+#include "imgfs_journal.h"
 #include "util.h"
 
 #include <inttypes.h>      // for PRIxN macros
@@ -118,6 +122,13 @@ int do_open(const char *imgfs_filename,
         return ERR_IO;
     }
 
+    if (imgfs_file->header.revision != IMGFS_REVISION_ORIGINAL
+        && (imgfs_file->header.revision != IMGFS_REVISION_PAGED
+            || fseek(imgfs_file->file, (long) metadata_offset(&imgfs_file->header), SEEK_SET) != 0)) {
+        fclose(imgfs_file->file);
+        return ERR_IO;
+    }
+
     //Put metadata in our structure
     struct img_metadata *metadata = calloc(imgfs_file->header.max_files, sizeof(struct img_metadata));
 
@@ -136,6 +147,25 @@ int do_open(const char *imgfs_filename,
     }
 
     imgfs_file->metadata = metadata;
+
+    //Extension block in memory, replay what a crash left in the journal, then set up the commit mode
+    //chosen with commit_configure()
+    const int writable = strchr(open_mode, '+') != NULL || open_mode[0] == 'w' || open_mode[0] == 'a';
+    int err = ext_attach(imgfs_file);
+    if (err == ERR_NONE) err = journal_replay(imgfs_filename, imgfs_file, writable);
+    if (err == ERR_NONE) err = commit_attach(imgfs_filename, imgfs_file, writable);
+    if (err == ERR_NONE) {
+        //Second descriptor for the large blobs, if direct_io_configure() enabled it
+        err = direct_attach(imgfs_filename, imgfs_file, writable);
+        if (err != ERR_NONE) commit_detach(imgfs_file);
+    }
+    if (err != ERR_NONE) {
+        ext_detach(imgfs_file);
+        free(imgfs_file->metadata);
+        imgfs_file->metadata = NULL;
+        fclose(imgfs_file->file);
+        return err;
+    }
     return ERR_NONE;
 }
 
@@ -147,6 +177,12 @@ void do_close(struct imgfs_file *imgfs_file)
     if (imgfs_file == NULL) {
         return;
     }
+    //Write what the commit mode left pending
+    if (imgfs_file->file != NULL && imgfs_file->metadata != NULL) {
+        commit_detach(imgfs_file);
+    }
+    direct_detach(imgfs_file);
+    ext_detach(imgfs_file);
     free(imgfs_file->metadata);
     imgfs_file->metadata = NULL;
     if (imgfs_file->file != NULL) {
@@ -155,6 +191,21 @@ void do_close(struct imgfs_file *imgfs_file)
 
 
 }
+/*******************************************************************
+ * Layout of the revisions
+ */
+uint64_t metadata_offset(const struct imgfs_header *header)
+{
+    return header->revision == IMGFS_REVISION_PAGED ? IMGFS_PAGE_SIZE : sizeof(struct imgfs_header);
+}
+
+uint64_t data_offset(const struct imgfs_header *header)
+{
+    const uint64_t end = metadata_offset(header) + (uint64_t) header->max_files * sizeof(struct img_metadata);
+    if (header->revision != IMGFS_REVISION_PAGED) return end;
+    return (end + IMGFS_PAGE_SIZE - 1) / IMGFS_PAGE_SIZE * IMGFS_PAGE_SIZE;
+}
+
 /*******************************************************************
  * identify resolution
  */
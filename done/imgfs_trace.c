@@ -0,0 +1,190 @@
+/**
+ * @file imgfs_trace.c
+ * @brief Spans of the phases of the requests, in the Chrome trace format.
+ */
+
+#define _GNU_SOURCE // open_memstream()
+
+#include "imgfs_trace.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct trace_event {
+    const char* name;
+    uint64_t start;    // ns
+    uint64_t duration; // ns
+};
+
+struct trace_ring {
+    struct trace_ring* next;      // In the list of all rings
+    struct trace_ring* next_free; // In the list of the rings no thread uses
+    unsigned id;                  // Shown as the thread id
+    uint64_t head;                // Number of spans ever recorded
+    struct trace_event* events;
+};
+
+static size_t ring_size = 0;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring* all_rings = NULL;
+static struct trace_ring* free_rings = NULL;
+static unsigned nb_rings = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct trace_ring* thread_ring = NULL;
+
+/********************************************************************/
+void trace_configure(size_t size)
+{
+    ring_size = size;
+}
+
+uint64_t trace_now(void)
+{
+    if (ring_size == 0) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/*******************************************************************
+ * Ring of the calling thread, NULL if none could be allocated
+ */
+static void release_ring(void* arg)
+{
+    struct trace_ring* ring = arg;
+    pthread_mutex_lock(&rings_lock);
+    ring->next_free = free_rings;
+    free_rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void create_ring_key(void)
+{
+    (void) pthread_key_create(&ring_key, release_ring);
+}
+
+static struct trace_ring* get_ring(void)
+{
+    if (thread_ring != NULL) return thread_ring;
+    pthread_once(&ring_key_once, create_ring_key);
+
+    pthread_mutex_lock(&rings_lock);
+    struct trace_ring* ring = free_rings;
+    if (ring != NULL) {
+        free_rings = ring->next_free; // its spans are kept
+    } else {
+        ring = calloc(1, sizeof(struct trace_ring));
+        if (ring != NULL) {
+            ring->events = calloc(ring_size, sizeof(struct trace_event));
+            if (ring->events == NULL) {
+                free(ring);
+                ring = NULL;
+            }
+        }
+        if (ring != NULL) {
+            ring->id = ++nb_rings;
+            ring->next = all_rings;
+            all_rings = ring;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (ring != NULL) {
+        (void) pthread_setspecific(ring_key, ring);
+        thread_ring = ring;
+    }
+    return ring;
+}
+
+/*******************************************************************
+ * Only the owner of a ring writes it, but the spans may be read meanwhile:
+ * the span is written before head is moved past it
+ */
+void trace_span(const char* name, uint64_t start)
+{
+    if (start == 0 || name == NULL) return;
+    const uint64_t end = trace_now();
+    struct trace_ring* ring = get_ring();
+    if (ring == NULL) return;
+
+    const uint64_t head = ring->head;
+    struct trace_event* event = &ring->events[head % ring_size];
+    __atomic_store_n(&event->name, name, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->start, start, __ATOMIC_RELAXED);
+    __atomic_store_n(&event->duration, end - start, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************
+ * Copies the spans of a ring that are not overwritten meanwhile;
+ * returns their number
+ */
+static size_t copy_ring(const struct trace_ring* ring, struct trace_event* copy)
+{
+    const uint64_t before = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    const uint64_t first = before > ring_size ? before - ring_size : 0;
+    for (uint64_t i = first; i < before; ++i) {
+        const struct trace_event* event = &ring->events[i % ring_size];
+        copy[i - first].name = __atomic_load_n(&event->name, __ATOMIC_RELAXED);
+        copy[i - first].start = __atomic_load_n(&event->start, __ATOMIC_RELAXED);
+        copy[i - first].duration = __atomic_load_n(&event->duration, __ATOMIC_RELAXED);
+    }
+    // The spans recorded during the copy (and the one being recorded)
+    // took the slots of the oldest ones
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    const uint64_t after = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    const uint64_t valid = after + 1 > ring_size ? after + 1 - ring_size : 0;
+    if (valid >= before) return 0;
+    const uint64_t skip = valid > first ? valid - first : 0;
+    for (uint64_t i = skip; i < before - first; ++i) copy[i - skip] = copy[i];
+    return (size_t) (before - first - skip);
+}
+
+/********************************************************************/
+int trace_format(char** text, size_t* size)
+{
+    M_REQUIRE_NON_NULL(text);
+    M_REQUIRE_NON_NULL(size);
+
+    *text = NULL;
+    *size = 0;
+    FILE* out = open_memstream(text, size);
+    if (out == NULL) return ERR_OUT_OF_MEMORY;
+
+    struct trace_event* copy = ring_size > 0 ? calloc(ring_size, sizeof(struct trace_event)) : NULL;
+    if (ring_size > 0 && copy == NULL) {
+        fclose(out);
+        free(*text);
+        *text = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    fprintf(out, "{\"traceEvents\":[");
+    const char* sep = "\n";
+    pthread_mutex_lock(&rings_lock);
+    for (const struct trace_ring* ring = all_rings; ring != NULL; ring = ring->next) {
+        const size_t nb = copy_ring(ring, copy);
+        for (size_t i = 0; i < nb; ++i) {
+            fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u}",
+                    sep, copy[i].name, (double) copy[i].start / 1e3, (double) copy[i].duration / 1e3, ring->id);
+            sep = ",\n";
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    free(copy);
+
+    const int failed = ferror(out);
+    if (fclose(out) != 0 || failed) {
+        free(*text);
+        *text = NULL;
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file imgfs_trace.h
+ * @brief Spans of the phases of the requests, in the Chrome trace format.
+ *
+ * When enabled, each thread keeps its last spans (a name, a start and a
+ * duration on the monotonic clock) in a ring of its own, so that
+ * recording a span takes no lock. A ring outlives its thread and is
+ * handed to the next thread that needs one. trace_format() dumps all the
+ * rings as Chrome trace-event JSON, to be loaded in chrome://tracing or
+ * https://ui.perfetto.dev: nested spans of a thread show as a stack.
+ *
+ * When disabled (the default), trace_now() returns 0 and trace_span()
+ * does nothing.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Enables the tracing.
+ *
+ * @param ring_size Number of spans kept per thread; 0 disables the tracing.
+ */
+void trace_configure(size_t ring_size);
+
+/**
+ * @brief Start of a span.
+ *
+ * @return The monotonic time in nanoseconds, 0 if the tracing is disabled.
+ */
+uint64_t trace_now(void);
+
+/**
+ * @brief Records a span of the calling thread, from start to now.
+ *
+ * @param name Static name of the span, e.g. "parse"
+ * @param start Its start, as returned by trace_now()
+ */
+void trace_span(const char* name, uint64_t start);
+
+/**
+ * @brief Formats the spans of all the threads as Chrome trace-event JSON.
+ *
+ * @param text Location of the newly allocated text (to be freed)
+ * @param size Location of its size
+ * @return Some error code. 0 if no error.
+ */
+int trace_format(char** text, size_t* size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -15,7 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define SIZE_COMMANDS 6
+#define SIZE_COMMANDS 9
 
 typedef int (*command)(int, char **);
 
@@ -30,7 +30,10 @@ struct command_mapping commands[] = {
     {"help",   help},
     {"delete", do_delete_cmd},
     {"insert",do_insert_cmd},
-    {"read",do_read_cmd}
+    {"read",do_read_cmd},
+    {"import", do_import_cmd},
+    {"export", do_export_cmd},
+    {"fsck", do_fsck_cmd}
 };
 
 
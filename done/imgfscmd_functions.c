@@ -7,6 +7,11 @@
 
 #include "imgfs.h"
 #include "imgfscmd_functions.h"
+#include "imgfs_alloc.h"
+#include "imgfs_direct.h"
+#include "imgfs_export.h"
+#include "imgfs_fsck.h"
+#include "imgfs_import.h"
 #include "util.h"   // for _unused
 
 #include <stdlib.h>
@@ -91,6 +96,9 @@ int do_create_cmd(int argc, char **argv)
     char *filename = argv[0];
     struct imgfs_file imgfs_file;
     int counter = 0;
+    uint16_t prealloc_mib = 0; // 0: data appended at the end of the file
+    uint16_t arena_kib = 0;    // 0: derived images appended like the originals
+    uint32_t revision = IMGFS_REVISION_ORIGINAL;
     char **argv_copy = argv;
     argv_copy++;
     argc--;
@@ -144,6 +152,27 @@ int do_create_cmd(int argc, char **argv)
                         if (error != ERR_NONE)return error;
                     }
                     counter += 3;
+                } else if (strcmp(argv_copy[counter], "-prealloc") == 0) {
+                    if (counter + 1 == argc) {
+                        return ERR_NOT_ENOUGH_ARGUMENTS;
+                    }
+                    prealloc_mib = atouint16(argv_copy[counter + 1]);
+                    if (prealloc_mib == 0) {
+                        return ERR_INVALID_ARGUMENT;
+                    }
+                    counter += 2;
+                } else if (strcmp(argv_copy[counter], "-arena") == 0) {
+                    if (counter + 1 == argc) {
+                        return ERR_NOT_ENOUGH_ARGUMENTS;
+                    }
+                    arena_kib = atouint16(argv_copy[counter + 1]);
+                    if (arena_kib == 0) {
+                        return ERR_INVALID_ARGUMENT;
+                    }
+                    counter += 2;
+                } else if (strcmp(argv_copy[counter], "-paged") == 0) {
+                    revision = IMGFS_REVISION_PAGED;
+                    counter += 1;
                 } else {
                     return ERR_INVALID_ARGUMENT;
                 }
@@ -151,7 +180,13 @@ int do_create_cmd(int argc, char **argv)
         }
     }
     //Create the imgFS
-    int err_create = do_create(filename, &imgfs_file);
+    int err_create = do_create_revision(filename, &imgfs_file, revision);
+    if (err_create == ERR_NONE && prealloc_mib != 0) {
+        err_create = enable_prealloc(&imgfs_file, (uint64_t) prealloc_mib << 20);
+    }
+    if (err_create == ERR_NONE && arena_kib != 0) {
+        err_create = enable_arena(&imgfs_file, (uint64_t) arena_kib << 10);
+    }
     fclose(imgfs_file.file);
     free(imgfs_file.metadata);
     imgfs_file.metadata = NULL;
@@ -258,6 +293,160 @@ int do_insert_cmd(int argc, char **argv)
     return error;
 }
 
+/**********************************************************************
+ * Progress and failures of an import, on stderr.
+ */
+static void print_import_progress(const struct import_stats* stats, void* arg _unused)
+{
+    const double seconds = stats->seconds > 0 ? stats->seconds : 1e-9;
+    fprintf(stderr, "\r%zu images imported, %zu failed, %.1f images/s, %.1f MB/s",
+            stats->nb_inserted, stats->nb_failed,
+            (double) stats->nb_inserted / seconds, (double) stats->nb_bytes / 1e6 / seconds);
+}
+
+static void print_import_failure(const char* name, int error, void* arg _unused)
+{
+    fprintf(stderr, "\r%s: %s\n", name, ERR_MSG(error));
+}
+
+/**********************************************************************
+ * Imports the files of a directory, or of a tar stream on stdin ("-").
+ */
+int do_import_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    struct import_options options = { 0, print_import_progress, print_import_failure, NULL };
+    for (int i = 2; i < argc; i += 2) {
+        if (i + 1 >= argc) return ERR_NOT_ENOUGH_ARGUMENTS;
+        if (strcmp(argv[i], "-threads") == 0) {
+            options.nb_threads = atouint16(argv[i + 1]);
+            if (options.nb_threads == 0) return ERR_INVALID_ARGUMENT;
+        } else if (strcmp(argv[i], "-direct") == 0) {
+            // Originals of at least that many KiB bypass the page cache
+            const uint32_t kib = atouint32(argv[i + 1]);
+            if (kib == 0) return ERR_INVALID_ARGUMENT;
+            direct_io_configure((size_t) kib << 10);
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], "r+b", &myfile);
+    if (error != ERR_NONE) return error;
+
+    struct import_stats stats;
+    zero_init_var(stats);
+    if (strcmp(argv[1], "-") == 0) {
+        error = do_import_tar(stdin, &myfile, &options, &stats);
+    } else {
+        error = do_import_dir(argv[1], &myfile, &options, &stats);
+    }
+    do_close(&myfile);
+
+    if (stats.nb_read > 0) fputc('\n', stderr);
+    printf("%zu images imported, %zu failed, %.3f s\n", stats.nb_inserted, stats.nb_failed, stats.seconds);
+    return error;
+}
+
+/**********************************************************************
+ * Exports the imgFS as a tar ("-" for stdout, or a name ending in .tar)
+ * or as a compacted imgFS (any other name).
+ */
+int do_export_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc != 2 && argc != 3) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc == 3 && strcmp(argv[2], "-derived") != 0) return ERR_INVALID_ARGUMENT;
+    const int with_derived = argc == 3;
+
+    const char* output = argv[1];
+    const size_t length = strlen(output);
+    const int to_stdout = strcmp(output, "-") == 0;
+    const int to_tar = to_stdout || (length > 4 && strcmp(output + length - 4, ".tar") == 0);
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], "rb", &myfile);
+    if (error != ERR_NONE) return error;
+
+    struct export_stats stats;
+    zero_init_var(stats);
+    if (to_tar) {
+        FILE* tar = to_stdout ? stdout : fopen(output, "wb");
+        if (tar == NULL) {
+            error = ERR_IO;
+        } else {
+            error = do_export_tar(&myfile, tar, with_derived, &stats);
+            if (!to_stdout && fclose(tar) != 0 && error == ERR_NONE) error = ERR_IO;
+        }
+    } else {
+        error = do_export_imgfs(&myfile, output, with_derived, &stats);
+    }
+    do_close(&myfile);
+
+    if (error == ERR_NONE) {
+        const double seconds = stats.seconds > 0 ? stats.seconds : 1e-9;
+        fprintf(stderr, "%zu images exported, %.1f MB read, %.3f s, %.1f MB/s\n", stats.nb_images,
+                (double) stats.nb_bytes / 1e6, stats.seconds, (double) stats.nb_bytes / 1e6 / seconds);
+    }
+    return error;
+}
+
+/**********************************************************************
+ * Problems found by fsck, on stdout.
+ */
+static void print_fsck_problem(uint32_t index, const char* img_id, const char* problem, void* arg _unused)
+{
+    if (index == UINT32_MAX) {
+        printf("header: %s\n", problem);
+    } else {
+        printf("slot %" PRIu32 " (%s): %s\n", index, img_id, problem);
+    }
+}
+
+/**********************************************************************
+ * Checks the imgFS; -repair fixes the image count in the header.
+ */
+int do_fsck_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < 1) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    int repair = 0;
+    size_t nb_threads = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-repair") == 0) {
+            repair = 1;
+        } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            nb_threads = atouint16(argv[++i]);
+            if (nb_threads == 0) return ERR_INVALID_ARGUMENT;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], repair ? "r+b" : "rb", &myfile);
+    if (error != ERR_NONE) return error;
+
+    struct fsck_report report;
+    error = do_fsck(&myfile, nb_threads, repair, print_fsck_problem, NULL, &report);
+    do_close(&myfile);
+    if (error != ERR_NONE) return error;
+
+    const size_t nb_problems = report.nb_bad_count + report.nb_duplicate_id + report.nb_bad_extent + report.nb_bad_sha;
+    const double seconds = report.seconds > 0 ? report.seconds : 1e-9;
+    printf("%" PRIu32 " images checked, %zu problem(s)%s; %.1f MB hashed in %.3f s, %.1f MB/s\n",
+           report.nb_valid, nb_problems, report.repaired ? ", image count repaired" : "",
+           (double) report.nb_bytes / 1e6, report.seconds, (double) report.nb_bytes / 1e6 / seconds);
+    return ERR_NONE;
+}
+
 /********************************************************************
  * Verifies and puts the resolution.
  *******************************************************************/
@@ -37,6 +37,21 @@ int do_insert_cmd(int argc, char* argv[]);
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
 
+/********************************************************************
+ * Imports a directory or a tar stream into the imgFS.
+ *******************************************************************/
+int do_import_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Exports the imgFS to a tar stream or to a compacted imgFS.
+ *******************************************************************/
+int do_export_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Checks the consistency of the imgFS.
+ *******************************************************************/
+int do_fsck_cmd(int argc, char* argv[]);
+
 /********************************************************************
  * Verifies and puts the resolution.
  *******************************************************************/
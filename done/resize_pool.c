@@ -0,0 +1,231 @@
+/**
+ * @file resize_pool.c
+ * @brief Fixed-size executor for the libvips work of lazily_resize().
+ */
+
+#include "resize_pool.h"
+#include "error.h"
+#include "imgfs_trace.h"
+#include "util.h"   // for _unused
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h> // sysconf()
+
+struct resize_job {
+    resize_task task;
+    void* arg;
+    size_t mem_estimate;
+    int result;
+    int done;
+    struct resize_job* next;
+};
+
+struct resize_pool {
+    pthread_t* workers;
+    size_t nb_threads;
+    size_t max_queued;
+    size_t max_bytes;
+    struct imgfs_lock* caller_lock; // read without the lock, like running
+
+    // Initialized once and for all: a submitter may still reach them
+    // while the pool shuts down
+    pthread_mutex_t lock;
+    pthread_cond_t job_available; // signaled to workers
+    pthread_cond_t slot_available; // signaled to submitters waiting for room
+    pthread_cond_t job_done; // broadcast to submitters waiting for a result
+
+    struct resize_job* head;
+    struct resize_job* tail;
+    size_t nb_accepted; // queued + running
+    size_t bytes_accepted;
+    int running; // read without the lock (with __atomic builtins), written under it
+    int stopping;
+};
+
+static struct resize_pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .job_available = PTHREAD_COND_INITIALIZER,
+    .slot_available = PTHREAD_COND_INITIALIZER,
+    .job_done = PTHREAD_COND_INITIALIZER
+};
+
+/*******************************************************************
+ * Worker loop
+ */
+static void* resize_worker(void* arg _unused)
+{
+    // Signals are handled by the main thread only
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        while (pool.head == NULL && !pool.stopping) {
+            pthread_cond_wait(&pool.job_available, &pool.lock);
+        }
+        if (pool.head == NULL) break; // stopping and nothing left
+
+        struct resize_job* job = pool.head;
+        pool.head = job->next;
+        if (pool.head == NULL) pool.tail = NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        const uint64_t span_start = trace_now();
+        const int result = job->task(job->arg);
+        trace_span("resize job", span_start);
+
+        pthread_mutex_lock(&pool.lock);
+        job->result = result;
+        job->done = 1;
+        pool.nb_accepted--;
+        pool.bytes_accepted -= job->mem_estimate;
+        pthread_cond_broadcast(&pool.job_done);
+        pthread_cond_broadcast(&pool.slot_available);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/*******************************************************************
+ * Start the workers
+ */
+int resize_pool_init(size_t nb_threads, size_t max_queued, size_t max_bytes,
+                     struct imgfs_lock* caller_lock)
+{
+    if (__atomic_load_n(&pool.running, __ATOMIC_ACQUIRE) || pool.workers != NULL) return ERR_THREADING;
+
+    if (nb_threads == 0) {
+        const long nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nb_threads = nb_cpus > 0 ? (size_t) nb_cpus : 1;
+    }
+    pool.nb_threads = nb_threads;
+    pool.workers = calloc(nb_threads, sizeof(pthread_t));
+    if (pool.workers == NULL) return ERR_OUT_OF_MEMORY;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.max_queued = max_queued != 0 ? max_queued : RESIZE_POOL_DEFAULT_QUEUE_PER_THREAD * nb_threads;
+    pool.max_bytes = max_bytes != 0 ? max_bytes : RESIZE_POOL_DEFAULT_MAX_BYTES;
+    __atomic_store_n(&pool.caller_lock, caller_lock, __ATOMIC_RELAXED);
+    pool.head = pool.tail = NULL;
+    pool.nb_accepted = 0;
+    pool.bytes_accepted = 0;
+    pool.stopping = 0;
+    pthread_mutex_unlock(&pool.lock);
+
+    for (size_t i = 0; i < nb_threads; ++i) {
+        if (pthread_create(&pool.workers[i], NULL, resize_worker, NULL) != 0) {
+            pool.nb_threads = i;
+            resize_pool_shutdown();
+            return ERR_THREADING;
+        }
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    __atomic_store_n(&pool.running, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool.lock);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Stop the workers
+ */
+void resize_pool_shutdown(void)
+{
+    if (pool.workers == NULL) return;
+
+    // Submitters waiting for room give up; the queued jobs are still run
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.job_available);
+    pthread_cond_broadcast(&pool.slot_available);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (size_t i = 0; i < pool.nb_threads; ++i) {
+        pthread_join(pool.workers[i], NULL);
+    }
+    free(pool.workers);
+    pool.workers = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    __atomic_store_n(&pool.running, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*******************************************************************
+ * Tells whether jobs are handed to workers
+ */
+int resize_pool_is_running(void)
+{
+    return __atomic_load_n(&pool.running, __ATOMIC_ACQUIRE);
+}
+
+/*******************************************************************
+ * Take the caller lock back after a wait, if it was released: the wait
+ * goes to the resize site, the rest of the hold to the caller's
+ */
+static void relock_caller(struct imgfs_lock* released, enum lock_site site)
+{
+    if (released != NULL) imgfs_lock_retake(released, LOCK_SITE_RESIZE, site);
+}
+
+/*******************************************************************
+ * Submit a job and wait for it
+ */
+int resize_pool_run(resize_task task, void* arg, size_t mem_estimate)
+{
+    M_REQUIRE_NON_NULL(task);
+
+    if (!__atomic_load_n(&pool.running, __ATOMIC_ACQUIRE)) {
+        return task(arg);
+    }
+
+    struct resize_job job = { task, arg, mem_estimate, ERR_NONE, 0, NULL };
+
+    // Only a caller holding the lock can let it go (imgfscmd, say, does not take it)
+    struct imgfs_lock* const caller_lock = __atomic_load_n(&pool.caller_lock, __ATOMIC_RELAXED);
+    struct imgfs_lock* const released = imgfs_lock_held(caller_lock) ? caller_lock : NULL;
+    const enum lock_site site = released != NULL ? (enum lock_site) released->holder : LOCK_SITE_READ;
+    if (released != NULL) imgfs_lock_release(released);
+    pthread_mutex_lock(&pool.lock);
+
+    // Back-pressure: wait for a free slot and enough memory budget
+    while (!pool.stopping
+           && (pool.nb_accepted >= pool.max_queued
+               || (pool.nb_accepted > 0 && pool.bytes_accepted + mem_estimate > pool.max_bytes))) {
+        pthread_cond_wait(&pool.slot_available, &pool.lock);
+    }
+    if (!pool.running) {
+        // Shut down since the check above: no worker left to run the job
+        pthread_mutex_unlock(&pool.lock);
+        relock_caller(released, site);
+        return task(arg);
+    }
+    if (pool.stopping) {
+        pthread_mutex_unlock(&pool.lock);
+        relock_caller(released, site);
+        return ERR_THREADING;
+    }
+
+    pool.nb_accepted++;
+    pool.bytes_accepted += mem_estimate;
+    if (pool.tail == NULL) {
+        pool.head = &job;
+    } else {
+        pool.tail->next = &job;
+    }
+    pool.tail = &job;
+    pthread_cond_signal(&pool.job_available);
+
+    while (!job.done) {
+        pthread_cond_wait(&pool.job_done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    relock_caller(released, site);
+
+    return job.result;
+}
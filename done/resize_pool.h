@@ -0,0 +1,81 @@
+/**
+ * @file resize_pool.h
+ * @brief Fixed-size executor for the libvips work of lazily_resize().
+ *
+ * Request threads submit a job and wait for its result. The number of
+ * jobs running at once is bounded by the number of workers, and the
+ * number of jobs accepted (queued or running) is bounded both in count
+ * and in estimated memory, so that many cold thumbnails requested at the
+ * same time cannot oversubscribe the CPU or exhaust memory.
+ *
+ * When the pool is not started (e.g. in imgfscmd), jobs simply run on
+ * the calling thread.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#include "imgfs_lock.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESIZE_POOL_DEFAULT_QUEUE_PER_THREAD 2
+#define RESIZE_POOL_DEFAULT_MAX_BYTES (256UL * 1024 * 1024) // 256 MiB of decoded pixels in flight
+
+/**
+ * @brief A unit of work run by the pool. Returns some error code.
+ */
+typedef int (*resize_task)(void* arg);
+
+/**
+ * @brief Starts the resize workers.
+ *
+ * @param nb_threads Number of workers; 0 means one per online CPU.
+ * @param max_queued Max. number of accepted jobs; 0 means
+ *        RESIZE_POOL_DEFAULT_QUEUE_PER_THREAD per worker.
+ * @param max_bytes Max. sum of the memory estimates of accepted jobs;
+ *        0 means RESIZE_POOL_DEFAULT_MAX_BYTES.
+ * @param caller_lock Lock held by the callers of resize_pool_run(), released
+ *        while they wait on their job if they hold it (may be NULL).
+ * @return Some error code. 0 if no error.
+ */
+int resize_pool_init(size_t nb_threads, size_t max_queued, size_t max_bytes,
+                     struct imgfs_lock* caller_lock);
+
+/**
+ * @brief Stops the workers once the accepted jobs are done.
+ *
+ * A thread still in resize_pool_run() has its job run if it was already
+ * accepted, gets ERR_THREADING if it was waiting for room, and runs its
+ * task inline once the pool is stopped.
+ */
+void resize_pool_shutdown(void);
+
+/**
+ * @brief Runs task(arg) on a worker and waits for its result.
+ *
+ * Blocks while the queue is full or while the job would exceed the memory
+ * budget (a job bigger than the whole budget is still accepted when
+ * nothing else is in flight). The caller lock given to resize_pool_init()
+ * is released during the wait when the calling thread holds it, so the
+ * caller must re-validate any shared state it read before the call.
+ *
+ * @param task The work to run.
+ * @param arg Its argument.
+ * @param mem_estimate Estimated peak memory of the job, in bytes.
+ * @return The task's error code, or ERR_THREADING.
+ */
+int resize_pool_run(resize_task task, void* arg, size_t mem_estimate);
+
+/**
+ * @brief Tells whether resize_pool_run() hands jobs to workers (and thus
+ *        releases the caller lock) rather than running them inline.
+ */
+int resize_pool_is_running(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE // O_DIRECT
+
+#include "imgfs.h"
+#include "imgfs_alloc.h"
+#include "imgfs_commit.h"
+#include "imgfs_direct.h"
+#include "test.h"
+#include <check.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vips/vips.h>
+
+// In test02: pic1 (papillon.jpg, 72876 bytes at 21664)
+#define PIC1_OFFSET 21664
+
+// The test is linked with -Wl,--wrap=open: when set, O_DIRECT is refused
+// as on a filesystem that does not support it
+static int refuse_direct = 0;
+
+int __real_open(const char* path, int flags, ...);
+
+int __wrap_open(const char* path, int flags, ...)
+{
+    if (refuse_direct && (flags & O_DIRECT)) {
+        errno = EINVAL;
+        return -1;
+    }
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return __real_open(path, flags, mode);
+}
+
+static uint64_t file_size(const char* filename)
+{
+    struct stat st;
+    ck_assert_int_eq(stat(filename, &st), 0);
+    return (uint64_t) st.st_size;
+}
+
+// ======================================================================
+START_TEST(enable_prealloc_invalid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    ck_assert_invalid_arg(enable_prealloc(NULL, PREALLOC_MIN_CHUNK));
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_invalid_arg(enable_prealloc(&file, PREALLOC_MIN_CHUNK - 1));
+    ck_assert_uint_eq(file.header.ext_offset, 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(alloc_data_prealloc)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    const uint64_t end = file_size(dump);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // The data goes on after the extension block, in a reserved chunk
+    ck_assert_err_none(enable_prealloc(&file, PREALLOC_MIN_CHUNK));
+    ck_assert_uint_eq(file.header.ext_offset, end);
+    struct imgfs_ext ext;
+    ck_assert_err_none(read_ext(&file, &ext));
+    const uint64_t data_end = end + sizeof(struct imgfs_ext);
+    ck_assert_uint_eq(ext.data_end, data_end);
+    ck_assert_uint_eq(ext.prealloc_chunk, PREALLOC_MIN_CHUNK);
+    ck_assert_uint_eq(file_size(dump), data_end + PREALLOC_MIN_CHUNK);
+
+    // Blobs follow each other from the logical end, within the chunk
+    uint64_t offset = 0;
+    ck_assert_err_none(alloc_data(&file, 1000, &offset));
+    ck_assert_uint_eq(offset, data_end);
+    ck_assert_err_none(alloc_data(&file, 1000, &offset));
+    ck_assert_uint_eq(offset, data_end + 1000);
+    ck_assert_err_none(alloc_data_aligned(&file, 10, 4096, &offset));
+    ck_assert_uint_eq(offset % 4096, 0);
+    ck_assert_uint_ge(offset, data_end + 2000);
+    ck_assert_uint_eq(file_size(dump), data_end + PREALLOC_MIN_CHUNK);
+
+    // Past the chunk, the file grows by whole chunks
+    const uint64_t before = file_size(dump);
+    ck_assert_err_none(alloc_data(&file, PREALLOC_MIN_CHUNK + 1, &offset));
+    ck_assert_uint_gt(file_size(dump), before);
+    ck_assert_uint_eq((file_size(dump) - before) % PREALLOC_MIN_CHUNK, 0);
+    ck_assert_uint_ge(file_size(dump), offset + PREALLOC_MIN_CHUNK + 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(alloc_data_prealloc_reopen)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(enable_prealloc(&file, PREALLOC_MIN_CHUNK));
+    uint64_t first = 0;
+    ck_assert_err_none(alloc_data(&file, 5000, &first));
+    do_close(&file);
+
+    // The logical end, not the end of the file, is where the next blob goes
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    struct imgfs_ext ext;
+    ck_assert_err_none(read_ext(&file, &ext));
+    ck_assert_uint_eq(ext.data_end, first + 5000);
+    uint64_t next = 0;
+    ck_assert_err_none(alloc_data(&file, 5000, &next));
+    ck_assert_uint_eq(next, first + 5000);
+    ck_assert_uint_lt(next, file_size(dump));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(alloc_data_many_stores)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    // More stores with an extension block and a commit state than there used to be room for
+    enum { NB_STORES = 20 };
+    char names[NB_STORES][4200];
+    struct imgfs_file files[NB_STORES];
+    uint64_t offsets[NB_STORES];
+    ck_assert_err_none(commit_configure(COMMIT_PER_OP, NULL));
+    for (size_t i = 0; i < NB_STORES; ++i) {
+        snprintf(names[i], sizeof(names[i]), "%s%zu", dump, i);
+        DUPLICATE_FILE(names[i], IMGFS("test02"));
+        ck_assert_err_none(do_open(names[i], "rb+", &files[i]));
+        ck_assert_err_none(enable_prealloc(&files[i], PREALLOC_MIN_CHUNK));
+        ck_assert_err_none(alloc_data(&files[i], 1000 + i, &offsets[i]));
+    }
+    for (size_t i = 0; i < NB_STORES; ++i) {
+        struct imgfs_ext ext;
+        ck_assert_err_none(read_ext(&files[i], &ext));
+        ck_assert_uint_eq(ext.data_end, offsets[i] + 1000 + i);
+        do_close(&files[i]);
+    }
+    ck_assert_err_none(commit_configure(COMMIT_DIRECT, NULL));
+
+    // ...and each one kept its own block
+    for (size_t i = 0; i < NB_STORES; ++i) {
+        struct imgfs_file file;
+        struct imgfs_ext ext;
+        ck_assert_err_none(do_open(names[i], "rb", &file));
+        ck_assert_err_none(read_ext(&file, &ext));
+        ck_assert_uint_eq(ext.data_end, offsets[i] + 1000 + i);
+        do_close(&file);
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_prealloc)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    void* image = NULL;
+    size_t image_size = 0;
+    read_file_and_size(&image, DATA_DIR "foret.jpg", &image_size);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(enable_prealloc(&file, PREALLOC_MIN_CHUNK));
+    struct imgfs_ext ext;
+    ck_assert_err_none(read_ext(&file, &ext));
+
+    ck_assert_err_none(do_insert(image, image_size, "foret", &file));
+    ck_assert_uint_eq(file.metadata[2].offset[ORIG_RES], ext.data_end);
+    do_close(&file);
+
+    char* buffer = NULL;
+    uint32_t size = 0;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_read("foret", ORIG_RES, &buffer, &size, &file));
+    ck_assert_uint_eq(size, image_size);
+    ck_assert_mem_eq(buffer, image, size);
+    free(buffer);
+    do_close(&file);
+
+    free(image);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(enable_arena_invalid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    ck_assert_invalid_arg(enable_arena(NULL, ARENA_MIN_SEGMENT));
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_invalid_arg(enable_arena(&file, ARENA_MIN_SEGMENT - 1));
+    ck_assert_uint_eq(file.header.ext_offset, 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(append_derived_arena)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    static char blob[ARENA_MIN_SEGMENT + 1];
+    memset(blob, 'x', sizeof(blob));
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(enable_arena(&file, ARENA_MIN_SEGMENT));
+
+    // The first derived image starts a segment of whole pages, the next ones follow it
+    uint64_t first = 0, second = 0;
+    ck_assert_err_none(append_derived(&file, blob, 1000, &first));
+    ck_assert_uint_eq(first % IMGFS_PAGE_SIZE, 0);
+    ck_assert_err_none(append_derived(&file, blob, 2000, &second));
+    ck_assert_uint_eq(second, first + 1000);
+    ck_assert_uint_ge(file_size(dump), first + ARENA_MIN_SEGMENT);
+
+    // Originals go after the segment
+    uint64_t original = 0;
+    ck_assert_err_none(append_data(&file, blob, 100, &original));
+    ck_assert_uint_ge(original, first + ARENA_MIN_SEGMENT);
+
+    // ...and so does a derived image larger than a segment
+    uint64_t large = 0;
+    ck_assert_err_none(append_derived(&file, blob, ARENA_MIN_SEGMENT + 1, &large));
+    ck_assert_uint_ge(large, original + 100);
+
+    // A derived image that does not fit in the segment starts a new one
+    uint64_t next = 0;
+    ck_assert_err_none(append_derived(&file, blob, ARENA_MIN_SEGMENT - 2000, &next));
+    ck_assert_uint_ge(next, large + ARENA_MIN_SEGMENT + 1);
+    ck_assert_uint_eq(next % IMGFS_PAGE_SIZE, 0);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(append_derived_arena_reopen)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char blob[100];
+    memset(blob, 'y', sizeof(blob));
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(enable_arena(&file, ARENA_MIN_SEGMENT));
+    uint64_t first = 0;
+    ck_assert_err_none(append_derived(&file, blob, sizeof(blob), &first));
+    do_close(&file);
+
+    // The segment is filled on after a reopen, and what was written reads back
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    uint64_t next = 0;
+    ck_assert_err_none(append_derived(&file, blob, sizeof(blob), &next));
+    ck_assert_uint_eq(next, first + sizeof(blob));
+    char read_back[sizeof(blob)];
+    ck_assert_err_none(read_data(&file, first, sizeof(read_back), read_back));
+    ck_assert_mem_eq(read_back, blob, sizeof(blob));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(append_data_direct)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    static char blob[3 * IMGFS_PAGE_SIZE + 100];
+    for (size_t i = 0; i < sizeof(blob); ++i) blob[i] = (char) i;
+    void* papillon = NULL;
+    size_t papillon_size = 0;
+    read_file_and_size(&papillon, DATA_DIR "papillon.jpg", &papillon_size);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    direct_io_configure(IMGFS_PAGE_SIZE);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(direct_applies(&file, sizeof(blob)), 1);
+    ck_assert_int_eq(direct_applies(&file, IMGFS_PAGE_SIZE - 1), 0);
+
+    // Large blobs go to whole aligned blocks, and read back from anywhere
+    uint64_t offset = 0;
+    ck_assert_err_none(append_data(&file, blob, sizeof(blob), &offset));
+    ck_assert_uint_eq(offset % DIRECT_IO_ALIGN, 0);
+    ck_assert_uint_eq(file_size(dump) % DIRECT_IO_ALIGN, 0);
+    char* read_back = malloc(papillon_size);
+    ck_assert_ptr_nonnull(read_back);
+    ck_assert_err_none(read_data(&file, offset, sizeof(blob), read_back));
+    ck_assert_mem_eq(read_back, blob, sizeof(blob));
+    ck_assert_err_none(read_data(&file, PIC1_OFFSET, papillon_size, read_back));
+    ck_assert_mem_eq(read_back, papillon, papillon_size);
+
+    // The descriptor belongs to the FILE* it was opened with
+    FILE* const opened = file.file;
+    file.file = fopen(dump, "rb");
+    ck_assert_ptr_nonnull(file.file);
+    ck_assert_int_eq(direct_applies(&file, sizeof(blob)), 0);
+    fclose(file.file);
+    file.file = opened;
+    do_close(&file);
+    direct_io_configure(0);
+
+    // ...and so does the buffered I/O
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(direct_applies(&file, sizeof(blob)), 0);
+    ck_assert_err_none(read_data(&file, offset, sizeof(blob), read_back));
+    ck_assert_mem_eq(read_back, blob, sizeof(blob));
+    do_close(&file);
+
+    free(read_back);
+    free(papillon);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(append_data_direct_refused)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    static char blob[2 * IMGFS_PAGE_SIZE];
+    memset(blob, 'z', sizeof(blob));
+
+    // Without O_DIRECT, the imgFS opens all the same, fully buffered
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    direct_io_configure(IMGFS_PAGE_SIZE);
+    refuse_direct = 1;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    refuse_direct = 0;
+    ck_assert_int_eq(direct_applies(&file, sizeof(blob)), 0);
+
+    uint64_t offset = 0;
+    ck_assert_err_none(append_data(&file, blob, sizeof(blob), &offset));
+    char read_back[sizeof(blob)];
+    ck_assert_err_none(read_data(&file, offset, sizeof(read_back), read_back));
+    ck_assert_mem_eq(read_back, blob, sizeof(blob));
+    ck_assert_int_eq(direct_write(&file, 0, blob, sizeof(blob)), ERR_INVALID_ARGUMENT);
+    do_close(&file);
+    direct_io_configure(0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_alloc_suite()
+{
+    Suite *s = suite_create("Tests for the placement of blobs");
+
+    Add_Test(s, enable_prealloc_invalid);
+    Add_Test(s, alloc_data_prealloc);
+    Add_Test(s, alloc_data_prealloc_reopen);
+    Add_Test(s, alloc_data_many_stores);
+    Add_Test(s, do_insert_prealloc);
+    Add_Test(s, enable_arena_invalid);
+    Add_Test(s, append_derived_arena);
+    Add_Test(s, append_derived_arena_reopen);
+    Add_Test(s, append_data_direct);
+    Add_Test(s, append_data_direct_refused);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_alloc_suite)
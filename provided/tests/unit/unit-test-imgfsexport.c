@@ -0,0 +1,201 @@
+#include "imgfs.h"
+#include "imgfs_export.h"
+#include "imgfs_import.h"
+#include "test.h"
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+// In test02: pic1 (72876 bytes at 21664, the content of papillon.jpg) and pic2
+#define PIC1_SIZE 72876
+
+static const struct img_metadata* find_image(const struct imgfs_file* file, const char* img_id)
+{
+    for (uint32_t i = 0; i < file->header.max_files; ++i) {
+        if (file->metadata[i].is_valid == NON_EMPTY && strcmp(file->metadata[i].img_id, img_id) == 0) {
+            return &file->metadata[i];
+        }
+    }
+    return NULL;
+}
+
+static off_t file_size(const char* filename)
+{
+    struct stat st;
+    ck_assert_int_eq(stat(filename, &st), 0);
+    return st.st_size;
+}
+
+// The same images, with the same content, in both imgFS
+static void assert_same_images(const struct imgfs_file* source, const struct imgfs_file* copy)
+{
+    ck_assert_uint_eq(copy->header.nb_files, source->header.nb_files);
+    for (uint32_t i = 0; i < source->header.max_files; ++i) {
+        const struct img_metadata* md = &source->metadata[i];
+        if (md->is_valid == EMPTY) continue;
+        const struct img_metadata* copied = find_image(copy, md->img_id);
+        ck_assert_ptr_nonnull(copied);
+        ck_assert_mem_eq(copied->SHA, md->SHA, SHA256_DIGEST_LENGTH);
+        ck_assert_uint_eq(copied->size[ORIG_RES], md->size[ORIG_RES]);
+    }
+}
+
+// ======================================================================
+START_TEST(do_export_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    memset(&file, 0, sizeof(file));
+
+    ck_assert_invalid_arg(do_export_tar(NULL, stdout, 0, NULL));
+    ck_assert_invalid_arg(do_export_tar(&file, stdout, 0, NULL));
+    ck_assert_invalid_arg(do_export_imgfs(NULL, "x", 0, NULL));
+    ck_assert_invalid_arg(do_export_imgfs(&file, "x", 0, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_export_imgfs_compacted)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_copy);
+
+    void* papillon = NULL;
+    size_t papillon_size = 0;
+    read_file_and_size(&papillon, DATA_DIR "papillon.jpg", &papillon_size);
+
+    // A second image sharing the content of pic1, and the hole left by pic2
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_insert(papillon, papillon_size, "papillon", &file));
+    ck_assert_err_none(do_delete("pic2", &file));
+    do_close(&file);
+
+    struct export_stats stats;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err_none(do_export_imgfs(&file, dump_copy, 0, &stats));
+    ck_assert_uint_eq(stats.nb_images, 2);
+
+    struct imgfs_file copy;
+    ck_assert_err_none(do_open(dump_copy, "rb", &copy));
+    assert_same_images(&file, &copy);
+
+    // The shared content is copied once, and the hole is gone
+    const struct img_metadata* pic1 = find_image(&copy, "pic1");
+    ck_assert_uint_eq(find_image(&copy, "papillon")->offset[ORIG_RES], pic1->offset[ORIG_RES]);
+    ck_assert_uint_eq(file_size(dump_copy), pic1->offset[ORIG_RES] + PIC1_SIZE);
+    ck_assert_int_lt(file_size(dump_copy), file_size(dump));
+
+    char* buffer = NULL;
+    uint32_t size = 0;
+    ck_assert_err_none(do_read("papillon", ORIG_RES, &buffer, &size, &copy));
+    ck_assert_uint_eq(size, papillon_size);
+    ck_assert_mem_eq(buffer, papillon, size);
+    free(buffer);
+
+    do_close(&copy);
+    do_close(&file);
+    remove(dump_copy);
+    free(papillon);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_export_imgfs_onto_source)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_link);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    remove(dump_link);
+    ck_assert_int_eq(link(dump, dump_link), 0);
+    const off_t size = file_size(dump);
+
+    // By its own path and by another one
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err(do_export_imgfs(&file, dump, 0, NULL), ERR_INVALID_FILENAME);
+    ck_assert_err(do_export_imgfs(&file, dump_link, 0, NULL), ERR_INVALID_FILENAME);
+    do_close(&file);
+
+    ck_assert_int_eq(file_size(dump), size);
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    do_close(&file);
+    remove(dump_link);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_export_tar_read_back)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(_import);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb", &file));
+
+    FILE* tar = tmpfile();
+    ck_assert_ptr_nonnull(tar);
+    struct export_stats stats;
+    ck_assert_err_none(do_export_tar(&file, tar, 0, &stats));
+    ck_assert_uint_eq(stats.nb_images, 2);
+
+    // The first member: pic1, the first image of the imgFS
+    char block[512];
+    rewind(tar);
+    ck_assert_uint_eq(fread(block, sizeof(block), 1, tar), 1);
+    ck_assert_str_eq(block, "pic1.jpg");
+    ck_assert_mem_eq(block + 257, "ustar", 6);
+    ck_assert_uint_eq(strtoul(block + 124, NULL, 8), PIC1_SIZE);
+
+    // Imported into an empty imgFS, the same images
+    struct imgfs_file imported;
+    DUPLICATE_FILE(dump_import, IMGFS("empty"));
+    ck_assert_err_none(do_open(dump_import, "rb+", &imported));
+    struct import_stats import_stats;
+    rewind(tar);
+    ck_assert_err_none(do_import_tar(tar, &imported, NULL, &import_stats));
+    ck_assert_uint_eq(import_stats.nb_read, 2);
+    ck_assert_uint_eq(import_stats.nb_inserted, 2);
+    ck_assert_uint_eq(import_stats.nb_failed, 0);
+    assert_same_images(&file, &imported);
+
+    do_close(&imported);
+    do_close(&file);
+    fclose(tar);
+    remove(dump_import);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_export_suite()
+{
+    Suite *s = suite_create("Tests for the export of an imgFS");
+
+    Add_Test(s, do_export_null_params);
+    Add_Test(s, do_export_imgfs_compacted);
+    Add_Test(s, do_export_imgfs_onto_source);
+    Add_Test(s, do_export_tar_read_back);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_export_suite)
@@ -0,0 +1,153 @@
+#include "imgfs.h"
+#include "imgfs_fsck.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+
+// In test02: pic1 (72876 bytes at 21664) and pic2 (98119 bytes at 94540)
+#define PIC1_SIZE 72876
+#define PIC2_OFFSET 94540
+#define PIC2_SIZE 98119
+
+static void count_problem(uint32_t index, const char* img_id, const char* problem, void* arg)
+{
+    (void) index;
+    (void) img_id;
+    (void) problem;
+    ++*(size_t*) arg;
+}
+
+// Overwrites one byte of a file
+static void damage_file(const char* filename, long offset)
+{
+    FILE* file = fopen(filename, "rb+");
+    ck_assert_ptr_nonnull(file);
+    ck_assert_int_eq(fseek(file, offset, SEEK_SET), 0);
+    const int c = fgetc(file);
+    ck_assert_int_eq(fseek(file, offset, SEEK_SET), 0);
+    ck_assert_int_ne(fputc(c ^ 0xFF, file), EOF);
+    fclose(file);
+}
+
+// ======================================================================
+START_TEST(do_fsck_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct fsck_report report;
+
+    ck_assert_invalid_arg(do_fsck(NULL, 1, 0, NULL, NULL, &report));
+    ck_assert_invalid_arg(do_fsck(&file, 1, 0, NULL, NULL, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_fsck_consistent)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb", &file));
+
+    size_t nb_problems = 0;
+    struct fsck_report report;
+    ck_assert_err_none(do_fsck(&file, 0, 0, count_problem, &nb_problems, &report));
+
+    ck_assert_uint_eq(nb_problems, 0);
+    ck_assert_uint_eq(report.nb_valid, 2);
+    ck_assert_uint_eq(report.nb_bad_count, 0);
+    ck_assert_uint_eq(report.nb_duplicate_id, 0);
+    ck_assert_uint_eq(report.nb_bad_extent, 0);
+    ck_assert_uint_eq(report.nb_bad_sha, 0);
+    ck_assert_uint_eq(report.nb_bytes, PIC1_SIZE + PIC2_SIZE);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_fsck_corrupted)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    damage_file(dump, PIC2_OFFSET + 1000);
+    ck_assert_err_none(do_open(dump, "rb", &file));
+
+    // A second pic1 sharing its content, and an image past the end of the file
+    file.metadata[2] = file.metadata[0];
+    file.metadata[3] = file.metadata[0];
+    strcpy(file.metadata[3].img_id, "far");
+    file.metadata[3].offset[ORIG_RES] = 1 << 30;
+
+    size_t nb_problems = 0;
+    struct fsck_report report;
+    ck_assert_err_none(do_fsck(&file, 2, 0, count_problem, &nb_problems, &report));
+
+    ck_assert_uint_eq(report.nb_valid, 4);
+    ck_assert_uint_eq(report.nb_bad_count, 1);
+    ck_assert_uint_eq(report.nb_duplicate_id, 1);
+    ck_assert_uint_eq(report.nb_bad_extent, 1);
+    ck_assert_uint_eq(report.nb_bad_sha, 1);
+    ck_assert_uint_eq(nb_problems, 4);
+    ck_assert_int_eq(report.repaired, 0);
+    // The shared content is hashed once
+    ck_assert_uint_eq(report.nb_bytes, PIC1_SIZE + PIC2_SIZE);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_fsck_repair_count)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    file.header.nb_files = 7;
+    struct fsck_report report;
+    ck_assert_err_none(do_fsck(&file, 1, 1, NULL, NULL, &report));
+    ck_assert_uint_eq(report.nb_bad_count, 1);
+    ck_assert_int_eq(report.repaired, 1);
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    ck_assert_err_none(do_fsck(&file, 1, 0, NULL, NULL, &report));
+    ck_assert_uint_eq(report.nb_bad_count, 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_fsck_suite()
+{
+    Suite *s = suite_create("Tests for do_fsck implementation");
+
+    Add_Test(s, do_fsck_null_params);
+    Add_Test(s, do_fsck_consistent);
+    Add_Test(s, do_fsck_corrupted);
+    Add_Test(s, do_fsck_repair_count);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_fsck_suite)
@@ -0,0 +1,216 @@
+#include "imgfs.h"
+#include "imgfs_import.h"
+#include "test.h"
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define TAR_BLOCK 512
+
+// The failures reported by the import
+struct failures {
+    size_t count;
+    char names[4][256];
+    int errors[4];
+};
+
+static void record_failure(const char* name, int error, void* arg)
+{
+    struct failures* failures = arg;
+    if (failures->count < 4) {
+        strncpy(failures->names[failures->count], name, sizeof(failures->names[0]) - 1);
+        failures->errors[failures->count] = error;
+    }
+    failures->count++;
+}
+
+static const struct img_metadata* find_image(const struct imgfs_file* file, const char* img_id)
+{
+    for (uint32_t i = 0; i < file->header.max_files; ++i) {
+        if (file->metadata[i].is_valid == NON_EMPTY && strcmp(file->metadata[i].img_id, img_id) == 0) {
+            return &file->metadata[i];
+        }
+    }
+    return NULL;
+}
+
+// One ustar member; the name need not fit (nor be terminated in) its 100 bytes
+static void tar_member(FILE* tar, const char* name, const char* prefix, char type,
+                       const void* content, size_t size)
+{
+    char block[TAR_BLOCK];
+    memset(block, 0, sizeof(block));
+    memcpy(block, name, strlen(name) < 100 ? strlen(name) : 100);
+    snprintf(block + 100, 8, "%07o", 0644);
+    snprintf(block + 108, 8, "%07o", 0);
+    snprintf(block + 116, 8, "%07o", 0);
+    snprintf(block + 124, 12, "%011lo", (unsigned long) size);
+    snprintf(block + 136, 12, "%011o", 0);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    if (prefix != NULL) memcpy(block + 345, prefix, strlen(prefix));
+
+    memset(block + 148, ' ', 8);
+    unsigned int checksum = 0;
+    for (size_t i = 0; i < sizeof(block); ++i) checksum += (unsigned char) block[i];
+    snprintf(block + 148, 8, "%06o", checksum);
+    ck_assert_uint_eq(fwrite(block, sizeof(block), 1, tar), 1);
+
+    if (size > 0) {
+        static const char zeros[TAR_BLOCK];
+        ck_assert_uint_eq(fwrite(content, size, 1, tar), 1);
+        const size_t padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+        if (padding > 0) ck_assert_uint_eq(fwrite(zeros, padding, 1, tar), 1);
+    }
+}
+
+// ======================================================================
+START_TEST(do_import_tar_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+
+    ck_assert_invalid_arg(do_import_tar(NULL, &file, NULL, NULL));
+    ck_assert_invalid_arg(do_import_tar(stdin, NULL, NULL, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_import_tar_members)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    void* papillon = NULL;
+    size_t papillon_size = 0;
+    read_file_and_size(&papillon, DATA_DIR "papillon.jpg", &papillon_size);
+    void* foret = NULL;
+    size_t foret_size = 0;
+    read_file_and_size(&foret, DATA_DIR "foret.jpg", &foret_size);
+
+    char* archive = NULL;
+    size_t archive_size = 0;
+    FILE* tar = open_memstream(&archive, &archive_size);
+    ck_assert_ptr_nonnull(tar);
+
+    // A directory, to skip
+    tar_member(tar, "album/", NULL, '5', NULL, 0);
+
+    // A name longer than the header, in a GNU long name member before its file
+    char long_name[300] = "album/";
+    for (size_t i = 0; i < 20; ++i) strcat(long_name, "year/");
+    strcat(long_name, "long_papillon.jpg");
+    ck_assert_uint_gt(strlen(long_name), 100);
+    tar_member(tar, "././@LongLink", NULL, 'L', long_name, strlen(long_name) + 1);
+    tar_member(tar, long_name, NULL, '0', papillon, papillon_size);
+
+    // Names split between the prefix and the name fields, the second one taken
+    tar_member(tar, "foret.jpg", "album/2024", '0', foret, foret_size);
+    tar_member(tar, "foret.jpg", "album/2023", '0', papillon, papillon_size);
+
+    // A symbolic link, to skip, and an empty file, to report
+    tar_member(tar, "link.jpg", NULL, '2', NULL, 0);
+    tar_member(tar, "empty.jpg", NULL, '0', NULL, 0);
+
+    static const char end[2 * TAR_BLOCK];
+    ck_assert_uint_eq(fwrite(end, sizeof(end), 1, tar), 1);
+    fclose(tar);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("empty"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    struct failures failures;
+    memset(&failures, 0, sizeof(failures));
+    const struct import_options options = { 1, NULL, record_failure, &failures };
+    struct import_stats stats;
+    tar = fmemopen(archive, archive_size, "rb");
+    ck_assert_ptr_nonnull(tar);
+    ck_assert_err_none(do_import_tar(tar, &file, &options, &stats));
+    fclose(tar);
+
+    ck_assert_uint_eq(stats.nb_read, 3);
+    ck_assert_uint_eq(stats.nb_inserted, 2);
+    ck_assert_uint_eq(stats.nb_failed, 2);
+    ck_assert_uint_eq(stats.nb_bytes, papillon_size * 2 + foret_size);
+
+    // Reported in the order of the archive: the empty file before the flushed batch
+    ck_assert_uint_eq(failures.count, 2);
+    ck_assert_str_eq(failures.names[0], "empty.jpg");
+    ck_assert_err(failures.errors[0], ERR_INVALID_ARGUMENT);
+    ck_assert_str_eq(failures.names[1], "album/2023/foret.jpg");
+    ck_assert_err(failures.errors[1], ERR_DUPLICATE_ID);
+
+    ck_assert_uint_eq(file.header.nb_files, 2);
+    const struct img_metadata* md = find_image(&file, "long_papillon");
+    ck_assert_ptr_nonnull(md);
+    ck_assert_uint_eq(md->size[ORIG_RES], papillon_size);
+    md = find_image(&file, "foret");
+    ck_assert_ptr_nonnull(md);
+    ck_assert_uint_eq(md->size[ORIG_RES], foret_size);
+
+    do_close(&file);
+    free(archive);
+    free(foret);
+    free(papillon);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_import_tar_truncated)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    void* foret = NULL;
+    size_t foret_size = 0;
+    read_file_and_size(&foret, DATA_DIR "foret.jpg", &foret_size);
+
+    // A member cut in its content, with no end-of-archive blocks
+    char* archive = NULL;
+    size_t archive_size = 0;
+    FILE* tar = open_memstream(&archive, &archive_size);
+    ck_assert_ptr_nonnull(tar);
+    tar_member(tar, "foret.jpg", NULL, '0', foret, foret_size);
+    fclose(tar);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("empty"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    struct import_stats stats;
+    tar = fmemopen(archive, TAR_BLOCK + foret_size / 2, "rb");
+    ck_assert_ptr_nonnull(tar);
+    ck_assert_err(do_import_tar(tar, &file, NULL, &stats), ERR_IO);
+    fclose(tar);
+    ck_assert_uint_eq(stats.nb_read, 0);
+    ck_assert_uint_eq(file.header.nb_files, 0);
+
+    do_close(&file);
+    free(archive);
+    free(foret);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_import_suite()
+{
+    Suite *s = suite_create("Tests for the import of a tar stream");
+
+    Add_Test(s, do_import_tar_null_params);
+    Add_Test(s, do_import_tar_members);
+    Add_Test(s, do_import_tar_truncated);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_import_suite)
@@ -1,4 +1,5 @@
 #include "imgfs.h"
+#include "imgfs_commit.h"
 #include "test.h"
 #include <check.h>
 #include <string.h>
@@ -338,6 +339,63 @@ START_TEST(do_insert_write_initializes_metadata)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_insert_paged)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    void* image = NULL;
+    size_t image_size = 0;
+    read_file_and_size(&image, DATA_DIR "foret.jpg", &image_size);
+
+    // Whole metadata pages are written in both modes
+    const int modes[] = { COMMIT_DIRECT, COMMIT_PER_OP };
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+        struct imgfs_file file;
+        memset(&file, 0, sizeof(file));
+        file.header.max_files = 40; // three pages of slots
+        file.header.resized_res[0] = file.header.resized_res[1] = 64;
+        file.header.resized_res[2] = file.header.resized_res[3] = 256;
+        ck_assert_err_none(do_create_revision(dump, &file, IMGFS_REVISION_PAGED));
+        do_close(&file);
+
+        ck_assert_err_none(commit_configure(modes[m], NULL));
+        ck_assert_err_none(do_open(dump, "rb+", &file));
+        // A neighbour in the same page, changed in memory but never committed
+        file.metadata[1].is_valid = NON_EMPTY;
+        strcpy(file.metadata[1].img_id, "ghost");
+        ck_assert_err_none(do_insert(image, image_size, "foret", &file));
+        do_close(&file);
+        ck_assert_err_none(commit_configure(COMMIT_DIRECT, NULL));
+
+        ck_assert_err_none(do_open(dump, "rb", &file));
+        ck_assert_uint_eq(file.header.revision, IMGFS_REVISION_PAGED);
+        ck_assert_uint_eq(file.header.nb_files, 1);
+        ck_assert_uint_eq(metadata_offset(&file.header), IMGFS_PAGE_SIZE);
+        ck_assert_uint_eq(data_offset(&file.header) % IMGFS_PAGE_SIZE, 0);
+        ck_assert_int_eq(file.metadata[0].is_valid, NON_EMPTY);
+        ck_assert_str_eq(file.metadata[0].img_id, "foret");
+        ck_assert_uint_ge(file.metadata[0].offset[ORIG_RES], data_offset(&file.header));
+        for (uint32_t i = 1; i < file.header.max_files; ++i) {
+            ck_assert_int_eq(file.metadata[i].is_valid, EMPTY);
+        }
+
+        char* buffer = NULL;
+        uint32_t size = 0;
+        ck_assert_err_none(do_read("foret", ORIG_RES, &buffer, &size, &file));
+        ck_assert_uint_eq(size, image_size);
+        ck_assert_mem_eq(buffer, image, size);
+        free(buffer);
+        do_close(&file);
+    }
+
+    free(image);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -352,6 +410,7 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, do_insert_valid);
     Add_Test(s, do_insert_write_correct_metadata);
     Add_Test(s, do_insert_write_initializes_metadata);
+    Add_Test(s, do_insert_paged);
 
     return s;
 }
@@ -0,0 +1,292 @@
+#include "imgfs.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <vips/vips.h>
+
+// papillon.jpg is the content of pic1 in test02
+struct batch_images {
+    void* papillon;
+    size_t papillon_size;
+    void* coquelicots;
+    size_t coquelicots_size;
+    void* foret;
+    size_t foret_size;
+};
+
+static void read_images(struct batch_images* images)
+{
+    read_file_and_size(&images->papillon, DATA_DIR "papillon.jpg", &images->papillon_size);
+    read_file_and_size(&images->coquelicots, DATA_DIR "coquelicots.jpg", &images->coquelicots_size);
+    read_file_and_size(&images->foret, DATA_DIR "foret.jpg", &images->foret_size);
+}
+
+static void free_images(struct batch_images* images)
+{
+    free(images->papillon);
+    free(images->coquelicots);
+    free(images->foret);
+}
+
+static const struct img_metadata* find_image(const struct imgfs_file* file, const char* img_id)
+{
+    for (uint32_t i = 0; i < file->header.max_files; ++i) {
+        if (file->metadata[i].is_valid == NON_EMPTY && strcmp(file->metadata[i].img_id, img_id) == 0) {
+            return &file->metadata[i];
+        }
+    }
+    return NULL;
+}
+
+// ======================================================================
+START_TEST(do_insert_batch_null_params)
+{
+    start_test_print;
+
+    struct insert_request request = { "", 0, "pic", 0 };
+    struct imgfs_file file;
+
+    ck_assert_invalid_arg(do_insert_batch(NULL, 1, 1, &file));
+    ck_assert_invalid_arg(do_insert_batch(&request, 1, 1, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_batch_new_images)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct batch_images images;
+    read_images(&images);
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    struct insert_request requests[] = {
+        { images.coquelicots, images.coquelicots_size, "coquelicots", -1 },
+        { images.foret, images.foret_size, "foret", -1 },
+    };
+    ck_assert_err_none(do_insert_batch(requests, 2, 2, &file));
+    ck_assert_err_none(requests[0].result);
+    ck_assert_err_none(requests[1].result);
+    ck_assert_int_eq(file.header.nb_files, 4);
+
+    const struct img_metadata* coquelicots = find_image(&file, "coquelicots");
+    const struct img_metadata* foret = find_image(&file, "foret");
+    ck_assert_ptr_nonnull(coquelicots);
+    ck_assert_ptr_nonnull(foret);
+    ck_assert_uint_eq(coquelicots->size[ORIG_RES], images.coquelicots_size);
+    ck_assert_uint_ne(coquelicots->offset[ORIG_RES], foret->offset[ORIG_RES]);
+    do_close(&file);
+
+    // The images read back as they were given
+    char* buffer = NULL;
+    uint32_t size = 0;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_read("foret", ORIG_RES, &buffer, &size, &file));
+    ck_assert_uint_eq(size, images.foret_size);
+    ck_assert_mem_eq(buffer, images.foret, size);
+    free(buffer);
+    do_close(&file);
+
+    free_images(&images);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_batch_content_dedup)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct batch_images images;
+    read_images(&images);
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // The content of pic1, and the same new content twice
+    struct insert_request requests[] = {
+        { images.papillon, images.papillon_size, "papillon", -1 },
+        { images.foret, images.foret_size, "foret1", -1 },
+        { images.foret, images.foret_size, "foret2", -1 },
+    };
+    ck_assert_err_none(do_insert_batch(requests, 3, 0, &file));
+    for (size_t r = 0; r < 3; ++r) ck_assert_err_none(requests[r].result);
+    ck_assert_int_eq(file.header.nb_files, 5);
+
+    const struct img_metadata* pic1 = find_image(&file, "pic1");
+    const struct img_metadata* papillon = find_image(&file, "papillon");
+    const struct img_metadata* foret1 = find_image(&file, "foret1");
+    const struct img_metadata* foret2 = find_image(&file, "foret2");
+    ck_assert_ptr_nonnull(papillon);
+    ck_assert_ptr_nonnull(foret1);
+    ck_assert_ptr_nonnull(foret2);
+    ck_assert_uint_eq(papillon->offset[ORIG_RES], pic1->offset[ORIG_RES]);
+    ck_assert_uint_eq(foret1->offset[ORIG_RES], foret2->offset[ORIG_RES]);
+    ck_assert_uint_ne(foret1->offset[ORIG_RES], pic1->offset[ORIG_RES]);
+
+    do_close(&file);
+    free_images(&images);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_batch_shared_resolutions)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct batch_images images;
+    read_images(&images);
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // A pic1 with derived images: its copies share them as well
+    file.metadata[0].offset[THUMB_RES] = 94540;
+    file.metadata[0].size[THUMB_RES] = 1000;
+    file.metadata[0].offset[SMALL_RES] = 95540;
+    file.metadata[0].size[SMALL_RES] = 2000;
+    struct insert_request requests[] = {
+        { images.papillon, images.papillon_size, "papillon1", -1 },
+        { images.papillon, images.papillon_size, "papillon2", -1 },
+    };
+    ck_assert_err_none(do_insert_batch(requests, 2, 1, &file));
+    ck_assert_err_none(requests[0].result);
+    ck_assert_err_none(requests[1].result);
+
+    const struct img_metadata* pic1 = find_image(&file, "pic1");
+    const char* const copies[] = { "papillon1", "papillon2" };
+    for (size_t c = 0; c < 2; ++c) {
+        const struct img_metadata* copy = find_image(&file, copies[c]);
+        ck_assert_ptr_nonnull(copy);
+        for (int res = THUMB_RES; res <= ORIG_RES; ++res) {
+            ck_assert_uint_eq(copy->offset[res], pic1->offset[res]);
+            ck_assert_uint_eq(copy->size[res], pic1->size[res]);
+        }
+    }
+
+    do_close(&file);
+    free_images(&images);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_batch_duplicate_id)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct batch_images images;
+    read_images(&images);
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // An ID of the imgFS, and an ID given twice in the batch
+    struct insert_request requests[] = {
+        { images.coquelicots, images.coquelicots_size, "pic1", -1 },
+        { images.coquelicots, images.coquelicots_size, "fleurs", -1 },
+        { images.foret, images.foret_size, "fleurs", -1 },
+    };
+    ck_assert_err_none(do_insert_batch(requests, 3, 1, &file));
+    ck_assert_err(requests[0].result, ERR_DUPLICATE_ID);
+    ck_assert_err_none(requests[1].result);
+    ck_assert_err(requests[2].result, ERR_DUPLICATE_ID);
+    ck_assert_int_eq(file.header.nb_files, 3);
+
+    const struct img_metadata* fleurs = find_image(&file, "fleurs");
+    ck_assert_ptr_nonnull(fleurs);
+    ck_assert_uint_eq(fleurs->size[ORIG_RES], images.coquelicots_size);
+
+    do_close(&file);
+    free_images(&images);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_batch_undercounted)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct batch_images images;
+    read_images(&images);
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // A header that undercounts the slots in use must not hide them from the batch
+    file.header.nb_files = 0;
+    struct insert_request requests[] = {
+        { images.coquelicots, images.coquelicots_size, "pic2", -1 },
+        { images.papillon, images.papillon_size, "papillon", -1 },
+        { images.foret, images.foret_size, "foret", -1 },
+    };
+    ck_assert_err_none(do_insert_batch(requests, 3, 1, &file));
+    ck_assert_err(requests[0].result, ERR_DUPLICATE_ID);
+    ck_assert_err_none(requests[1].result);
+    ck_assert_err_none(requests[2].result);
+    ck_assert_uint_eq(find_image(&file, "papillon")->offset[ORIG_RES], find_image(&file, "pic1")->offset[ORIG_RES]);
+
+    do_close(&file);
+    free_images(&images);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_insert_batch_full)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct batch_images images;
+    read_images(&images);
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("full"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    struct insert_request requests[] = {
+        { images.foret, images.foret_size, "foret", -1 },
+    };
+    ck_assert_err_none(do_insert_batch(requests, 1, 1, &file));
+    ck_assert_err(requests[0].result, ERR_IMGFS_FULL);
+
+    do_close(&file);
+    free_images(&images);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_insert_batch_suite()
+{
+    Suite *s = suite_create("Tests for do_insert_batch implementation");
+
+    Add_Test(s, do_insert_batch_null_params);
+    Add_Test(s, do_insert_batch_new_images);
+    Add_Test(s, do_insert_batch_content_dedup);
+    Add_Test(s, do_insert_batch_shared_resolutions);
+    Add_Test(s, do_insert_batch_duplicate_id);
+    Add_Test(s, do_insert_batch_undercounted);
+    Add_Test(s, do_insert_batch_full);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(imgfs_insert_batch_suite)
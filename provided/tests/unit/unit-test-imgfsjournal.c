@@ -0,0 +1,269 @@
+#include "imgfs.h"
+#include "imgfs_journal.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <unistd.h>
+
+// A copy of pic1 (same content) in slot 2, as do_insert() would journal it
+static void journal_pic3(const char* dump, FILE* journal, uint64_t offset)
+{
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+
+    struct img_metadata md = file.metadata[0];
+    strcpy(md.img_id, "pic3");
+    md.offset[ORIG_RES] = offset;
+    struct imgfs_header header = file.header;
+    header.nb_files++;
+
+    ck_assert_err_none(journal_append(journal, JOURNAL_METADATA, 2, &md, sizeof(md)));
+    ck_assert_err_none(journal_append(journal, JOURNAL_HEADER, 0, &header, sizeof(header)));
+
+    do_close(&file);
+}
+
+static int journal_exists(const char* dump)
+{
+    char path[4200];
+    ck_assert_err_none(journal_path(dump, path, sizeof(path)));
+    return access(path, F_OK) == 0;
+}
+
+// ======================================================================
+START_TEST(journal_replay_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    memset(&file, 0, sizeof(file));
+
+    ck_assert_invalid_arg(journal_replay(NULL, &file, 1));
+    ck_assert_invalid_arg(journal_replay("x", NULL, 1));
+    ck_assert_invalid_arg(journal_replay("x", &file, 1));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_replay_committed)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    FILE* journal = NULL;
+    ck_assert_err_none(journal_open(dump, &journal));
+    journal_pic3(dump, journal, 21664);
+    ck_assert_err_none(journal_commit(journal, 2));
+    fclose(journal);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(file.header.nb_files, 3);
+    ck_assert_int_eq(file.metadata[2].is_valid, NON_EMPTY);
+    ck_assert_str_eq(file.metadata[2].img_id, "pic3");
+    ck_assert_uint_eq(file.metadata[2].offset[ORIG_RES], 21664);
+    do_close(&file);
+
+    // Written to the imgFS, and the journal is gone
+    ck_assert_int_eq(journal_exists(dump), 0);
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 3);
+    ck_assert_str_eq(file.metadata[2].img_id, "pic3");
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_replay_torn_tail)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    FILE* journal = NULL;
+    ck_assert_err_none(journal_open(dump, &journal));
+    journal_pic3(dump, journal, 21664);
+    ck_assert_err_none(journal_commit(journal, 2));
+
+    // A second transaction cut in the middle of its first record
+    struct img_metadata md;
+    memset(&md, 0, sizeof(md));
+    strcpy(md.img_id, "torn");
+    md.is_valid = NON_EMPTY;
+    const long end = ftell(journal);
+    ck_assert_err_none(journal_append(journal, JOURNAL_METADATA, 3, &md, sizeof(md)));
+    ck_assert_err_none(journal_commit(journal, 1));
+    fflush(journal);
+    ck_assert_int_eq(ftruncate(fileno(journal), end + (long) sizeof(struct journal_record) + 10), 0);
+    fclose(journal);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(file.header.nb_files, 3);
+    ck_assert_str_eq(file.metadata[2].img_id, "pic3");
+    ck_assert_int_eq(file.metadata[3].is_valid, EMPTY);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_replay_uncommitted)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    FILE* journal = NULL;
+    ck_assert_err_none(journal_open(dump, &journal));
+    journal_pic3(dump, journal, 21664);
+    fclose(journal);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(file.header.nb_files, 2);
+    ck_assert_int_eq(file.metadata[2].is_valid, EMPTY);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_replay_wrong_count)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    // A commit record that does not count the records before it ends the replay
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    FILE* journal = NULL;
+    ck_assert_err_none(journal_open(dump, &journal));
+    journal_pic3(dump, journal, 21664);
+    ck_assert_err_none(journal_commit(journal, 1));
+    fclose(journal);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(file.header.nb_files, 2);
+    ck_assert_int_eq(file.metadata[2].is_valid, EMPTY);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_replay_content_mismatch)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    // The SHA of pic1 at the offset of pic2: its content never reached the imgFS
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    FILE* journal = NULL;
+    ck_assert_err_none(journal_open(dump, &journal));
+    journal_pic3(dump, journal, 94540);
+    ck_assert_err_none(journal_commit(journal, 2));
+    fclose(journal);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(file.header.nb_files, 2);
+    ck_assert_int_eq(file.metadata[2].is_valid, EMPTY);
+    ck_assert_int_eq(file.metadata[0].is_valid, NON_EMPTY);
+    ck_assert_int_eq(file.metadata[1].is_valid, NON_EMPTY);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_replay_keeps_derived)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    // A committed slot with a thumbnail, synced before the commit record
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    FILE* journal = NULL;
+    ck_assert_err_none(journal_open(dump, &journal));
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    struct img_metadata md = file.metadata[0];
+    md.offset[THUMB_RES] = 94540;
+    md.size[THUMB_RES] = 1000;
+    do_close(&file);
+    ck_assert_err_none(journal_append(journal, JOURNAL_METADATA, 0, &md, sizeof(md)));
+    ck_assert_err_none(journal_commit(journal, 1));
+    fclose(journal);
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], 94540);
+    ck_assert_uint_eq(file.metadata[0].size[THUMB_RES], 1000);
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], 94540);
+    ck_assert_uint_eq(file.metadata[0].size[THUMB_RES], 1000);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(journal_replay_read_only)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    // Applied in memory only: the journal stays for the next writer
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    FILE* journal = NULL;
+    ck_assert_err_none(journal_open(dump, &journal));
+    journal_pic3(dump, journal, 21664);
+    ck_assert_err_none(journal_commit(journal, 2));
+    fclose(journal);
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 3);
+    ck_assert_str_eq(file.metadata[2].img_id, "pic3");
+    do_close(&file);
+    ck_assert_int_eq(journal_exists(dump), 1);
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_int_eq(file.header.nb_files, 3);
+    do_close(&file);
+    ck_assert_int_eq(journal_exists(dump), 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_journal_suite()
+{
+    Suite *s = suite_create("Tests for the replay of the journal");
+
+    Add_Test(s, journal_replay_null_params);
+    Add_Test(s, journal_replay_committed);
+    Add_Test(s, journal_replay_torn_tail);
+    Add_Test(s, journal_replay_uncommitted);
+    Add_Test(s, journal_replay_wrong_count);
+    Add_Test(s, journal_replay_content_mismatch);
+    Add_Test(s, journal_replay_keeps_derived);
+    Add_Test(s, journal_replay_read_only);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_journal_suite)
@@ -1,5 +1,6 @@
 #include "image_content.h"
 #include "imgfs.h"
+#include "imgfs_heap.h"
 #include "test.h"
 #include <check.h>
 #include <vips/vips.h>
@@ -134,6 +135,97 @@ START_TEST(do_read_resize_invalid_mode)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_read_into_null_params)
+{
+    start_test_print;
+
+    struct read_buffer buffer = { NULL, 0 };
+    uint32_t size;
+    struct imgfs_file file;
+
+    ck_assert_invalid_arg(do_read_into(NULL, ORIG_RES, &buffer, &size, &file));
+    ck_assert_invalid_arg(do_read_into("pic1", ORIG_RES, NULL, &size, &file));
+    ck_assert_invalid_arg(do_read_into("pic1", ORIG_RES, &buffer, NULL, &file));
+    ck_assert_invalid_arg(do_read_into("pic1", ORIG_RES, &buffer, &size, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_read_into_reuse)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    char expected_buffer[72876];
+    struct read_buffer buffer = { NULL, 0 };
+    uint32_t size = 0;
+
+    read_file(expected_buffer, DATA_DIR "/papillon.jpg", 72876);
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    // pic2 (98119 bytes) makes the buffer, which pic1 then fits in
+    ck_assert_err_none(do_read_into("pic2", ORIG_RES, &buffer, &size, &file));
+    ck_assert_int_eq(size, 98119);
+    ck_assert_ptr_nonnull(buffer.data);
+    ck_assert_uint_ge(buffer.capacity, 98119);
+    const char* data = buffer.data;
+    const size_t capacity = buffer.capacity;
+
+    struct heap_usage before, after;
+    heap_usage_get(&before);
+    ck_assert_err_none(do_read_into("pic1", ORIG_RES, &buffer, &size, &file));
+    heap_usage_get(&after);
+    ck_assert_uint_eq(after.allocations, before.allocations);
+    ck_assert_ptr_eq(buffer.data, data);
+    ck_assert_uint_eq(buffer.capacity, capacity);
+    ck_assert_int_eq(size, 72876);
+    ck_assert_mem_eq(expected_buffer, buffer.data, 72876);
+
+    // Kept on error
+    ck_assert_err(do_read_into("pic3", ORIG_RES, &buffer, &size, &file), ERR_IMAGE_NOT_FOUND);
+    ck_assert_ptr_eq(buffer.data, data);
+    ck_assert_uint_eq(buffer.capacity, capacity);
+
+    read_buffer_free(&buffer);
+    ck_assert_ptr_null(buffer.data);
+    ck_assert_uint_eq(buffer.capacity, 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_read_into_grow)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    char expected_buffer[72876];
+    struct read_buffer buffer = { NULL, 0 };
+    uint32_t size = 0;
+
+    read_file(expected_buffer, DATA_DIR "/papillon.jpg", 72876);
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    // A buffer too small for the image is grown
+    ck_assert_err_none(read_buffer_reserve(&buffer, 100));
+    ck_assert_uint_ge(buffer.capacity, 100);
+    ck_assert_err_none(do_read_into("pic1", ORIG_RES, &buffer, &size, &file));
+    ck_assert_uint_ge(buffer.capacity, 72876);
+    ck_assert_int_eq(size, 72876);
+    ck_assert_mem_eq(expected_buffer, buffer.data, 72876);
+
+    read_buffer_free(&buffer);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_read_test_suite()
 {
@@ -144,6 +236,9 @@ Suite *imgfs_read_test_suite()
     Add_Test(s, do_read_valid);
     Add_Test(s, do_read_resize);
     Add_Test(s, do_read_resize_invalid_mode);
+    Add_Test(s, do_read_into_null_params);
+    Add_Test(s, do_read_into_reuse);
+    Add_Test(s, do_read_into_grow);
 
     return s;
 }
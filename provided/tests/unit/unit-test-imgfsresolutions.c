@@ -2,6 +2,7 @@
 #include "imgfs.h"
 #include "test.h"
 #include <check.h>
+#include <string.h>
 #include <vips/vips.h>
 
 // ======================================================================
@@ -52,6 +53,111 @@ START_TEST(get_resolution_valid)
 }
 END_TEST
 
+// ======================================================================
+// Headers of JPEG streams, read by get_resolution() without decoding
+
+// SOI, APP0 (JFIF), then a baseline SOF0 of 480 x 640
+static const unsigned char jpeg_header[] = {
+    0xFF, 0xD8,
+    0xFF, 0xE0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+    0xFF, 0xC0, 0x00, 0x11, 0x08, 0x01, 0xE0, 0x02, 0x80, 0x03,
+    0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01
+};
+
+START_TEST(get_resolution_jpeg_header)
+{
+    start_test_print;
+
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, (const char*) jpeg_header, sizeof(jpeg_header)));
+
+    ck_assert_uint_eq(height, 480);
+    ck_assert_uint_eq(width, 640);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(get_resolution_jpeg_truncated)
+{
+    start_test_print;
+
+    // Cut anywhere before the end of the SOF0
+    uint32_t height = 0, width = 0;
+    for (size_t size = 0; size < sizeof(jpeg_header); ++size) {
+        ck_assert_err(get_resolution(&height, &width, (const char*) jpeg_header, size), ERR_IMGLIB);
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(get_resolution_jpeg_odd_markers)
+{
+    start_test_print;
+
+    // Fill bytes, markers without payload, then a DHT (C4) that must not be
+    // taken for a SOF, before a progressive SOF2 of 300 x 200
+    static const unsigned char stream[] = {
+        0xFF, 0xD8,
+        0xFF, 0xFF, 0xFF, 0x01,
+        0xFF, 0xD3,
+        0xFF, 0xC4, 0x00, 0x07, 0x00, 0x11, 0x11, 0x22, 0x22,
+        0xFF, 0xC2, 0x00, 0x0B, 0x08, 0x01, 0x2C, 0x00, 0xC8, 0x01, 0x01, 0x11, 0x00
+    };
+
+    uint32_t height = 0, width = 0;
+    ck_assert_err_none(get_resolution(&height, &width, (const char*) stream, sizeof(stream)));
+
+    ck_assert_uint_eq(height, 300);
+    ck_assert_uint_eq(width, 200);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(get_resolution_jpeg_invalid_headers)
+{
+    start_test_print;
+
+    uint32_t height = 0, width = 0;
+
+    // Start of scan before any SOF
+    static const unsigned char no_sof[] = {
+        0xFF, 0xD8, 0xFF, 0xDA, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00, 0xFF, 0xD9
+    };
+    ck_assert_err(get_resolution(&height, &width, (const char*) no_sof, sizeof(no_sof)), ERR_IMGLIB);
+
+    // Height left to a DNL marker
+    unsigned char dnl[sizeof(jpeg_header)];
+    memcpy(dnl, jpeg_header, sizeof(dnl));
+    dnl[25] = dnl[26] = 0;
+    ck_assert_err(get_resolution(&height, &width, (const char*) dnl, sizeof(dnl)), ERR_IMGLIB);
+
+    // A segment longer than the stream
+    unsigned char too_long[sizeof(jpeg_header)];
+    memcpy(too_long, jpeg_header, sizeof(too_long));
+    too_long[4] = 0x7F;
+    ck_assert_err(get_resolution(&height, &width, (const char*) too_long, sizeof(too_long)), ERR_IMGLIB);
+
+    // A segment length shorter than its own length field
+    unsigned char too_short[sizeof(jpeg_header)];
+    memcpy(too_short, jpeg_header, sizeof(too_short));
+    too_short[5] = 0x01;
+    too_short[4] = 0x00;
+    ck_assert_err(get_resolution(&height, &width, (const char*) too_short, sizeof(too_short)), ERR_IMGLIB);
+
+    // No SOI
+    ck_assert_err(get_resolution(&height, &width, (const char*) jpeg_header + 2, sizeof(jpeg_header) - 2),
+                  ERR_IMGLIB);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_get_resolution_test_suite()
 {
@@ -60,6 +166,10 @@ Suite *imgfs_get_resolution_test_suite()
     Add_Test(s, get_resolution_null);
     Add_Test(s, get_resolution_invalid_buffer);
     Add_Test(s, get_resolution_valid);
+    Add_Test(s, get_resolution_jpeg_header);
+    Add_Test(s, get_resolution_jpeg_truncated);
+    Add_Test(s, get_resolution_jpeg_odd_markers);
+    Add_Test(s, get_resolution_jpeg_invalid_headers);
 
     return s;
 }